@@ -1,33 +1,72 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <concepts>
+#include <cstdint>
 #include <memory>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 #include <variant>
 #include <vector>
 
+#include "Arena.hpp"
+#include "Symbols.hpp"
+
 namespace ast {
 
     struct IfExpression;
-    using IfExpressionPtr = std::unique_ptr<IfExpression>;
+    using IfExpressionPtr = NodePtr<IfExpression>;
     struct UnaryOpExpression;
-    using UnaryOpExpressionPtr = std::unique_ptr<UnaryOpExpression>;
+    using UnaryOpExpressionPtr = NodePtr<UnaryOpExpression>;
     struct BinaryOpExpression;
-    using BinaryOpExpressionPtr = std::unique_ptr<BinaryOpExpression>;
+    using BinaryOpExpressionPtr = NodePtr<BinaryOpExpression>;
     struct FunctionCallExpression;
-    using FunctionCallExpressionPtr = std::unique_ptr<FunctionCallExpression>;
+    using FunctionCallExpressionPtr = NodePtr<FunctionCallExpression>;
     struct LiteralExpression;
-    using LiteralExpressionPtr = std::unique_ptr<LiteralExpression>;
+    using LiteralExpressionPtr = NodePtr<LiteralExpression>;
     struct ArrayRangeExpression;
-    using ArrayRangeExpressionPtr = std::unique_ptr<ArrayRangeExpression>;
+    using ArrayRangeExpressionPtr = NodePtr<ArrayRangeExpression>;
     struct ComponentExpression;
-    using ComponentExpressionPtr = std::unique_ptr<ComponentExpression>;
+    using ComponentExpressionPtr = NodePtr<ComponentExpression>;
+
+    // Bytes [m_begin, m_end) of the source text a node was parsed from: from its first token to the end of its last,
+    // which may take in a trailing comment. Line and column are only worked out when needed, see LineIndex.
+    // Nodes that were not parsed, such as those made by rewriting a tree, have an empty span.
+    struct SourceSpan
+    {
+        std::uint32_t m_begin = 0;
+        std::uint32_t m_end = 0;
+
+        bool Empty() const
+        {
+            return m_begin == m_end;
+        }
+    };
+
+    // Covers both spans; an empty span counts as unknown and is ignored.
+    inline SourceSpan join(SourceSpan a, SourceSpan b)
+    {
+        if (a.Empty()) {
+            return b;
+        }
+        if (b.Empty()) {
+            return a;
+        }
+        return SourceSpan{ std::min(a.m_begin, b.m_begin), std::max(a.m_end, b.m_end) };
+    }
 
     struct Expression
     {
         Expression(const Expression& other) = delete;
         Expression(Expression&& other) = default;
+        ~Expression();
         Expression& operator=(const Expression& other) = delete;
         Expression& operator=(Expression&& other) = default;
 
@@ -47,6 +86,7 @@ namespace ast {
             : m_expr(std::move(e)) {};
 
         std::variant<IfExpressionPtr, UnaryOpExpressionPtr, BinaryOpExpressionPtr, FunctionCallExpressionPtr, LiteralExpressionPtr, ArrayRangeExpressionPtr, ComponentExpressionPtr> m_expr;
+        SourceSpan m_span; // of the node held, kept here rather than in every node type
     };
 
     struct IfExpression
@@ -117,14 +157,84 @@ namespace ast {
         std::optional<Expression> m_subscript;
     };
 
-    struct ComponentReference
+    // Dotted name with optional subscripts on each part, e.g. a.b[1].c. Up to InlineParts unsubscripted parts are
+    // stored inline, which covers the common x and a.b without any allocation; longer or subscripted names spill
+    // all parts to the heap.
+    class ComponentReference
     {
-        ComponentReference(const std::string& name)
-            : m_parts({ std::pair(name, std::vector<ArraySubscript>{}) }), m_global(false) {};
-        ComponentReference(std::vector<std::pair<std::string, std::vector<ArraySubscript>>>&& parts, bool global)
-            : m_parts(parts), m_global(global) {};
-        std::vector<std::pair<std::string, std::vector<ArraySubscript>>> m_parts;
-        bool m_global;
+    public:
+        struct Part
+        {
+            Symbol m_name;
+            std::vector<ArraySubscript> m_subscripts;
+        };
+
+        static constexpr std::size_t InlineParts = 2;
+
+        ComponentReference() = default;
+        explicit ComponentReference(Symbol name)
+            : m_inline{ name }, m_inlineCount(1) {}
+
+        void Append(Symbol name)
+        {
+            if (m_spill == nullptr && m_inlineCount < InlineParts) {
+                m_inline[m_inlineCount++] = name;
+                return;
+            }
+            Spill().push_back(Part{ name, {} });
+        }
+
+        // Adds a subscript to the last part.
+        void AddSubscript(ArraySubscript&& subscript)
+        {
+            assert(Size() > 0);
+            Spill().back().m_subscripts.push_back(std::move(subscript));
+        }
+
+        std::size_t Size() const
+        {
+            return m_spill != nullptr ? m_spill->size() : m_inlineCount;
+        }
+
+        Symbol Name(std::size_t i) const
+        {
+            return m_spill != nullptr ? (*m_spill)[i].m_name : m_inline[i];
+        }
+
+        std::span<const ArraySubscript> Subscripts(std::size_t i) const
+        {
+            if (m_spill == nullptr) {
+                return {};
+            }
+            return (*m_spill)[i].m_subscripts;
+        }
+
+        std::span<ArraySubscript> Subscripts(std::size_t i)
+        {
+            if (m_spill == nullptr) {
+                return {};
+            }
+            return (*m_spill)[i].m_subscripts;
+        }
+
+        bool m_global = false;
+
+    private:
+        std::vector<Part>& Spill()
+        {
+            if (m_spill == nullptr) {
+                m_spill = std::make_unique<std::vector<Part>>();
+                m_spill->reserve(m_inlineCount + 1);
+                for (std::uint8_t i = 0; i < m_inlineCount; ++i) {
+                    m_spill->push_back(Part{ m_inline[i], {} });
+                }
+            }
+            return *m_spill;
+        }
+
+        std::array<Symbol, InlineParts> m_inline{};
+        std::uint8_t m_inlineCount = 0;
+        std::unique_ptr<std::vector<Part>> m_spill;
     };
 
     struct FunctionCallExpression
@@ -136,6 +246,23 @@ namespace ast {
         std::vector<Expression> m_arguments;
     };
 
+    // Text of a string literal: a view into the parsed source when the literal has no escapes,
+    // otherwise an owned copy with the escapes already resolved.
+    struct SourceString
+    {
+        explicit SourceString(std::string_view raw)
+            : m_text(raw) {}
+        explicit SourceString(std::string&& unescaped)
+            : m_text(std::move(unescaped)) {}
+
+        std::string_view View() const
+        {
+            return std::visit([](auto& text) { return std::string_view(text); }, m_text);
+        }
+
+        std::variant<std::string_view, std::string> m_text;
+    };
+
     enum class LiteralType
     {
         Real,
@@ -159,11 +286,11 @@ namespace ast {
         LiteralExpression(bool b)
             : m_type(LiteralType::Boolean), m_value(b) {}
 
-        LiteralExpression(std::string&& s)
+        LiteralExpression(SourceString&& s)
             : m_type(LiteralType::String), m_value(std::move(s)) {}
 
         LiteralType m_type;
-        std::variant<double, int, bool, std::string> m_value;
+        std::variant<double, int, bool, SourceString> m_value;
     };
 
     struct ArrayRangeExpression
@@ -182,8 +309,142 @@ namespace ast {
     struct ComponentExpression
     {
         ComponentExpression(ComponentReference&& ref)
-            : m_componentRef(ref) {};
+            : m_componentRef(std::move(ref)) {};
         ComponentReference m_componentRef;
     };
 
+    struct ElementModification;
+
+    struct ClassModification
+    {
+        // The first argument with the given (undotted) name, or nullptr.
+        const ElementModification* Find(std::string_view name) const;
+
+        std::vector<ElementModification> m_arguments;
+    };
+
+    // One argument of a class modification: 'each'/'final' flags, a dotted name, optional nested arguments, an optional
+    // value and an optional description.
+    struct ElementModification
+    {
+        bool m_each = false;
+        bool m_final = false;
+        std::vector<Symbol> m_name;
+        std::optional<ClassModification> m_modification;
+        std::optional<Expression> m_value;
+        std::optional<SourceString> m_description;
+    };
+
+    inline const ElementModification* ClassModification::Find(std::string_view name) const
+    {
+        for (auto& arg : m_arguments) {
+            if (arg.m_name.size() == 1 && name_of(arg.m_name.front()) == name) {
+                return &arg;
+            }
+        }
+        return nullptr;
+    }
+
+    // The source text of an annotation's class modification, parentheses included. Annotations are skipped unparsed,
+    // since simulation never looks at them; parse_annotation builds the ClassModification when a tool needs it.
+    struct Annotation
+    {
+        std::string_view m_body;
+    };
+
+    // The description string and annotation following a declaration, equation or top level expression.
+    struct Description
+    {
+        std::optional<SourceString> m_text;
+        std::optional<Annotation> m_annotation;
+    };
+
+
+    // Calls fn on every direct child expression of e, in source order: operands, call arguments, range bounds and the
+    // subscripts of component references. E is Expression or const Expression, and the children have the same constness.
+    template <typename E, typename Fn>
+        requires std::same_as<std::remove_const_t<E>, Expression>
+    void for_each_child(E& e, Fn&& fn)
+    {
+        auto subscripts = [&](auto& ref) {
+            for (std::size_t i = 0; i < ref.Size(); ++i) {
+                for (auto& s : ref.Subscripts(i)) {
+                    if (s.m_subscript.has_value()) {
+                        fn(s.m_subscript.value());
+                    }
+                }
+            }
+        };
+        std::visit([&](auto& ptr) {
+            if (ptr == nullptr) {
+                return;
+            }
+            // NodePtr does not propagate constness to the node, so do it here
+            auto& node = [&]() -> auto& {
+                if constexpr (std::is_const_v<E>) {
+                    return std::as_const(*ptr);
+                }
+                else {
+                    return *ptr;
+                }
+            }();
+            using Node = std::remove_cvref_t<decltype(node)>;
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                fn(node.m_condition);
+                fn(node.m_then);
+                fn(node.m_else);
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                fn(node.m_operand);
+            }
+            else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                fn(node.m_left);
+                fn(node.m_right);
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                subscripts(node.m_functionName);
+                for (auto& arg : node.m_arguments) {
+                    fn(arg);
+                }
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                fn(node.m_start);
+                if (node.m_step.has_value()) {
+                    fn(node.m_step.value());
+                }
+                fn(node.m_stop);
+            }
+            else if constexpr (std::is_same_v<Node, ComponentExpression>) {
+                subscripts(node.m_componentRef);
+            }
+        }, e.m_expr);
+    }
+
+    // Destroying a node destroys its child expressions, so letting the NodePtrs recurse would take one chain of
+    // destructor frames per tree level, and a left-deep sum of ten thousand terms would overflow the stack.
+    // Instead the children are moved out to a worklist and the node is destroyed once it has none left.
+    inline Expression::~Expression()
+    {
+        bool leaf = std::visit([](auto& ptr) {
+            using Node = typename std::remove_cvref_t<decltype(ptr)>::element_type;
+            return ptr == nullptr || std::is_same_v<Node, LiteralExpression>;
+        }, m_expr);
+        if (leaf) {
+            return;
+        }
+        std::vector<Expression> pending;
+        auto detach = [&pending](Expression& child) {
+            bool empty = std::visit([](auto& ptr) { return ptr == nullptr; }, child.m_expr);
+            if (!empty) {
+                pending.push_back(std::move(child));
+            }
+        };
+        for_each_child(*this, detach);
+        while (!pending.empty()) {
+            Expression e = std::move(pending.back());
+            pending.pop_back();
+            for_each_child(e, detach);
+        }
+    }
+
 }
\ No newline at end of file
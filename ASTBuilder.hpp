@@ -1,124 +1,109 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
 #include "AST.hpp"
 #include "Grammar.hpp"
 
 namespace ast {
 
-	class BuilderException : std::exception
-	{
-	public:
-		BuilderException(const char* err)
-			: std::exception(err) {};
-	};
-
+	// Builders never throw: the first error is recorded and the builder is marked failed. A failed builder gets no
+	// further input; builder_action reports its error at the start of its rule and fails the enclosing builder, so that
+	// one error gives one diagnostic and the parse goes on.
 	class BaseBuilder
 	{
 	public:
 		template <typename nodetype>
 		void Node(nodetype&& expr)
 		{
-			m_error.emplace(BuilderException("unexpected Expression"));
+			Fail("unexpected Expression");
 		}
 
 		template <typename rule>
 		void Terminal()
 		{
-			m_error.emplace(BuilderException("unexpected rule notify"));
+			Fail("unexpected rule notify");
 		}
 
 		void Real(double d)
 		{
-			m_error.emplace(BuilderException("unexpected Real"));
+			Fail("unexpected Real");
 		}
 
 		void Integer(int i)
 		{
-			m_error.emplace(BuilderException("unexpected Integer"));
+			Fail("unexpected Integer");
 		}
 
 		void Boolean(bool b)
 		{
-			m_error.emplace(BuilderException("unexpected Boolean"));
+			Fail("unexpected Boolean");
+		}
+
+		void String(SourceString&& s)
+		{
+			Fail("unexpected String");
 		}
 
-		void String(std::string&& s)
+		void Ident(Symbol s)
 		{
-			m_error.emplace(BuilderException("unexpected String"));
+			Fail("unexpected identifier");
 		}
 
-		void Ident(std::string&& s)
+		void AnnotationBody(std::string_view body)
 		{
-			m_error.emplace(BuilderException("unexpected identifier"));
+			Fail("unexpected annotation");
 		}
 
-	protected:
-		void CheckError()
+		bool Failed() const
 		{
-			if (m_error.has_value()) {
-				throw m_error.value();
+			return m_failed;
+		}
+
+		// The error detected by this builder itself, or nullptr if it failed because a nested rule failed.
+		const char* Error() const
+		{
+			return m_error;
+		}
+
+		void Fail(const char* error = nullptr)
+		{
+			if (!m_failed) {
+				m_failed = true;
+				m_error = error;
 			}
 		}
+
 	private:
-		std::optional<BuilderException> m_error;
+		bool m_failed = false;
+		const char* m_error = nullptr;
 	};
 
+	// Builds the operator part of an expression (simple_expression in the grammar) by precedence climbing.
+	// The grammar rules below simple_expression have no builders of their own: their operands arrive here as a flat
+	// stream of primaries and operator terminals, and the grammar already guarantees the stream is well formed,
+	// so the builder only has to apply precedence and left associativity to produce the same tree the rules describe.
 	class ExpressionBuilder : public BaseBuilder
 	{
 	public:
 		void Node(Expression&& expr)
 		{
-			switch (m_state) {
-			case Base:
-				if (m_temp_expr.has_value()) {
-					throw BuilderException("already has expression");
-				}
-				m_temp_expr.emplace(std::move(expr));
-				break;
-			case UnOp:
-				if (m_temp_expr.has_value()) {
-					throw BuilderException("should not have expression before unary operator");
-				}
-				m_temp_expr.emplace(UnaryOpExpressionPtr(new UnaryOpExpression(m_unop.value(), std::move(expr))));
-				m_unop.reset();
-				m_state = Base;
-				break;
-			case BinOp:
-				if (!m_temp_expr.has_value()) {
-					throw BuilderException("should have expression before binary operator");
-				}
-				m_temp_expr.emplace(BinaryOpExpressionPtr(new BinaryOpExpression(m_binop.value(), std::move(m_temp_expr.value()), std::move(expr))));
-				m_binop.reset();
-				m_state = Base;
-				break;
-			case ArrayRange:
-				if (!m_temp_expr.has_value()) {
-					throw BuilderException("should have first expression for array range");
-				}
-				if (m_temp_expr_2.has_value()) {
-					m_temp_expr.emplace(ArrayRangeExpressionPtr(new ArrayRangeExpression(std::move(m_temp_expr.value()), std::move(m_temp_expr_2.value()), std::move(expr))));
-					m_temp_expr_2.reset();
-					m_state = Base;
-				}
-				else {
-					m_temp_expr_2.emplace(std::move(expr));
-				}
-				break;
-			case ComponentOrFunctionCall:
-			case FunctionCall:
-
-			default:
-				throw BuilderException("invalid state for expression");
+			if (m_expect_operator) {
+				return Fail("should not have two expressions without operator");
 			}
+			if (m_operand_count == MaxPending) {
+				return Fail("expression nesting too deep");
+			}
+			m_operands[m_operand_count++].emplace(std::move(expr));
+			m_expect_operator = true;
 		}
 
-		void Node(ComponentReference&& ref)
+		// Offset of the operator terminal that follows; the span of a unary operation starts at its operator.
+		void OperatorAt(std::uint32_t offset)
 		{
-			if (m_state != Base) {
-				throw BuilderException("invalid state for component reference");
-			}
-			m_state = ComponentOrFunctionCall;
-			m_component.emplace(std::move(ref));
+			m_operator_at = offset;
 		}
 
 		template <typename rule>
@@ -129,392 +114,350 @@ namespace ast {
 
 		template <>	void Terminal<SYMBOL_colon>()
 		{
-			if (m_state == Base) {
-				if (!m_temp_expr.has_value()) {
-					throw BuilderException("should have an expression before ':'");
-				}
-				m_state = ArrayRange;
-			}
-			else if (m_state == ArrayRange) {
-				if (!m_temp_expr_2.has_value()) {
-					throw BuilderException("should have two expressions before second ':'");
-				}
-			}
-			else {
-				throw BuilderException("unexpected state for ':'");
-			}
+			if (!m_expect_operator) {
+				return Fail("should have an expression before ':'");
+			}
+			if (m_range_count == 2) {
+				return Fail("too many ':' in array range");
+			}
+			Reduce(0);
+			m_range[m_range_count++].emplace(PopOperand());
+			m_expect_operator = false;
+		}
+
+		template <>	void Terminal<KEYWORD_or>() { Binary(BinaryOp::Or, "no unary 'or'"); }
+		template <>	void Terminal<KEYWORD_and>() { Binary(BinaryOp::And, "no unary 'and'"); }
+		template <>	void Terminal<KEYWORD_not>() { Unary(UnaryOp::Not, "no binary 'not'"); }
+		template <>	void Terminal<SYMBOL_equal>() { Binary(BinaryOp::Equal, "no unary '=='"); }
+		template <>	void Terminal<SYMBOL_not_equal>() { Binary(BinaryOp::NotEqual, "no unary '<>'"); }
+		template <>	void Terminal<SYMBOL_less_equal>() { Binary(BinaryOp::LessEqual, "no unary '<='"); }
+		template <>	void Terminal<SYMBOL_less>() { Binary(BinaryOp::Less, "no unary '<'"); }
+		template <>	void Terminal<SYMBOL_greater_equal>() { Binary(BinaryOp::GreaterEqual, "no unary '>='"); }
+		template <>	void Terminal<SYMBOL_greater>() { Binary(BinaryOp::Greater, "no unary '>'"); }
+		template <>	void Terminal<SYMBOL_plus>() { BinaryOrUnary(BinaryOp::Add, UnaryOp::Plus); }
+		template <>	void Terminal<SYMBOL_minus>() { BinaryOrUnary(BinaryOp::Sub, UnaryOp::Minus); }
+		template <>	void Terminal<SYMBOL_dot_plus>() { BinaryOrUnary(BinaryOp::AddElemWise, UnaryOp::DotPlus); }
+		template <>	void Terminal<SYMBOL_dot_minus>() { BinaryOrUnary(BinaryOp::SubElemWise, UnaryOp::DotMinus); }
+		template <>	void Terminal<SYMBOL_star>() { Binary(BinaryOp::Mul, "no unary '*'"); }
+		template <>	void Terminal<SYMBOL_slash>() { Binary(BinaryOp::Div, "no unary '/'"); }
+		template <>	void Terminal<SYMBOL_dot_star>() { Binary(BinaryOp::MulElemWise, "no unary '.*'"); }
+		template <>	void Terminal<SYMBOL_dot_slash>() { Binary(BinaryOp::DivElemWise, "no unary './'"); }
+		template <>	void Terminal<SYMBOL_pow>() { Binary(BinaryOp::Pow, "no unary '^'"); }
+		template <>	void Terminal<SYMBOL_dot_pow>() { Binary(BinaryOp::PowElemWise, "no unary '.^'"); }
+
+		std::optional<Expression> Build()
+		{
+			if (m_operand_count == 0) {
+				Fail("can't build empty expression");
+				return std::nullopt;
+			}
+			if (!m_expect_operator) {
+				Fail("can't build incomplete expression");
+				return std::nullopt;
+			}
+			Reduce(0);
+			if (m_range_count == 0) {
+				return PopOperand();
+			}
+			Expression stop = PopOperand();
+			SourceSpan span = join(m_range[0]->m_span, stop.m_span);
+			Expression range = m_range_count == 1
+				? Expression(make<ArrayRangeExpression>(std::move(m_range[0].value()), std::move(stop)))
+				: Expression(make<ArrayRangeExpression>(std::move(m_range[0].value()), std::move(m_range[1].value()), std::move(stop)));
+			range.m_span = span;
+			return range;
 		}
 
-		template <>	void Terminal<KEYWORD_or>()
-		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for 'or'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Or;
-			}
-			else {
-				throw BuilderException("no unary 'or'");
-			}
-		}
+	private:
+		// Binding strength of the operator levels of the grammar, loosest first. A unary 'not' takes a relation as operand,
+		// a leading unary +/- the first term of an arithmetic expression.
+		enum Precedence {
+			LogicalOr = 1,
+			LogicalAnd,
+			LogicalNot,
+			Relational,
+			Additive,
+			Multiplicative,
+			Power,
+		};
 
-		template <>	void Terminal<KEYWORD_and>()
-		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for 'and'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::And;
-			}
-			else {
-				throw BuilderException("no unary 'and'");
+		static Precedence PrecedenceOf(BinaryOp op)
+		{
+			switch (op) {
+			case BinaryOp::Or:
+				return LogicalOr;
+			case BinaryOp::And:
+				return LogicalAnd;
+			case BinaryOp::Less:
+			case BinaryOp::LessEqual:
+			case BinaryOp::Greater:
+			case BinaryOp::GreaterEqual:
+			case BinaryOp::Equal:
+			case BinaryOp::NotEqual:
+				return Relational;
+			case BinaryOp::Add:
+			case BinaryOp::Sub:
+			case BinaryOp::AddElemWise:
+			case BinaryOp::SubElemWise:
+				return Additive;
+			case BinaryOp::Mul:
+			case BinaryOp::Div:
+			case BinaryOp::MulElemWise:
+			case BinaryOp::DivElemWise:
+				return Multiplicative;
+			default:
+				return Power;
 			}
 		}
 
-		template <>	void Terminal<KEYWORD_not>()
+		struct PendingOperator
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for 'not'");
-			}
-			if (m_temp_expr.has_value()) {
-				throw BuilderException("no binary 'not'");
-			}
-			else {
-				m_state = UnOp;
-				m_unop = UnaryOp::Not;
-			}
-		}
+			Precedence m_precedence;
+			bool m_unary;
+			BinaryOp m_binop;
+			UnaryOp m_unop;
+			std::uint32_t m_begin; // of a unary operator
+		};
 
-		template <>	void Terminal<SYMBOL_equal>()
+		void Binary(BinaryOp op, const char* unaryError)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '=='");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Equal;
-			}
-			else {
-				throw BuilderException("no unary '=='");
+			if (!m_expect_operator) {
+				return Fail(unaryError);
 			}
+			Precedence precedence = PrecedenceOf(op);
+			Reduce(precedence);
+			PushOperator({ precedence, false, op, UnaryOp::Plus, 0 });
+			m_expect_operator = false;
 		}
 
-		template <>	void Terminal<SYMBOL_not_equal>()
+		void Unary(UnaryOp op, const char* binaryError)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '<>'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::NotEqual;
-			}
-			else {
-				throw BuilderException("no unary '<>'");
+			if (m_expect_operator) {
+				return Fail(binaryError);
 			}
+			PushOperator({ op == UnaryOp::Not ? LogicalNot : Additive, true, BinaryOp::Add, op, m_operator_at });
 		}
 
-		template <>	void Terminal<SYMBOL_less_equal>()
+		void BinaryOrUnary(BinaryOp binop, UnaryOp unop)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '<='");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::LessEqual;
+			if (m_expect_operator) {
+				Binary(binop, nullptr);
 			}
 			else {
-				throw BuilderException("no unary '<='");
+				Unary(unop, nullptr);
 			}
 		}
 
-		template <>	void Terminal<SYMBOL_less>()
+		void PushOperator(PendingOperator op)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '<'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Less;
-			}
-			else {
-				throw BuilderException("no unary '<'");
+			if (m_operator_count == MaxPending) {
+				return Fail("expression nesting too deep");
 			}
+			m_operators[m_operator_count++] = op;
 		}
 
-		template <>	void Terminal<SYMBOL_greater_equal>()
+		Expression PopOperand()
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '>='");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::GreaterEqual;
-			}
-			else {
-				throw BuilderException("no unary '>='");
-			}
+			Expression expr = std::move(m_operands[--m_operand_count].value());
+			m_operands[m_operand_count].reset();
+			return expr;
 		}
 
-		template <>	void Terminal<SYMBOL_greater>()
+		// Applies all pending operators binding at least as tightly as the given precedence.
+		void Reduce(int precedence)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '>'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Greater;
-			}
-			else {
-				throw BuilderException("no unary '>'");
+			while (m_operator_count > 0 && m_operators[m_operator_count - 1].m_precedence >= precedence) {
+				PendingOperator op = m_operators[--m_operator_count];
+				if (op.m_unary) {
+					Expression operand = PopOperand();
+					SourceSpan span = operand.m_span.Empty() ? SourceSpan{} : SourceSpan{ op.m_begin, operand.m_span.m_end };
+					m_operands[m_operand_count++].emplace(make<UnaryOpExpression>(op.m_unop, std::move(operand))).m_span = span;
+				}
+				else {
+					Expression right = PopOperand();
+					Expression left = PopOperand();
+					SourceSpan span = join(left.m_span, right.m_span);
+					m_operands[m_operand_count++].emplace(make<BinaryOpExpression>(op.m_binop, std::move(left), std::move(right))).m_span = span;
+				}
 			}
 		}
 
-		template <>	void Terminal<SYMBOL_plus>()
-		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '+'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Add;
-			}
-			else {
-				m_state = UnOp;
-				m_unop = UnaryOp::Plus;
-			}
-		}
+		// Pending operators have strictly increasing precedence except for a unary +/- below a multiplicative or power
+		// operator, so a single simple_expression never has more than one pending operator per level.
+		static constexpr std::size_t MaxPending = 8;
 
-		template <>	void Terminal<SYMBOL_minus>()
-		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '-'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Sub;
-			}
-			else {
-				m_state = UnOp;
-				m_unop = UnaryOp::Minus;
-			}
-		}
+		std::array<std::optional<Expression>, MaxPending> m_operands;
+		std::array<PendingOperator, MaxPending> m_operators;
+		std::array<std::optional<Expression>, 2> m_range;
+		std::size_t m_operand_count = 0;
+		std::size_t m_operator_count = 0;
+		std::size_t m_range_count = 0;
+		std::uint32_t m_operator_at = 0;
+		bool m_expect_operator = false;
+	};
 
-		template <>	void Terminal<SYMBOL_dot_plus>()
-		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '.+'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::AddElemWise;
-			}
-			else {
-				m_state = UnOp;
-				m_unop = UnaryOp::DotPlus;
-			}
-		}
+	// Argument list of a function call. It has its own builder so that a failed attempt to match call arguments
+	// after a component reference leaves nothing behind in the enclosing PrimaryBuilder.
+	struct FunctionArguments
+	{
+		std::vector<Expression> m_arguments;
+	};
 
-		template <>	void Terminal<SYMBOL_dot_minus>()
+	class FunctionArgumentsBuilder : public BaseBuilder
+	{
+	public:
+		void Node(Expression&& expr)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '.-'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::SubElemWise;
-			}
-			else {
-				m_state = UnOp;
-				m_unop = UnaryOp::DotMinus;
-			}
+			m_args.m_arguments.push_back(std::move(expr));
 		}
 
-		template <>	void Terminal<SYMBOL_star>()
+		std::optional<FunctionArguments> Build()
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '*'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Mul;
-			}
-			else {
-				throw BuilderException("no unary '*'");
-			}
+			return std::move(m_args);
 		}
 
-		template <>	void Terminal<SYMBOL_slash>()
-		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '/'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Div;
-			}
-			else {
-				throw BuilderException("no unary '/'");
-			}
-		}
+	private:
+		FunctionArguments m_args;
+	};
 
-		template <>	void Terminal<SYMBOL_dot_star>()
+	// Builds a single primary: a literal, a parenthesised expression, a component reference or a function call.
+	class PrimaryBuilder : public BaseBuilder
+	{
+	public:
+		void Node(Expression&& expr)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '.*'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::MulElemWise;
-			}
-			else {
-				throw BuilderException("no unary '.*'");
+			switch (m_state) {
+			case Base:
+				if (m_temp_expr.has_value()) {
+					return Fail("already has expression");
+				}
+				m_temp_expr.emplace(std::move(expr));
+				break;
+			case ComponentOrFunctionCall:
+			case FunctionCall:
+
+			default:
+				return Fail("invalid state for expression");
 			}
 		}
 
-		template <>	void Terminal<SYMBOL_dot_slash>()
+		void Node(ComponentReference&& ref)
 		{
 			if (m_state != Base) {
-				throw BuilderException("unexpected state for './'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::DivElemWise;
-			}
-			else {
-				throw BuilderException("no unary './'");
+				return Fail("invalid state for component reference");
 			}
+			m_state = ComponentOrFunctionCall;
+			m_component.emplace(std::move(ref));
 		}
 
-		template <>	void Terminal<SYMBOL_pow>()
+		void Node(FunctionArguments&& args)
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '^'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::Pow;
-			}
-			else {
-				throw BuilderException("no unary '^'");
+			if (m_state != ComponentOrFunctionCall && m_state != FunctionCall) {
+				return Fail("function arguments without function name");
 			}
+			m_temp_expr.emplace(make<FunctionCallExpression>(std::move(m_component.value()), std::move(args.m_arguments)));
+			m_component.reset();
+			m_state = Base;
 		}
 
-		template <>	void Terminal<SYMBOL_dot_pow>()
+		template <typename rule>
+		void Terminal()
 		{
-			if (m_state != Base) {
-				throw BuilderException("unexpected state for '.^'");
-			}
-			if (m_temp_expr.has_value()) {
-				m_state = BinOp;
-				m_binop = BinaryOp::PowElemWise;
-			}
-			else {
-				throw BuilderException("no unary '.^'");
-			}
+			BaseBuilder::Terminal<rule>();
 		}
 
 		template <> void Terminal<KEYWORD_end>()
 		{
 			if (m_state != Base || m_temp_expr.has_value()) {
-				throw BuilderException("invalid state for literal");
+				return Fail("invalid state for literal");
 			}
-			m_temp_expr.emplace(LiteralExpressionPtr(new LiteralExpression()));
+			m_temp_expr.emplace(make<LiteralExpression>());
 		}
 
 		template <> void Terminal<KEYWORD_der>()
 		{
 			if (m_state != Base) {
-				throw BuilderException("invalid state for 'der' literal");
+				return Fail("invalid state for 'der' literal");
 			}
 			m_state = FunctionCall;
-			m_component.emplace("der");
+			m_component.emplace(intern("der"));
 		}
 
 		template <> void Terminal<KEYWORD_initial>()
 		{
 			if (m_state != Base) {
-				throw BuilderException("invalid state for 'initial' literal");
+				return Fail("invalid state for 'initial' literal");
 			}
 			m_state = FunctionCall;
-			m_component.emplace("initial");
+			m_component.emplace(intern("initial"));
 		}
 
 		template <> void Terminal<KEYWORD_pure>()
 		{
 			if (m_state != Base) {
-				throw BuilderException("invalid state for 'pure' literal");
+				return Fail("invalid state for 'pure' literal");
 			}
 			m_state = FunctionCall;
-			m_component.emplace("pure");
+			m_component.emplace(intern("pure"));
 		}
 
 		void Real(double d)
 		{
 			if (m_state != Base || m_temp_expr.has_value()) {
-				throw BuilderException("invalid state for literal");
+				return Fail("invalid state for literal");
 			}
-			m_temp_expr.emplace(LiteralExpressionPtr(new LiteralExpression(d)));
+			m_temp_expr.emplace(make<LiteralExpression>(d));
 		}
 
 		void Integer(int i)
 		{
 			if (m_state != Base || m_temp_expr.has_value()) {
-				throw BuilderException("invalid state for literal");
+				return Fail("invalid state for literal");
 			}
-			m_temp_expr.emplace(LiteralExpressionPtr(new LiteralExpression(i)));
+			m_temp_expr.emplace(make<LiteralExpression>(i));
 		}
 
 		void Boolean(bool b)
 		{
 			if (m_state != Base || m_temp_expr.has_value()) {
-				throw BuilderException("invalid state for literal");
+				return Fail("invalid state for literal");
 			}
-			m_temp_expr.emplace(LiteralExpressionPtr(new LiteralExpression(b)));
+			m_temp_expr.emplace(make<LiteralExpression>(b));
 		}
 
-		void String(std::string&& s)
+		void String(SourceString&& s)
 		{
 			if (m_state != Base || m_temp_expr.has_value()) {
-				throw BuilderException("invalid state for literal");
+				return Fail("invalid state for literal");
 			}
-			m_temp_expr.emplace(LiteralExpressionPtr(new LiteralExpression(std::move(s))));
+			m_temp_expr.emplace(make<LiteralExpression>(std::move(s)));
 		}
 
-		Expression&& Build()
+		std::optional<Expression> Build()
 		{
-			CheckError();
 			switch (m_state) {
 			case Base:
 				if (!m_temp_expr.has_value()) {
-					throw BuilderException("can't build empty expression");
+					Fail("can't build empty expression");
+					return std::nullopt;
 				}
 				return std::move(m_temp_expr.value());
-			case ArrayRange:
-				if (!m_temp_expr.has_value() || !m_temp_expr_2.has_value()) {
-					throw BuilderException("not enough expressions for array range");
-				}
-				return ArrayRangeExpressionPtr(new ArrayRangeExpression(std::move(m_temp_expr.value()), std::move(m_temp_expr_2.value())));
+			case ComponentOrFunctionCall:
+				return Expression(make<ComponentExpression>(std::move(m_component.value())));
 			default:
-				throw BuilderException("can't build incomplete expression");
+				Fail("can't build incomplete expression");
+				return std::nullopt;
 			}
 		}
 	private:
 		enum State {
 			Base,
-			UnOp,
-			BinOp,
-			ArrayRange,
 			ComponentOrFunctionCall,
 			FunctionCall,
 		};
 
 		State m_state = Base;
 		std::optional<Expression> m_temp_expr;
-		std::optional<Expression> m_temp_expr_2;
-		std::optional<UnaryOp> m_unop;
-		std::optional<BinaryOp> m_binop;
 		std::optional<ComponentReference> m_component;
 	};
 
@@ -534,17 +477,20 @@ namespace ast {
 			}
 		}
 
-		Expression&& Build()
+		std::optional<Expression> Build()
 		{
-			CheckError();
 			if (!m_if_branch.has_value() || !m_temp_expr.has_value()) {
-				throw BuilderException("trying to build incomplete if expression");
+				Fail("trying to build incomplete if expression");
+				return std::nullopt;
 			}
 			ast::Expression temp_else_expr = std::move(m_temp_expr.value());
 			for (auto& [cond, then] : m_elseif_branch) {
-				temp_else_expr = IfExpressionPtr(new IfExpression(std::move(cond), std::move(then), std::move(temp_else_expr)));
+				// an elseif branch becomes a nested if expression, spanning from its condition to the final else
+				SourceSpan span = join(cond.m_span, temp_else_expr.m_span);
+				temp_else_expr = make<IfExpression>(std::move(cond), std::move(then), std::move(temp_else_expr));
+				temp_else_expr.m_span = span;
 			}
-			return IfExpressionPtr(new IfExpression(std::move(m_if_branch.value().first), std::move(m_if_branch.value().second), std::move(temp_else_expr)));
+			return Expression(make<IfExpression>(std::move(m_if_branch.value().first), std::move(m_if_branch.value().second), std::move(temp_else_expr)));
 		}
 
 	private:
@@ -558,15 +504,15 @@ namespace ast {
 	public:
 		void Node(Expression&& expr)
 		{
-			if (m_parts.empty()) {
-				throw BuilderException("array index without ident");
+			if (m_ref.Size() == 0) {
+				return Fail("array index without ident");
 			}
-			m_parts.back().second.push_back(ArraySubscript(std::move(expr)));
+			m_ref.AddSubscript(ArraySubscript(std::move(expr)));
 		}
 
-		void Ident(std::string&& ident)
+		void Ident(Symbol ident)
 		{
-			m_parts.push_back(std::pair<std::string, std::vector<ArraySubscript>>(std::move(ident), {}));
+			m_ref.Append(ident);
 		}
 
 		template <typename rule>
@@ -577,28 +523,137 @@ namespace ast {
 
 		template <> void Terminal<SYMBOL_dot>()
 		{
-			if (m_parts.empty()) {
-				m_global = true;
+			if (m_ref.Size() == 0) {
+				m_ref.m_global = true;
 			}
 		}
 
 		template <> void Terminal<SYMBOL_colon>()
 		{
-			if (m_parts.empty()) {
-				throw BuilderException("array index without ident");
+			if (m_ref.Size() == 0) {
+				return Fail("array index without ident");
 			}
-			m_parts.back().second.push_back(ArraySubscript{});
+			m_ref.AddSubscript(ArraySubscript{});
 		}
 
-		ComponentReference&& Build()
+		std::optional<ComponentReference> Build()
 		{
-			CheckError();
-			return ComponentReference(std::move(m_parts), m_global);
+			return std::move(m_ref);
 		}
 
 	private:
-		bool m_global = false;
-		std::vector<std::pair<std::string, std::vector<ArraySubscript>>> m_parts;
+		// parts are appended to the reference in place, so building it takes no intermediate containers
+		ComponentReference m_ref;
 	};
 
-}
\ No newline at end of file
+	// Joins the parts of a description string ("a" + "b"); a single part stays as it came from the source.
+	inline void append_description(std::optional<SourceString>& text, SourceString&& part)
+	{
+		if (!text.has_value()) {
+			text.emplace(std::move(part));
+			return;
+		}
+		std::string joined(text->View());
+		joined += part.View();
+		text.emplace(std::move(joined));
+	}
+
+	class DescriptionBuilder : public BaseBuilder
+	{
+	public:
+		void String(SourceString&& s)
+		{
+			append_description(m_description.m_text, std::move(s));
+		}
+
+		void AnnotationBody(std::string_view body)
+		{
+			m_description.m_annotation.emplace(Annotation{ body });
+		}
+
+		template <typename rule>
+		void Terminal()
+		{
+			BaseBuilder::Terminal<rule>();
+		}
+
+		template <> void Terminal<SYMBOL_plus>() {}
+
+		std::optional<Description> Build()
+		{
+			return std::move(m_description);
+		}
+
+	private:
+		Description m_description;
+	};
+
+	class ElementModificationBuilder : public BaseBuilder
+	{
+	public:
+		void Node(ClassModification&& mod)
+		{
+			m_mod.m_modification.emplace(std::move(mod));
+		}
+
+		void Node(Expression&& expr)
+		{
+			if (m_mod.m_value.has_value()) {
+				return Fail("modification already has a value");
+			}
+			m_mod.m_value.emplace(std::move(expr));
+		}
+
+		void Ident(Symbol ident)
+		{
+			m_mod.m_name.push_back(ident);
+		}
+
+		void String(SourceString&& s)
+		{
+			append_description(m_mod.m_description, std::move(s));
+		}
+
+		template <typename rule>
+		void Terminal()
+		{
+			BaseBuilder::Terminal<rule>();
+		}
+
+		template <> void Terminal<KEYWORD_each>() { m_mod.m_each = true; }
+		template <> void Terminal<KEYWORD_final>() { m_mod.m_final = true; }
+		template <> void Terminal<SYMBOL_dot>() {}
+		template <> void Terminal<SYMBOL_plus>() {}
+
+		std::optional<ElementModification> Build()
+		{
+			if (m_mod.m_name.empty()) {
+				Fail("modification without name");
+				return std::nullopt;
+			}
+			return std::move(m_mod);
+		}
+
+	private:
+		ElementModification m_mod;
+	};
+
+	class ClassModificationBuilder : public BaseBuilder
+	{
+	public:
+		void Node(ElementModification&& arg)
+		{
+			m_mod.m_arguments.push_back(std::move(arg));
+		}
+
+		std::optional<ClassModification> Build()
+		{
+			return std::move(m_mod);
+		}
+
+	private:
+		ClassModification m_mod;
+	};
+
+}
+
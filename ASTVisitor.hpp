@@ -1,35 +1,177 @@
 #pragma once
 
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
 #include "AST.hpp"
 
 #define AST_VISIT(e, s) ast::visitor<std::remove_cvref_t<decltype(e)>, std::remove_cvref_t<decltype(s)>>::visit(e, s)
 
 namespace ast {
 
+    // Depth-first walk over the tree below root with an explicit stack, so arbitrarily deep expressions (such as the
+    // left-deep chains of long sums) are handled in constant call stack depth.
+    // pre(e) runs before the children of e and may return false to skip them; post(e) runs after the children (or
+    // straight after pre when they were skipped). E is Expression or const Expression.
+    template <typename E, typename Pre, typename Post>
+        requires std::same_as<std::remove_const_t<E>, Expression>
+    void walk(E& root, Pre&& pre, Post&& post)
+    {
+        struct Frame
+        {
+            E* m_expr;
+            bool m_expanded;
+        };
+        std::vector<Frame> stack;
+        stack.push_back(Frame{ &root, false });
+        while (!stack.empty()) {
+            Frame& top = stack.back();
+            E* e = top.m_expr;
+            if (top.m_expanded) {
+                stack.pop_back();
+                post(*e);
+                continue;
+            }
+            top.m_expanded = true;
+            bool descend = true;
+            if constexpr (std::is_void_v<decltype(pre(*e))>) {
+                pre(*e);
+            }
+            else {
+                descend = pre(*e);
+            }
+            if (descend) {
+                std::size_t first = stack.size();
+                for_each_child(*e, [&stack](E& child) { stack.push_back(Frame{ &child, false }); });
+                std::reverse(stack.begin() + first, stack.end());
+            }
+        }
+    }
+
+    template <typename E, typename Pre>
+        requires std::same_as<std::remove_const_t<E>, Expression>
+    void walk_pre(E& root, Pre&& pre)
+    {
+        walk(root, pre, [](E&) {});
+    }
+
+    template <typename E, typename Post>
+        requires std::same_as<std::remove_const_t<E>, Expression>
+    void walk_post(E& root, Post&& post)
+    {
+        walk(root, [](E&) {}, post);
+    }
+
+    // Steps through a component reference in the order walk() visits its subscript expressions, for printers that
+    // write the text of the reference around them.
+    class ReferenceCursor
+    {
+    public:
+        explicit ReferenceCursor(const ComponentReference& ref)
+            : m_ref(&ref) {}
+
+        // Passes the reference up to its next subscript expression to text(punctuation) and name(identifier) and
+        // returns true; once no subscript expression is left, passes the rest and returns false.
+        template <typename Text, typename Name>
+        bool Advance(Text&& text, Name&& name)
+        {
+            if (m_pending) {
+                m_pending = false;
+                ++m_subscript;
+            }
+            while (m_part < m_ref->Size()) {
+                auto subscripts = m_ref->Subscripts(m_part);
+                if (!m_named) {
+                    if (m_part > 0 || m_ref->m_global) {
+                        text(".");
+                    }
+                    name(name_of(m_ref->Name(m_part)));
+                    if (!subscripts.empty()) {
+                        text("[");
+                    }
+                    m_named = true;
+                }
+                if (m_subscript < subscripts.size()) {
+                    if (m_subscript > 0) {
+                        text(", ");
+                    }
+                    if (subscripts[m_subscript].m_subscript.has_value()) {
+                        m_pending = true;
+                        return true;
+                    }
+                    text(":");
+                    ++m_subscript;
+                    continue;
+                }
+                if (!subscripts.empty()) {
+                    text("]");
+                }
+                ++m_part;
+                m_subscript = 0;
+                m_named = false;
+            }
+            return false;
+        }
+
+        // the subscript expression reached by the last Advance() that returned true
+        const Expression& Subscript() const
+        {
+            return m_ref->Subscripts(m_part)[m_subscript].m_subscript.value();
+        }
+
+    private:
+        const ComponentReference* m_ref;
+        std::size_t m_part = 0;
+        std::size_t m_subscript = 0;
+        bool m_named = false;
+        bool m_pending = false;
+    };
+
     template <typename Node, typename State>
     struct visitor;
 
+    // A node type is visitable with State if visitor<Node, State> is specialized (generically or for State).
+    template <typename Node, typename State>
+    concept visitable = requires(const Node& node, State& s) {
+        visitor<Node, State>::visit(node, s);
+    };
+
+    template <typename Node, typename State>
+    using visit_result_t = decltype(visitor<Node, State>::visit(std::declval<const Node&>(), std::declval<State&>()));
+
+    template <typename Variant, typename State>
+    struct expression_visit;
+
+    // Checks at compile time that every alternative of Expression::m_expr has a visitor for State and that they
+    // all return the same type, which is then the result of visiting an Expression. This lets fold visitors return
+    // a value per node without each of them having to spell out a conversion.
+    template <typename First, typename... Rest, typename State>
+    struct expression_visit<std::variant<First, Rest...>, State>
+    {
+        static_assert(visitable<First, State> && (visitable<Rest, State> && ...), "every Expression alternative needs a visitor for this state type");
+
+        using result_type = visit_result_t<First, State>;
+
+        static_assert((std::is_same_v<visit_result_t<Rest, State>, result_type> && ...),
+            "all node visitors of one state type must return the same type");
+    };
+
     template <typename State>
     struct visitor<Expression, State>
     {
-        static auto visit(const Expression& e, State& s)
+        using result_type = typename expression_visit<decltype(Expression::m_expr), State>::result_type;
+
+        // std::visit over the single variant compiles to one indirect jump through a table of the node visitors.
+        static result_type visit(const Expression& e, State& s)
         {
-            switch (e.m_expr.index()) {
-            case 0:
-                return AST_VISIT(std::get<IfExpressionPtr>(e.m_expr), s);
-            case 1:
-                return AST_VISIT(std::get<UnaryOpExpressionPtr>(e.m_expr), s);
-            case 2:
-                return AST_VISIT(std::get<BinaryOpExpressionPtr>(e.m_expr), s);
-            case 3:
-                return AST_VISIT(std::get<FunctionCallExpressionPtr>(e.m_expr), s);
-            case 4:
-                return AST_VISIT(std::get<LiteralExpressionPtr>(e.m_expr), s);
-            case 5:
-                return AST_VISIT(std::get<ArrayRangeExpressionPtr>(e.m_expr), s);
-            case 6:
-                return AST_VISIT(std::get<ComponentReferencePtr>(e.m_expr), s);
-            }
+            return std::visit<result_type>([&s](auto& node) -> result_type {
+                return visitor<std::remove_cvref_t<decltype(node)>, State>::visit(node, s);
+            }, e.m_expr);
         }
     };
 
@@ -63,11 +205,25 @@ namespace ast {
         }
     };
 
+    // Visits the subscript expressions of all parts of ref.
+    template <typename State>
+    void visit_subscripts(const ComponentReference& ref, State& s)
+    {
+        for (std::size_t i = 0; i < ref.Size(); ++i) {
+            for (auto& subscript : ref.Subscripts(i)) {
+                if (subscript.m_subscript.has_value()) {
+                    AST_VISIT(subscript.m_subscript.value(), s);
+                }
+            }
+        }
+    }
+
     template <typename State>
     struct visitor<FunctionCallExpressionPtr, State>
     {
         static void visit(const FunctionCallExpressionPtr& e, State& s)
         {
+            visit_subscripts(e->m_functionName, s);
             for (auto& expr : e->m_arguments) {
                 AST_VISIT(expr, s);
             }
@@ -95,4 +251,13 @@ namespace ast {
         }
     };
 
+    template <typename State>
+    struct visitor<ComponentExpressionPtr, State>
+    {
+        static void visit(const ComponentExpressionPtr& e, State& s)
+        {
+            visit_subscripts(e->m_componentRef, s);
+        }
+    };
+
 }
\ No newline at end of file
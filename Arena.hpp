@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace ast {
+
+    // Bump allocator owning the storage of all AST nodes of one parse.
+    // Node destructors are still run through NodeDeleter, but the memory itself is only released in bulk when the arena dies,
+    // so an arena must outlive every tree allocated from it.
+    class Arena
+    {
+    public:
+        explicit Arena(std::size_t blockSize = 64 * 1024)
+            : m_blockSize(blockSize) {}
+
+        Arena(const Arena& other) = delete;
+        Arena& operator=(const Arena& other) = delete;
+
+        void* Allocate(std::size_t size, std::size_t align)
+        {
+            assert(align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+            std::size_t offset = (m_used + align - 1) & ~(align - 1);
+            if (offset + size > m_capacity) {
+                NewBlock(size);
+                offset = 0;
+            }
+            m_used = offset + size;
+            m_allocated += size;
+            return m_block + offset;
+        }
+
+        std::size_t BytesReserved() const
+        {
+            return m_reserved;
+        }
+
+        std::size_t BytesAllocated() const
+        {
+            return m_allocated;
+        }
+
+        // The arena new nodes are allocated from on this thread: the innermost active ArenaScope,
+        // or a per-thread scratch arena living until thread exit for nodes built outside of any scope.
+        static Arena& Current()
+        {
+            if (s_current != nullptr) {
+                return *s_current;
+            }
+            thread_local Arena scratch;
+            return scratch;
+        }
+
+    private:
+        friend class ArenaScope;
+
+        void NewBlock(std::size_t minSize)
+        {
+            std::size_t size = minSize > m_blockSize ? minSize : m_blockSize;
+            m_blocks.emplace_back(new std::byte[size]);
+            m_block = m_blocks.back().get();
+            m_capacity = size;
+            m_used = 0;
+            m_reserved += size;
+        }
+
+        std::size_t m_blockSize;
+        std::vector<std::unique_ptr<std::byte[]>> m_blocks;
+        std::byte* m_block = nullptr;
+        std::size_t m_used = 0;
+        std::size_t m_capacity = 0;
+        std::size_t m_reserved = 0;
+        std::size_t m_allocated = 0;
+
+        inline static thread_local Arena* s_current = nullptr;
+    };
+
+    // Makes an arena the allocation target for ast::make on the current thread for the lifetime of the scope.
+    class ArenaScope
+    {
+    public:
+        explicit ArenaScope(Arena& arena)
+            : m_previous(Arena::s_current)
+        {
+            Arena::s_current = &arena;
+        }
+
+        ~ArenaScope()
+        {
+            Arena::s_current = m_previous;
+        }
+
+        ArenaScope(const ArenaScope& other) = delete;
+        ArenaScope& operator=(const ArenaScope& other) = delete;
+
+    private:
+        Arena* m_previous;
+    };
+
+    // Deleter for arena-backed nodes: runs the destructor, the storage goes away with the arena.
+    template <typename T>
+    struct NodeDeleter
+    {
+        void operator()(T* p) const
+        {
+            p->~T();
+        }
+    };
+
+    template <typename T>
+    using NodePtr = std::unique_ptr<T, NodeDeleter<T>>;
+
+    template <typename T, typename... Args>
+    NodePtr<T> make(Args&&... args)
+    {
+        void* mem = Arena::Current().Allocate(sizeof(T), alignof(T));
+        return NodePtr<T>(new (mem) T(std::forward<Args>(args)...));
+    }
+
+}
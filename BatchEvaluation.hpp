@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define MINIMODELICA_BATCH_AVX512 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define MINIMODELICA_BATCH_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define MINIMODELICA_BATCH_SSE2 1
+// AVX2 kernels are compiled as well and used where the processor running the program has AVX2
+#define MINIMODELICA_BATCH_DISPATCH_AVX2 1
+#endif
+
+// With MINIMODELICA_BATCH_SLEEF defined, and the program linked with the SLEEF library, powers of exponents that
+// power() does not compute by one operation run on SLEEF's vector pow instead of std::pow lane by lane. Its functions
+// are accurate to 1 ulp where std::pow is about half that, so such lanes can differ from Machine in the last bit or
+// two; every other lane stays the same to the bit. The functions are declared here for the lanes this file compiles,
+// AVX2 below with its kernels.
+#ifdef MINIMODELICA_BATCH_SLEEF
+extern "C" {
+    double Sleef_pow_u10(double a, double b);
+#if defined(MINIMODELICA_BATCH_AVX512)
+    __m512d Sleef_powd8_u10avx512f(__m512d a, __m512d b);
+#elif defined(MINIMODELICA_BATCH_SSE2)
+    __m128d Sleef_powd2_u10sse2(__m128d a, __m128d b);
+#endif
+}
+#endif
+
+#include "CpuFeatures.hpp"
+#include "Evaluation.hpp"
+#include "Bytecode.hpp"
+
+// Evaluation of one bytecode program for many bindings of its variables at once, such as the points of a parameter
+// sweep. The values come as one column per variable slot, a value for each lane, and the program runs over blocks of
+// lanes: each instruction is a loop over a block, so the dispatch is paid once per block instead of once per point,
+// and the loops run on the widest vectors there are: AVX-512 or AVX2 when the target was compiled for them, else AVX2
+// when the processor running the program has it and SSE2 when not, else one lane at a time. Every lane gives exactly
+// what Machine gives for it, but for the SLEEF option below.
+namespace ast {
+
+    namespace batch {
+
+        // Lanes per block: small enough for the registers of an expression to stay in the first level cache.
+        inline constexpr std::size_t BlockLanes = 256;
+
+        // The operations of the evaluator on one double; also the tail of every block.
+        struct ScalarLanes
+        {
+            using Vector = double;
+            using Mask = bool;
+            static constexpr std::size_t Width = 1;
+
+            static double Load(const double* p) { return *p; }
+            static void Store(double* p, double x) { *p = x; }
+            static double Add(double a, double b) { return a + b; }
+            static double Sub(double a, double b) { return a - b; }
+            static double Mul(double a, double b) { return a * b; }
+            static double Div(double a, double b) { return a / b; }
+            static double Neg(double x) { return -x; }
+            static bool Less(double a, double b) { return a < b; }
+            static bool LessEqual(double a, double b) { return a <= b; }
+            static bool Equal(double a, double b) { return a == b; }
+            static bool NotEqual(double a, double b) { return a != b; }
+            static bool And(bool a, bool b) { return a && b; }
+            static bool Or(bool a, bool b) { return a || b; }
+            static double Number(bool m) { return m ? 1. : 0.; }
+            static double Select(bool m, double then, double otherwise) { return m ? then : otherwise; }
+            static double Broadcast(double x) { return x; }
+            static double Sqrt(double x) { return std::sqrt(x); }
+            static double Abs(double x) { return std::fabs(x); }
+            static double Floor(double x) { return std::floor(x); }
+            static double Ceil(double x) { return std::ceil(x); }
+#ifdef MINIMODELICA_BATCH_SLEEF
+            static double Pow(double a, double b) { return Sleef_pow_u10(a, b); }
+#endif
+        };
+
+        // The same on a vector of lanes. Comparisons are ordered, except for inequality, which holds for NaN as it
+        // does on doubles; a Boolean is 1.0 where the mask is set and 0.0 elsewhere. The square root and rounding
+        // instructions round as the C library functions do, and Abs clears the sign bit as std::fabs does.
+#if defined(MINIMODELICA_BATCH_AVX512)
+        struct Avx512Lanes
+        {
+            using Vector = __m512d;
+            using Mask = __mmask8;
+            static constexpr std::size_t Width = 8;
+
+            static Vector Load(const double* p) { return _mm512_loadu_pd(p); }
+            static void Store(double* p, Vector x) { _mm512_storeu_pd(p, x); }
+            static Vector Add(Vector a, Vector b) { return _mm512_add_pd(a, b); }
+            static Vector Sub(Vector a, Vector b) { return _mm512_sub_pd(a, b); }
+            static Vector Mul(Vector a, Vector b) { return _mm512_mul_pd(a, b); }
+            static Vector Div(Vector a, Vector b) { return _mm512_div_pd(a, b); }
+            static Vector Neg(Vector x) { return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(x), _mm512_set1_epi64(INT64_MIN))); }
+            static Mask Less(Vector a, Vector b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+            static Mask LessEqual(Vector a, Vector b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+            static Mask Equal(Vector a, Vector b) { return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ); }
+            static Mask NotEqual(Vector a, Vector b) { return _mm512_cmp_pd_mask(a, b, _CMP_NEQ_UQ); }
+            static Mask And(Mask a, Mask b) { return static_cast<Mask>(a & b); }
+            static Mask Or(Mask a, Mask b) { return static_cast<Mask>(a | b); }
+            static Vector Number(Mask m) { return _mm512_maskz_mov_pd(m, _mm512_set1_pd(1.)); }
+            static Vector Select(Mask m, Vector then, Vector otherwise) { return _mm512_mask_blend_pd(m, otherwise, then); }
+            static Vector Broadcast(double x) { return _mm512_set1_pd(x); }
+            static Vector Sqrt(Vector x) { return _mm512_sqrt_pd(x); }
+            static Vector Abs(Vector x) { return _mm512_castsi512_pd(_mm512_andnot_si512(_mm512_set1_epi64(INT64_MIN), _mm512_castpd_si512(x))); }
+            static Vector Floor(Vector x) { return _mm512_roundscale_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+            static Vector Ceil(Vector x) { return _mm512_roundscale_pd(x, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC); }
+#ifdef MINIMODELICA_BATCH_SLEEF
+            static Vector Pow(Vector a, Vector b) { return Sleef_powd8_u10avx512f(a, b); }
+#endif
+        };
+#elif defined(MINIMODELICA_BATCH_SSE2)
+        struct Sse2Lanes
+        {
+            using Vector = __m128d;
+            using Mask = __m128d;
+            static constexpr std::size_t Width = 2;
+
+            static Vector Load(const double* p) { return _mm_loadu_pd(p); }
+            static void Store(double* p, Vector x) { _mm_storeu_pd(p, x); }
+            static Vector Add(Vector a, Vector b) { return _mm_add_pd(a, b); }
+            static Vector Sub(Vector a, Vector b) { return _mm_sub_pd(a, b); }
+            static Vector Mul(Vector a, Vector b) { return _mm_mul_pd(a, b); }
+            static Vector Div(Vector a, Vector b) { return _mm_div_pd(a, b); }
+            static Vector Neg(Vector x) { return _mm_xor_pd(x, _mm_set1_pd(-0.)); }
+            static Mask Less(Vector a, Vector b) { return _mm_cmplt_pd(a, b); }
+            static Mask LessEqual(Vector a, Vector b) { return _mm_cmple_pd(a, b); }
+            static Mask Equal(Vector a, Vector b) { return _mm_cmpeq_pd(a, b); }
+            static Mask NotEqual(Vector a, Vector b) { return _mm_cmpneq_pd(a, b); }
+            static Mask And(Mask a, Mask b) { return _mm_and_pd(a, b); }
+            static Mask Or(Mask a, Mask b) { return _mm_or_pd(a, b); }
+            static Vector Number(Mask m) { return _mm_and_pd(m, _mm_set1_pd(1.)); }
+            static Vector Select(Mask m, Vector then, Vector otherwise) { return _mm_or_pd(_mm_and_pd(m, then), _mm_andnot_pd(m, otherwise)); }
+            static Vector Broadcast(double x) { return _mm_set1_pd(x); }
+            static Vector Sqrt(Vector x) { return _mm_sqrt_pd(x); }
+            static Vector Abs(Vector x) { return _mm_andnot_pd(_mm_set1_pd(-0.), x); }
+            // SSE2 has no rounding to an integral double for every range, so these round lane by lane
+            static Vector Floor(Vector x) { return _mm_set_pd(std::floor(_mm_cvtsd_f64(_mm_unpackhi_pd(x, x))), std::floor(_mm_cvtsd_f64(x))); }
+            static Vector Ceil(Vector x) { return _mm_set_pd(std::ceil(_mm_cvtsd_f64(_mm_unpackhi_pd(x, x))), std::ceil(_mm_cvtsd_f64(x))); }
+#ifdef MINIMODELICA_BATCH_SLEEF
+            static Vector Pow(Vector a, Vector b) { return Sleef_powd2_u10sse2(a, b); }
+#endif
+        };
+#endif
+
+        // The kernels, one set per kind of lanes (see BatchKernels.hpp); those of AVX2 follow.
+#if defined(MINIMODELICA_BATCH_AVX512)
+        namespace avx512 {
+            using VectorLanes = Avx512Lanes;
+#include "BatchKernels.hpp"
+        }
+#elif defined(MINIMODELICA_BATCH_SSE2)
+        namespace sse2 {
+            using VectorLanes = Sse2Lanes;
+#include "BatchKernels.hpp"
+        }
+#elif !defined(MINIMODELICA_BATCH_AVX2)
+        namespace scalar {
+            using VectorLanes = ScalarLanes;
+#include "BatchKernels.hpp"
+        }
+#endif
+
+    }
+
+}
+
+// Without /arch:AVX2 or -mavx2, GCC and Clang compile AVX2 code only in functions marked for it; everything up to the
+// pop is, including the lambdas of the kernels. MSVC compiles the intrinsics of any instruction set anywhere. Only
+// code that runs after the processor check is in here.
+#if defined(MINIMODELICA_BATCH_DISPATCH_AVX2) && defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(MINIMODELICA_BATCH_DISPATCH_AVX2) && defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+#if defined(MINIMODELICA_BATCH_AVX2) || defined(MINIMODELICA_BATCH_DISPATCH_AVX2)
+#ifdef MINIMODELICA_BATCH_SLEEF
+extern "C" __m256d Sleef_powd4_u10avx2(__m256d a, __m256d b);
+#endif
+
+namespace ast {
+
+    namespace batch {
+
+        struct Avx2Lanes
+        {
+            using Vector = __m256d;
+            using Mask = __m256d;
+            static constexpr std::size_t Width = 4;
+
+            static Vector Load(const double* p) { return _mm256_loadu_pd(p); }
+            static void Store(double* p, Vector x) { _mm256_storeu_pd(p, x); }
+            static Vector Add(Vector a, Vector b) { return _mm256_add_pd(a, b); }
+            static Vector Sub(Vector a, Vector b) { return _mm256_sub_pd(a, b); }
+            static Vector Mul(Vector a, Vector b) { return _mm256_mul_pd(a, b); }
+            static Vector Div(Vector a, Vector b) { return _mm256_div_pd(a, b); }
+            static Vector Neg(Vector x) { return _mm256_xor_pd(x, _mm256_set1_pd(-0.)); }
+            static Mask Less(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+            static Mask LessEqual(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+            static Mask Equal(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+            static Mask NotEqual(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ); }
+            static Mask And(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+            static Mask Or(Mask a, Mask b) { return _mm256_or_pd(a, b); }
+            static Vector Number(Mask m) { return _mm256_and_pd(m, _mm256_set1_pd(1.)); }
+            static Vector Select(Mask m, Vector then, Vector otherwise) { return _mm256_blendv_pd(otherwise, then, m); }
+            static Vector Broadcast(double x) { return _mm256_set1_pd(x); }
+            static Vector Sqrt(Vector x) { return _mm256_sqrt_pd(x); }
+            static Vector Abs(Vector x) { return _mm256_andnot_pd(_mm256_set1_pd(-0.), x); }
+            static Vector Floor(Vector x) { return _mm256_round_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+            static Vector Ceil(Vector x) { return _mm256_round_pd(x, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC); }
+#ifdef MINIMODELICA_BATCH_SLEEF
+            static Vector Pow(Vector a, Vector b) { return Sleef_powd4_u10avx2(a, b); }
+#endif
+        };
+
+        namespace avx2 {
+            using VectorLanes = Avx2Lanes;
+#include "BatchKernels.hpp"
+        }
+
+    }
+
+}
+#endif
+
+#if defined(MINIMODELICA_BATCH_DISPATCH_AVX2) && defined(__clang__)
+#pragma clang attribute pop
+#elif defined(MINIMODELICA_BATCH_DISPATCH_AVX2) && defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+namespace ast {
+
+    // Runs a program over blocks of lanes with a register file of one block per register; one machine per thread.
+    class BatchMachine
+    {
+    public:
+        static constexpr std::size_t BlockLanes = batch::BlockLanes;
+
+        explicit BatchMachine(const Program& program)
+            : m_program(program), m_file(static_cast<std::size_t>(program.m_registers) * BlockLanes), m_operands(program.m_registers),
+              m_block(ChooseKernels())
+        {
+            for (std::size_t r = 0; r < program.m_constants.size(); ++r) {
+                std::fill_n(m_file.begin() + static_cast<std::ptrdiff_t>(r * BlockLanes), BlockLanes, program.m_constants[r]);
+            }
+        }
+
+        // columns holds the values of every variable by slot, each with a value for every lane of out; out gets
+        // the value of the expression in each lane. Without a full column for a variable the program reads, every
+        // lane is NaN, as from Machine::Run.
+        void Run(std::span<const std::span<const double>> columns, std::span<double> out)
+        {
+            const std::size_t constants = m_program.m_constants.size();
+            const std::size_t inputs = m_program.m_inputs.size();
+            for (std::uint32_t slot : m_program.m_inputs) {
+                if (slot >= columns.size() || columns[slot].size() < out.size()) {
+                    std::fill(out.begin(), out.end(), std::numeric_limits<double>::quiet_NaN());
+                    return;
+                }
+            }
+            const double** r = m_operands.data();
+            for (std::size_t i = 0; i < m_program.m_registers; ++i) {
+                r[i] = m_file.data() + i * BlockLanes;
+            }
+            for (std::size_t base = 0; base < out.size(); base += BlockLanes) {
+                const std::size_t n = std::min(BlockLanes, out.size() - base);
+                // variables are read in place, from their columns
+                for (std::size_t i = 0; i < inputs; ++i) {
+                    r[constants + i] = columns[m_program.m_inputs[i]].data() + base;
+                }
+                m_block(m_program, r, m_file.data(), n);
+                std::copy_n(r[m_program.m_result], n, out.begin() + static_cast<std::ptrdiff_t>(base));
+            }
+        }
+
+    private:
+        using BlockFunction = void (*)(const Program& program, const double* const* r, double* file, std::size_t n);
+
+        // The widest lanes the target was compiled for, or that the processor has.
+        static BlockFunction ChooseKernels()
+        {
+#if defined(MINIMODELICA_BATCH_AVX512)
+            return batch::avx512::run_block;
+#elif defined(MINIMODELICA_BATCH_AVX2)
+            return batch::avx2::run_block;
+#elif defined(MINIMODELICA_BATCH_DISPATCH_AVX2)
+            return cpu::has_avx2() ? batch::avx2::run_block : batch::sse2::run_block;
+#else
+            return batch::scalar::run_block;
+#endif
+        }
+
+        const Program& m_program;
+        std::vector<double> m_file;
+        std::vector<const double*> m_operands; // the block each register is read from
+        BlockFunction m_block;
+    };
+
+}
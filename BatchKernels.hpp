@@ -0,0 +1,135 @@
+// The block loop of BatchMachine for one lane type. BatchEvaluation.hpp includes this once for every instruction set
+// it has kernels for, each time inside a namespace of its own that names the lane type VectorLanes, so the functions
+// are compiled separately for each set. For that reason there is no include guard, and nothing is included here.
+
+// Applies op to n lanes, a vector at a time and the rest one by one. op is called with the lanes type first, so one
+// generic lambda serves both.
+template <typename Op>
+void unary(const double* a, double* dst, std::size_t n, Op op)
+{
+    using V = VectorLanes;
+    std::size_t i = 0;
+    for (; i + V::Width <= n; i += V::Width) {
+        V::Store(dst + i, op(V{}, V::Load(a + i)));
+    }
+    for (; i < n; ++i) {
+        dst[i] = op(ScalarLanes{}, a[i]);
+    }
+}
+
+template <typename Op>
+void binary(const double* a, const double* b, double* dst, std::size_t n, Op op)
+{
+    using V = VectorLanes;
+    std::size_t i = 0;
+    for (; i + V::Width <= n; i += V::Width) {
+        V::Store(dst + i, op(V{}, V::Load(a + i), V::Load(b + i)));
+    }
+    for (; i < n; ++i) {
+        dst[i] = op(ScalarLanes{}, a[i], b[i]);
+    }
+}
+
+inline void select(const double* condition, const double* then, const double* otherwise, double* dst, std::size_t n)
+{
+    using V = VectorLanes;
+    std::size_t i = 0;
+    for (; i + V::Width <= n; i += V::Width) {
+        V::Store(dst + i, V::Select(V::NotEqual(V::Load(condition + i), typename V::Vector{}), V::Load(then + i), V::Load(otherwise + i)));
+    }
+    for (; i < n; ++i) {
+        dst[i] = condition[i] != 0. ? then[i] : otherwise[i];
+    }
+}
+
+// The powers of a constant exponent that power() computes by one operation, which have vector instructions; false
+// for the other exponents.
+inline bool constant_power(const double* a, double exponent, double* dst, std::size_t n)
+{
+    if (exponent == 2.) {
+        binary(a, a, dst, n, [](auto l, auto x, auto y) { return l.Mul(x, y); });
+    }
+    else if (exponent == 0.5) {
+        unary(a, dst, n, [](auto l, auto x) {
+            auto infinity = l.Broadcast(std::numeric_limits<double>::infinity());
+            return l.Add(l.Select(l.Equal(x, l.Neg(infinity)), infinity, l.Sqrt(x)), decltype(x){});
+        });
+    }
+    else if (exponent == -1.) {
+        unary(a, dst, n, [](auto l, auto x) { return l.Div(l.Broadcast(1.), x); });
+    }
+    else if (exponent == 1.) {
+        unary(a, dst, n, [](auto, auto x) { return x; });
+    }
+    else if (exponent == 0.) {
+        std::fill_n(dst, n, 1.);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Runs the code of program over the first n lanes of a block, reading each register from the block r points it to
+// and writing it to its block in file.
+inline void run_block(const Program& program, const double* const* r, double* file, std::size_t n)
+{
+    for (const Instruction& i : program.m_code) {
+        double* dst = file + static_cast<std::size_t>(i.m_dst) * BlockLanes;
+        const double* a = r[i.m_a];
+        const double* b = r[i.m_b];
+        switch (i.m_op) {
+        case Opcode::Neg: unary(a, dst, n, [](auto l, auto x) { return l.Neg(x); }); break;
+        case Opcode::Not: unary(a, dst, n, [](auto l, auto x) { return l.Number(l.Equal(x, decltype(x){})); }); break;
+        case Opcode::Add: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Add(x, y); }); break;
+        case Opcode::Sub: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Sub(x, y); }); break;
+        case Opcode::Mul: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Mul(x, y); }); break;
+        case Opcode::Div: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Div(x, y); }); break;
+        case Opcode::Less: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Number(l.Less(x, y)); }); break;
+        case Opcode::LessEqual: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Number(l.LessEqual(x, y)); }); break;
+        case Opcode::Greater: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Number(l.Less(y, x)); }); break;
+        case Opcode::GreaterEqual: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Number(l.LessEqual(y, x)); }); break;
+        case Opcode::Equal: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Number(l.Equal(x, y)); }); break;
+        case Opcode::NotEqual: binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Number(l.NotEqual(x, y)); }); break;
+        case Opcode::And:
+            binary(a, b, dst, n, [](auto l, auto x, auto y) {
+                return l.Number(l.And(l.NotEqual(x, decltype(x){}), l.NotEqual(y, decltype(y){})));
+            });
+            break;
+        case Opcode::Or:
+            binary(a, b, dst, n, [](auto l, auto x, auto y) {
+                return l.Number(l.Or(l.NotEqual(x, decltype(x){}), l.NotEqual(y, decltype(y){})));
+            });
+            break;
+        case Opcode::Select: select(a, b, r[i.m_c], dst, n); break;
+        // the C library has no vector pow or elementary functions that round as the scalar ones do, so beyond the
+        // powers of constant_power and the calls that are single instructions those stay one call per lane; the
+        // dispatch is still paid once per block
+        case Opcode::Pow:
+            if (i.m_b < program.m_constants.size() && constant_power(a, program.m_constants[i.m_b], dst, n)) {
+                break;
+            }
+#ifdef MINIMODELICA_BATCH_SLEEF
+            binary(a, b, dst, n, [](auto l, auto x, auto y) { return l.Pow(x, y); });
+#else
+            for (std::size_t k = 0; k < n; ++k) {
+                dst[k] = power(a[k], b[k]);
+            }
+#endif
+            break;
+        case Opcode::Call:
+            switch (i.m_function) {
+            case Builtin::Sqrt: unary(a, dst, n, [](auto l, auto x) { return l.Sqrt(x); }); break;
+            case Builtin::Abs: unary(a, dst, n, [](auto l, auto x) { return l.Abs(x); }); break;
+            case Builtin::Floor: unary(a, dst, n, [](auto l, auto x) { return l.Floor(x); }); break;
+            case Builtin::Ceil: unary(a, dst, n, [](auto l, auto x) { return l.Ceil(x); }); break;
+            default:
+                for (std::size_t k = 0; k < n; ++k) {
+                    dst[k] = apply(i.m_function, a[k]);
+                }
+                break;
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,619 @@
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+
+namespace ast {
+
+    // Growable character buffer for the printers below. With a file descriptor it is written out whenever a block
+    // of blockSize bytes has been filled (and on Flush() and destruction); without one it just accumulates the text.
+    class OutputBuffer
+    {
+    public:
+        explicit OutputBuffer(int fd = -1, std::size_t blockSize = 1 << 20)
+            : m_fd(fd), m_blockSize(blockSize) {}
+
+        ~OutputBuffer()
+        {
+            Flush();
+        }
+
+        OutputBuffer(const OutputBuffer& other) = delete;
+        OutputBuffer& operator=(const OutputBuffer& other) = delete;
+
+        void Put(char c)
+        {
+            *Reserve(1) = c;
+            ++m_size;
+        }
+
+        void Write(std::string_view text)
+        {
+            if (text.empty()) {
+                return;
+            }
+            std::memcpy(Reserve(text.size()), text.data(), text.size());
+            m_size += text.size();
+        }
+
+        // shortest representation that reads back to the same value
+        void Write(double d)
+        {
+            char* p = Reserve(MaxNumberLength);
+            m_size = static_cast<std::size_t>(std::to_chars(p, p + MaxNumberLength, d).ptr - m_data.get());
+        }
+
+        void Write(int i)
+        {
+            char* p = Reserve(MaxNumberLength);
+            m_size = static_cast<std::size_t>(std::to_chars(p, p + MaxNumberLength, i).ptr - m_data.get());
+        }
+
+        // The text not yet flushed; everything written, for a buffer without a file descriptor.
+        std::string_view View() const
+        {
+            return std::string_view(m_data.get(), m_size);
+        }
+
+        void Flush()
+        {
+            if (m_fd < 0) {
+                return;
+            }
+            const char* p = m_data.get();
+            std::size_t left = m_size;
+            while (left > 0 && !m_failed) {
+#ifdef _WIN32
+                int written = _write(m_fd, p, static_cast<unsigned>(left));
+#else
+                auto written = ::write(m_fd, p, left);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+#endif
+                if (written <= 0) {
+                    m_failed = true;
+                    break;
+                }
+                p += written;
+                left -= static_cast<std::size_t>(written);
+            }
+            m_size = 0;
+        }
+
+        // whether a write to the file descriptor failed; later output is dropped
+        bool Failed() const
+        {
+            return m_failed;
+        }
+
+    private:
+        static constexpr std::size_t MaxNumberLength = 32;
+
+        // Makes room for n more characters and returns where they go.
+        char* Reserve(std::size_t n)
+        {
+            if (m_size + n > m_capacity) {
+                if (m_fd >= 0 && m_size > 0) {
+                    Flush();
+                }
+                if (m_size + n > m_capacity) {
+                    Grow(m_size + n);
+                }
+            }
+            return m_data.get() + m_size;
+        }
+
+        void Grow(std::size_t minCapacity)
+        {
+            std::size_t capacity = m_capacity == 0 ? m_blockSize : m_capacity * 2;
+            while (capacity < minCapacity) {
+                capacity *= 2;
+            }
+            auto data = std::make_unique_for_overwrite<char[]>(capacity);
+            if (m_size > 0) {
+                std::memcpy(data.get(), m_data.get(), m_size);
+            }
+            m_data = std::move(data);
+            m_capacity = capacity;
+        }
+
+        int m_fd;
+        std::size_t m_blockSize;
+        std::unique_ptr<char[]> m_data;
+        std::size_t m_size = 0;
+        std::size_t m_capacity = 0;
+        bool m_failed = false;
+    };
+
+    inline std::string_view unary_op_token(UnaryOp op)
+    {
+        switch (op) {
+        case UnaryOp::Not:
+            return "not";
+        case UnaryOp::Plus:
+            return "+";
+        case UnaryOp::Minus:
+            return "-";
+        case UnaryOp::DotPlus:
+            return ".+";
+        case UnaryOp::DotMinus:
+            return ".-";
+        }
+        return "";
+    }
+
+    inline std::string_view binary_op_token(BinaryOp op)
+    {
+        switch (op) {
+        case BinaryOp::Or:
+            return "or";
+        case BinaryOp::And:
+            return "and";
+        case BinaryOp::Less:
+            return "<";
+        case BinaryOp::LessEqual:
+            return "<=";
+        case BinaryOp::Greater:
+            return ">";
+        case BinaryOp::GreaterEqual:
+            return ">=";
+        case BinaryOp::Equal:
+            return "==";
+        case BinaryOp::NotEqual:
+            return "<>";
+        case BinaryOp::Add:
+            return "+";
+        case BinaryOp::Sub:
+            return "-";
+        case BinaryOp::AddElemWise:
+            return ".+";
+        case BinaryOp::SubElemWise:
+            return ".-";
+        case BinaryOp::Mul:
+            return "*";
+        case BinaryOp::Div:
+            return "/";
+        case BinaryOp::MulElemWise:
+            return ".*";
+        case BinaryOp::DivElemWise:
+            return "./";
+        case BinaryOp::Pow:
+            return "^";
+        case BinaryOp::PowElemWise:
+            return ".^";
+        }
+        return "";
+    }
+
+    // Visitor state writing the same tree dump as PrintVisitor, except that reals are printed in their shortest
+    // round-trip form rather than with the six significant digits of an ostream.
+    struct TreeWriter
+    {
+        OutputBuffer& m_out;
+    };
+
+    // Visitor state writing Modelica source that parses back to the same tree. Parentheses are only emitted where
+    // the grammar needs them.
+    struct SourceWriter
+    {
+        OutputBuffer& m_out;
+    };
+
+}
+
+// Both writers walk the tree with walk() rather than visiting each child in turn, so that deep trees do not take
+// a call frame per level; what goes between the children of a node is decided from a stack of the nodes above.
+
+template <> struct ast::visitor<ast::Expression, ast::TreeWriter>
+{
+    static void visit(const Expression& e, TreeWriter& w);
+};
+
+template <> struct ast::visitor<ast::Expression, ast::SourceWriter>
+{
+    static void visit(const Expression& e, SourceWriter& w);
+};
+
+namespace ast {
+
+    inline void write_identifier(std::string_view name, OutputBuffer& out)
+    {
+        if (name.empty() || name.front() != '\'') {
+            out.Write(name);
+            return;
+        }
+        // quoted identifiers are interned with their quotes but with the escapes resolved
+        out.Put('\'');
+        for (char c : name.substr(1, name.size() - 2)) {
+            if (c == '\'' || c == '\\') {
+                out.Put('\\');
+            }
+            out.Put(c);
+        }
+        out.Put('\'');
+    }
+
+    inline void write_string_literal(std::string_view text, OutputBuffer& out)
+    {
+        out.Put('"');
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out.Put('\\');
+            }
+            out.Put(c);
+        }
+        out.Put('"');
+    }
+
+    inline void write_tree_literal(const LiteralExpression& e, OutputBuffer& out)
+    {
+        switch (e.m_type) {
+        case LiteralType::Real:
+            out.Write(std::get<double>(e.m_value));
+            break;
+        case LiteralType::Integer:
+            out.Write(std::get<int>(e.m_value));
+            break;
+        case LiteralType::Boolean:
+            out.Write(std::get<bool>(e.m_value) ? "true" : "false");
+            break;
+        case LiteralType::String:
+            out.Write(std::get<SourceString>(e.m_value).View());
+            break;
+        case LiteralType::IndexEnd:
+            out.Write("end");
+            break;
+        }
+    }
+
+    inline void write_source_literal(const LiteralExpression& e, OutputBuffer& out)
+    {
+        switch (e.m_type) {
+        case LiteralType::Real: {
+            // keep reals recognisable as such: 1.0 must not come back as the integer 1
+            char text[32];
+            std::string_view number(text, static_cast<std::size_t>(std::to_chars(text, text + sizeof(text), std::get<double>(e.m_value)).ptr - text));
+            out.Write(number);
+            if (number.find_first_of(".e") == std::string_view::npos) {
+                out.Write(".0");
+            }
+            break;
+        }
+        case LiteralType::Integer:
+            out.Write(std::get<int>(e.m_value));
+            break;
+        case LiteralType::Boolean:
+            out.Write(std::get<bool>(e.m_value) ? "true" : "false");
+            break;
+        case LiteralType::String:
+            write_string_literal(std::get<SourceString>(e.m_value).View(), out);
+            break;
+        case LiteralType::IndexEnd:
+            out.Write("end");
+            break;
+        }
+    }
+
+    // Operator levels of the Modelica grammar, loosest first, for deciding where the unparser needs parentheses.
+    enum class SourcePrecedence
+    {
+        If,
+        Range,
+        LogicalOr,
+        LogicalAnd,
+        LogicalNot,
+        Relational,
+        Additive, // includes a leading unary +/- and negative numbers
+        Multiplicative,
+        Power,
+        Primary,
+    };
+
+    inline SourcePrecedence source_precedence(BinaryOp op)
+    {
+        switch (op) {
+        case BinaryOp::Or:
+            return SourcePrecedence::LogicalOr;
+        case BinaryOp::And:
+            return SourcePrecedence::LogicalAnd;
+        case BinaryOp::Less:
+        case BinaryOp::LessEqual:
+        case BinaryOp::Greater:
+        case BinaryOp::GreaterEqual:
+        case BinaryOp::Equal:
+        case BinaryOp::NotEqual:
+            return SourcePrecedence::Relational;
+        case BinaryOp::Add:
+        case BinaryOp::Sub:
+        case BinaryOp::AddElemWise:
+        case BinaryOp::SubElemWise:
+            return SourcePrecedence::Additive;
+        case BinaryOp::Mul:
+        case BinaryOp::Div:
+        case BinaryOp::MulElemWise:
+        case BinaryOp::DivElemWise:
+            return SourcePrecedence::Multiplicative;
+        default:
+            return SourcePrecedence::Power;
+        }
+    }
+
+    inline SourcePrecedence source_precedence(const Expression& e)
+    {
+        return std::visit([](auto& node) {
+            using Node = typename std::remove_cvref_t<decltype(node)>::element_type;
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                return SourcePrecedence::If;
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                return SourcePrecedence::Range;
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                return node->m_op == UnaryOp::Not ? SourcePrecedence::LogicalNot : SourcePrecedence::Additive;
+            }
+            else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                return source_precedence(node->m_op);
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                bool negative = (node->m_type == LiteralType::Real && std::signbit(std::get<double>(node->m_value)))
+                    || (node->m_type == LiteralType::Integer && std::get<int>(node->m_value) < 0);
+                return negative ? SourcePrecedence::Additive : SourcePrecedence::Primary;
+            }
+            else {
+                return SourcePrecedence::Primary;
+            }
+        }, e.m_expr);
+    }
+
+    inline SourcePrecedence tighter(SourcePrecedence p)
+    {
+        return static_cast<SourcePrecedence>(static_cast<int>(p) + 1);
+    }
+
+}
+
+inline void ast::visitor<ast::Expression, ast::TreeWriter>::visit(const Expression& root, TreeWriter& w)
+{
+    struct Frame
+    {
+        std::size_t m_children = 0;
+        // the reference of a call or component while it is written around its subscripts
+        std::optional<ReferenceCursor> m_reference;
+    };
+    std::vector<Frame> stack;
+    OutputBuffer& out = w.m_out;
+    auto text = [&out](std::string_view s) { out.Write(s); };
+    auto name = [&out](std::string_view s) { write_identifier(s, out); };
+    walk(root, [&](const Expression& e) {
+        if (!stack.empty()) {
+            // a subscript goes where the reference has got to; arguments and operands are separated by commas
+            Frame& parent = stack.back();
+            if (!parent.m_reference.has_value() || !parent.m_reference->Advance(text, name)) {
+                if (parent.m_reference.has_value() || parent.m_children > 0) {
+                    out.Write(", ");
+                }
+                parent.m_reference.reset();
+            }
+            ++parent.m_children;
+        }
+        Frame& frame = stack.emplace_back();
+        std::visit([&](auto& node) {
+            using Node = typename std::remove_cvref_t<decltype(node)>::element_type;
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                out.Write("If(");
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                out.Write("UnaryOp(");
+                out.Write(node->m_op == UnaryOp::Not ? "!" : unary_op_token(node->m_op));
+                out.Write(", ");
+            }
+            else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                out.Write("BinaryOp(");
+                out.Write(binary_op_token(node->m_op));
+                out.Write(", ");
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                out.Write("FunctionCall(");
+                frame.m_reference.emplace(node->m_functionName);
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                out.Write("Literal(");
+                write_tree_literal(*node, out);
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                out.Write("ArrayRange(");
+            }
+            else if constexpr (std::is_same_v<Node, ComponentExpression>) {
+                out.Write("Component(");
+                frame.m_reference.emplace(node->m_componentRef);
+            }
+        }, e.m_expr);
+    }, [&](const Expression&) {
+        Frame& frame = stack.back();
+        if (frame.m_reference.has_value()) {
+            frame.m_reference->Advance(text, name);
+        }
+        out.Put(')');
+        stack.pop_back();
+    });
+}
+
+inline void ast::visitor<ast::Expression, ast::SourceWriter>::visit(const Expression& root, SourceWriter& w)
+{
+    struct Frame
+    {
+        const Expression* m_expr;
+        std::size_t m_children = 0;
+        bool m_parens = false;
+        // the reference of a call or component while it is written around its subscripts
+        std::optional<ReferenceCursor> m_reference;
+    };
+    std::vector<Frame> stack;
+    OutputBuffer& out = w.m_out;
+    auto text = [&out](std::string_view s) { out.Write(s); };
+    auto name = [&out](std::string_view s) { write_identifier(s, out); };
+    walk(root, [&](const Expression& e) {
+        // writes what goes before the next child of the parent and returns how tightly that child has to bind
+        SourcePrecedence required = SourcePrecedence::If;
+        if (!stack.empty()) {
+            Frame& parent = stack.back();
+            std::size_t i = parent.m_children++;
+            required = std::visit([&](auto& node) {
+                using Node = typename std::remove_cvref_t<decltype(node)>::element_type;
+                if constexpr (std::is_same_v<Node, IfExpression>) {
+                    out.Write(i == 1 ? " then " : i == 2 ? " else " : "");
+                    return SourcePrecedence::If;
+                }
+                else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                    // 'not' takes a relation, a leading +/- the term after it
+                    return tighter(node->m_op == UnaryOp::Not ? SourcePrecedence::LogicalNot : SourcePrecedence::Additive);
+                }
+                else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                    // and/or and the arithmetic operators associate to the left; relations and powers do not chain at all
+                    SourcePrecedence precedence = source_precedence(node->m_op);
+                    if (i == 0) {
+                        bool chains = precedence != SourcePrecedence::Relational && precedence != SourcePrecedence::Power;
+                        return chains ? precedence : tighter(precedence);
+                    }
+                    out.Put(' ');
+                    out.Write(binary_op_token(node->m_op));
+                    out.Put(' ');
+                    return tighter(precedence);
+                }
+                else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                    if (i > 0) {
+                        out.Put(':');
+                    }
+                    return SourcePrecedence::LogicalOr;
+                }
+                else {
+                    // subscripts and call arguments are full expressions and never need parentheses
+                    if (!parent.m_reference.has_value() || !parent.m_reference->Advance(text, name)) {
+                        out.Write(parent.m_reference.has_value() ? "(" : ", ");
+                        parent.m_reference.reset();
+                    }
+                    return SourcePrecedence::If;
+                }
+            }, parent.m_expr->m_expr);
+        }
+        bool parens = source_precedence(e) < required;
+        if (parens) {
+            out.Put('(');
+        }
+        Frame& frame = stack.emplace_back(Frame{ &e, 0, parens });
+        std::visit([&](auto& node) {
+            using Node = typename std::remove_cvref_t<decltype(node)>::element_type;
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                out.Write("if ");
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                out.Write(unary_op_token(node->m_op));
+                if (node->m_op == UnaryOp::Not) {
+                    out.Put(' ');
+                }
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                frame.m_reference.emplace(node->m_functionName);
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                write_source_literal(*node, out);
+            }
+            else if constexpr (std::is_same_v<Node, ComponentExpression>) {
+                frame.m_reference.emplace(node->m_componentRef);
+            }
+        }, e.m_expr);
+    }, [&](const Expression&) {
+        Frame& frame = stack.back();
+        bool call = std::holds_alternative<FunctionCallExpressionPtr>(frame.m_expr->m_expr);
+        if (frame.m_reference.has_value()) {
+            frame.m_reference->Advance(text, name);
+            if (call) {
+                out.Put('(');
+            }
+        }
+        if (call) {
+            out.Put(')');
+        }
+        if (frame.m_parens) {
+            out.Put(')');
+        }
+        stack.pop_back();
+    });
+}
+
+namespace ast {
+
+    inline void write_modification(const ClassModification& mod, SourceWriter& w)
+    {
+        w.m_out.Put('(');
+        for (std::size_t i = 0; i < mod.m_arguments.size(); ++i) {
+            auto& arg = mod.m_arguments[i];
+            if (i > 0) {
+                w.m_out.Write(", ");
+            }
+            if (arg.m_each) {
+                w.m_out.Write("each ");
+            }
+            if (arg.m_final) {
+                w.m_out.Write("final ");
+            }
+            for (std::size_t j = 0; j < arg.m_name.size(); ++j) {
+                if (j > 0) {
+                    w.m_out.Put('.');
+                }
+                w.m_out.Write(name_of(arg.m_name[j]));
+            }
+            if (arg.m_modification.has_value()) {
+                write_modification(arg.m_modification.value(), w);
+            }
+            if (arg.m_value.has_value()) {
+                w.m_out.Write(" = ");
+                AST_VISIT(arg.m_value.value(), w);
+            }
+            if (arg.m_description.has_value()) {
+                w.m_out.Put(' ');
+                write_string_literal(arg.m_description->View(), w.m_out);
+            }
+        }
+        w.m_out.Put(')');
+    }
+
+    // Writes the description after an expression; an annotation is copied from its source text unless the caller
+    // passes its parsed modification.
+    inline void write_description(const Description& desc, SourceWriter& w, const ClassModification* annotation = nullptr)
+    {
+        if (desc.m_text.has_value()) {
+            w.m_out.Put(' ');
+            write_string_literal(desc.m_text->View(), w.m_out);
+        }
+        if (annotation != nullptr) {
+            w.m_out.Write(" annotation");
+            write_modification(*annotation, w);
+        }
+        else if (desc.m_annotation.has_value()) {
+            w.m_out.Write(" annotation");
+            w.m_out.Write(desc.m_annotation->m_body);
+        }
+    }
+
+}
@@ -0,0 +1,447 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+#include "Evaluation.hpp"
+
+// Register bytecode for scalar expressions (see Evaluation.hpp for what evaluates). A program runs on a file of
+// double registers laid out as its constants, then the variables it reads, then temporaries: constants are loaded
+// once, the variables are gathered from their pre-resolved slots at the start of a run, and the instructions only
+// ever address registers, so the loop does no lookups and has no load or move instructions.
+namespace ast {
+
+    enum class Opcode : std::uint8_t
+    {
+        Neg,
+        Not,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Pow,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Equal,
+        NotEqual,
+        And,
+        Or,
+        Select, // m_dst = m_a != 0 ? m_b : m_c
+        Call,   // m_dst = m_function(m_a)
+    };
+
+    struct Instruction
+    {
+        Opcode m_op;
+        Builtin m_function; // of a Call
+        std::uint16_t m_dst;
+        std::uint16_t m_a;
+        std::uint16_t m_b;
+        std::uint16_t m_c;
+    };
+
+    struct Program
+    {
+        std::vector<Instruction> m_code;
+        std::vector<double> m_constants;   // registers [0, constants)
+        std::vector<std::uint32_t> m_inputs; // slots of the registers [constants, constants + inputs)
+        std::uint32_t m_registers = 0;
+        std::uint16_t m_result = 0;
+    };
+
+    struct CompileResult
+    {
+        std::optional<Program> m_program;
+        std::string m_error;
+        SourceSpan m_where;       // of the expression that could not be compiled
+        std::size_t m_shared = 0; // operations of the tree that reuse the instruction of an equal one
+    };
+
+    namespace bytecode {
+
+        inline Opcode opcode_of(BinaryOp op)
+        {
+            switch (op) {
+            case BinaryOp::Or: return Opcode::Or;
+            case BinaryOp::And: return Opcode::And;
+            case BinaryOp::Less: return Opcode::Less;
+            case BinaryOp::LessEqual: return Opcode::LessEqual;
+            case BinaryOp::Greater: return Opcode::Greater;
+            case BinaryOp::GreaterEqual: return Opcode::GreaterEqual;
+            case BinaryOp::Equal: return Opcode::Equal;
+            case BinaryOp::NotEqual: return Opcode::NotEqual;
+            case BinaryOp::Add:
+            case BinaryOp::AddElemWise: return Opcode::Add;
+            case BinaryOp::Sub:
+            case BinaryOp::SubElemWise: return Opcode::Sub;
+            case BinaryOp::Mul:
+            case BinaryOp::MulElemWise: return Opcode::Mul;
+            case BinaryOp::Div:
+            case BinaryOp::DivElemWise: return Opcode::Div;
+            default: return Opcode::Pow;
+            }
+        }
+
+        // Emits code bottom-up in one post-order walk, with the operands computed so far on a stack. An operation equal
+        // to one emitted before, the same opcode on the same operands, is not emitted again but reuses its result, so
+        // a subexpression repeated in the tree is computed once. Registers are numbered per kind and temporaries are
+        // given out once the code is complete: a temporary is released after the last instruction reading it, and
+        // the result of an operation reuses a released operand register, so a left-deep chain of any length needs a
+        // single temporary.
+        class Compiler
+        {
+        public:
+            explicit Compiler(VariableSlots& slots)
+                : m_slots(slots) {}
+
+            CompileResult Compile(const Expression& root)
+            {
+                walk(root, [this](const Expression& e) {
+                    // the subscripts of references and the names of calls are checked in the post step
+                    return m_error.empty() && !std::holds_alternative<ComponentExpressionPtr>(e.m_expr);
+                }, [this](const Expression& e) {
+                    if (m_error.empty()) {
+                        std::visit([&](auto& ptr) { Emit(e, *ptr); }, e.m_expr);
+                    }
+                });
+                CompileResult result;
+                if (!m_error.empty()) {
+                    result.m_error = std::move(m_error);
+                    result.m_where = m_where;
+                    return result;
+                }
+                result.m_shared = m_reused;
+                Allocate();
+                std::size_t registers = m_constants.size() + m_inputs.size() + m_temporaries;
+                if (registers > 0xFFFF) {
+                    result.m_error = "expression needs too many registers";
+                    result.m_where = root.m_span;
+                    return result;
+                }
+                Program program;
+                program.m_registers = static_cast<std::uint32_t>(registers);
+                program.m_result = Lay(m_operands.back());
+                program.m_code.reserve(m_code.size());
+                for (auto& i : m_code) {
+                    program.m_code.push_back(Instruction{ i.m_op, i.m_function, Register(i.m_dst.m_index), Lay(i.m_a), Lay(i.m_b), Lay(i.m_c) });
+                }
+                program.m_constants = std::move(m_constants);
+                program.m_inputs = std::move(m_inputs);
+                result.m_program = std::move(program);
+                return result;
+            }
+
+        private:
+            enum class Bank : std::uint8_t
+            {
+                Constant,
+                Input,
+                Temporary,
+            };
+
+            struct Operand
+            {
+                Bank m_bank = Bank::Temporary;
+                std::uint32_t m_index = 0;
+            };
+
+            // While compiling, the temporary of an operation is the index of its instruction, until Allocate() gives
+            // it a register in m_dst.
+            struct Pending
+            {
+                Opcode m_op;
+                Builtin m_function;
+                std::uint8_t m_arity;
+                Operand m_dst;
+                Operand m_a;
+                Operand m_b;
+                Operand m_c;
+
+                bool operator==(const Pending& other) const
+                {
+                    auto same = [](Operand x, Operand y) { return x.m_bank == y.m_bank && x.m_index == y.m_index; };
+                    return m_op == other.m_op && m_function == other.m_function && m_arity == other.m_arity && same(m_a, other.m_a)
+                        && (m_arity < 2 || same(m_b, other.m_b)) && (m_arity < 3 || same(m_c, other.m_c));
+                }
+            };
+
+            std::uint16_t Lay(Operand operand) const
+            {
+                switch (operand.m_bank) {
+                case Bank::Constant:
+                    return static_cast<std::uint16_t>(operand.m_index);
+                case Bank::Input:
+                    return static_cast<std::uint16_t>(m_constants.size() + operand.m_index);
+                default:
+                    return Register(m_code[operand.m_index].m_dst.m_index);
+                }
+            }
+
+            std::uint16_t Register(std::uint32_t temporary) const
+            {
+                return static_cast<std::uint16_t>(m_constants.size() + m_inputs.size() + temporary);
+            }
+
+            void Fail(const Expression& e, const char* error)
+            {
+                m_error = error;
+                m_where = e.m_span;
+            }
+
+            Operand Pop()
+            {
+                Operand operand = m_operands.back();
+                m_operands.pop_back();
+                return operand;
+            }
+
+            static std::uint64_t mix(std::uint64_t hash, std::uint64_t value)
+            {
+                hash = (hash ^ value) * 0x9E3779B97F4A7C15ull;
+                return hash ^ (hash >> 32);
+            }
+
+            static std::uint64_t Hash(const Pending& pending)
+            {
+                std::uint64_t hash = mix(mix(0, static_cast<std::uint64_t>(pending.m_op)), static_cast<std::uint64_t>(pending.m_function));
+                const Operand* operands[] = { &pending.m_a, &pending.m_b, &pending.m_c };
+                for (std::size_t i = 0; i < pending.m_arity; ++i) {
+                    hash = mix(hash, static_cast<std::uint64_t>(operands[i]->m_bank) << 32 | operands[i]->m_index);
+                }
+                return hash;
+            }
+
+            // Emits an operation on the given operands, unless an equal one has been emitted before, and makes its
+            // result an operand in turn.
+            void Result(Opcode op, std::initializer_list<Operand> operands, Builtin function = {})
+            {
+                Pending pending{ op, function, static_cast<std::uint8_t>(operands.size()), {}, {}, {}, {} };
+                Operand* slot[] = { &pending.m_a, &pending.m_b, &pending.m_c };
+                std::size_t n = 0;
+                for (Operand operand : operands) {
+                    *slot[n++] = operand;
+                }
+                std::uint64_t hash = Hash(pending);
+                auto [first, last] = m_shared.equal_range(hash);
+                for (auto it = first; it != last; ++it) {
+                    if (m_code[it->second] == pending) {
+                        ++m_reused;
+                        m_operands.push_back(Operand{ Bank::Temporary, it->second });
+                        return;
+                    }
+                }
+                auto index = static_cast<std::uint32_t>(m_code.size());
+                m_shared.emplace(hash, index);
+                m_code.push_back(pending);
+                m_operands.push_back(Operand{ Bank::Temporary, index });
+            }
+
+            // Gives every instruction a result register, reusing the register of a temporary once the instruction
+            // reading it last has read it.
+            void Allocate()
+            {
+                std::vector<std::uint32_t> uses(m_code.size());
+                for (const Pending& pending : m_code) {
+                    const Operand* operands[] = { &pending.m_a, &pending.m_b, &pending.m_c };
+                    for (std::size_t i = 0; i < pending.m_arity; ++i) {
+                        if (operands[i]->m_bank == Bank::Temporary) {
+                            ++uses[operands[i]->m_index];
+                        }
+                    }
+                }
+                if (m_operands.back().m_bank == Bank::Temporary) {
+                    ++uses[m_operands.back().m_index]; // the result is never released
+                }
+                std::vector<std::uint32_t> free;
+                for (Pending& pending : m_code) {
+                    const Operand* operands[] = { &pending.m_a, &pending.m_b, &pending.m_c };
+                    for (std::size_t i = 0; i < pending.m_arity; ++i) {
+                        // an operand used twice is released at its second use
+                        if (operands[i]->m_bank == Bank::Temporary && --uses[operands[i]->m_index] == 0) {
+                            free.push_back(m_code[operands[i]->m_index].m_dst.m_index);
+                        }
+                    }
+                    if (!free.empty()) {
+                        pending.m_dst = Operand{ Bank::Temporary, free.back() };
+                        free.pop_back();
+                    }
+                    else {
+                        pending.m_dst = Operand{ Bank::Temporary, m_temporaries++ };
+                    }
+                }
+            }
+
+            void Emit(const Expression&, const IfExpression&)
+            {
+                // both branches are computed and one selected: expressions have no side effects, and straight-line
+                // code keeps the dispatch loop free of jumps
+                Operand otherwise = Pop();
+                Operand then = Pop();
+                Operand condition = Pop();
+                Result(Opcode::Select, { condition, then, otherwise });
+            }
+
+            void Emit(const Expression&, const UnaryOpExpression& e)
+            {
+                if (e.m_op == UnaryOp::Plus || e.m_op == UnaryOp::DotPlus) {
+                    return; // the operand is the result
+                }
+                Result(e.m_op == UnaryOp::Not ? Opcode::Not : Opcode::Neg, { Pop() });
+            }
+
+            void Emit(const Expression&, const BinaryOpExpression& e)
+            {
+                Operand right = Pop();
+                Operand left = Pop();
+                if (is_square(e)) {
+                    return Result(Opcode::Mul, { left, left }); // the exponent is a constant and is not read
+                }
+                Result(opcode_of(e.m_op), { left, right });
+            }
+
+            void Emit(const Expression& node, const FunctionCallExpression& e)
+            {
+                auto function = find_builtin(e.m_functionName);
+                if (!function.has_value()) {
+                    return Fail(node, "only calls of builtin functions of one argument can be compiled");
+                }
+                if (e.m_arguments.size() != 1) {
+                    return Fail(node, "builtin function takes one argument");
+                }
+                Result(Opcode::Call, { Pop() }, function.value());
+            }
+
+            void Emit(const Expression& node, const LiteralExpression& e)
+            {
+                double value = 0.;
+                switch (e.m_type) {
+                case LiteralType::Real:
+                    value = std::get<double>(e.m_value);
+                    break;
+                case LiteralType::Integer:
+                    value = std::get<int>(e.m_value);
+                    break;
+                case LiteralType::Boolean:
+                    value = std::get<bool>(e.m_value) ? 1. : 0.;
+                    break;
+                default:
+                    return Fail(node, "only numeric and Boolean literals can be compiled");
+                }
+                // equal constants share a register; compared by bits, so that 0.0 and -0.0 stay apart
+                auto [it, added] = m_constantIndex.try_emplace(std::bit_cast<std::uint64_t>(value), static_cast<std::uint32_t>(m_constants.size()));
+                if (added) {
+                    m_constants.push_back(value);
+                }
+                m_operands.push_back(Operand{ Bank::Constant, it->second });
+            }
+
+            void Emit(const Expression& node, const ArrayRangeExpression&)
+            {
+                Fail(node, "array ranges can not be compiled");
+            }
+
+            void Emit(const Expression& node, const ComponentExpression& e)
+            {
+                if (!VariableSlots::Names(e.m_componentRef)) {
+                    return Fail(node, "subscripted component references can not be compiled");
+                }
+                std::uint32_t slot = m_slots.Slot(e.m_componentRef);
+                auto [it, added] = m_inputIndex.try_emplace(slot, static_cast<std::uint32_t>(m_inputs.size()));
+                if (added) {
+                    m_inputs.push_back(slot);
+                }
+                m_operands.push_back(Operand{ Bank::Input, it->second });
+            }
+
+            VariableSlots& m_slots;
+            std::vector<Pending> m_code;
+            std::vector<Operand> m_operands;
+            std::unordered_multimap<std::uint64_t, std::uint32_t> m_shared;
+            std::size_t m_reused = 0;
+            std::uint32_t m_temporaries = 0;
+            std::vector<double> m_constants;
+            std::unordered_map<std::uint64_t, std::uint32_t> m_constantIndex;
+            std::vector<std::uint32_t> m_inputs;
+            std::unordered_map<std::uint32_t, std::uint32_t> m_inputIndex;
+            std::string m_error;
+            SourceSpan m_where;
+        };
+
+    }
+
+    // Compiles a scalar expression, giving each variable it reads a slot in slots.
+    inline CompileResult compile(const Expression& e, VariableSlots& slots)
+    {
+        bytecode::Compiler compiler(slots);
+        return compiler.Compile(e);
+    }
+
+    // Runs a program over and over with its own register file; one machine per thread.
+    class Machine
+    {
+    public:
+        explicit Machine(const Program& program)
+            : m_program(program), m_registers(program.m_registers)
+        {
+            std::copy(program.m_constants.begin(), program.m_constants.end(), m_registers.begin());
+        }
+
+        // values holds the value of every variable by slot. Without a value for a variable the program reads the
+        // result is NaN, as from evaluate_naive.
+        double Run(std::span<const double> values)
+        {
+            double* r = m_registers.data();
+            double* inputs = r + m_program.m_constants.size();
+            const std::uint32_t* slots = m_program.m_inputs.data();
+            for (std::size_t i = 0, n = m_program.m_inputs.size(); i < n; ++i) {
+                if (slots[i] >= values.size()) {
+                    return std::numeric_limits<double>::quiet_NaN();
+                }
+                inputs[i] = values[slots[i]];
+            }
+            for (const Instruction& i : m_program.m_code) {
+                switch (i.m_op) {
+                case Opcode::Neg: r[i.m_dst] = -r[i.m_a]; break;
+                case Opcode::Not: r[i.m_dst] = r[i.m_a] == 0. ? 1. : 0.; break;
+                case Opcode::Add: r[i.m_dst] = r[i.m_a] + r[i.m_b]; break;
+                case Opcode::Sub: r[i.m_dst] = r[i.m_a] - r[i.m_b]; break;
+                case Opcode::Mul: r[i.m_dst] = r[i.m_a] * r[i.m_b]; break;
+                case Opcode::Div: r[i.m_dst] = r[i.m_a] / r[i.m_b]; break;
+                case Opcode::Pow: r[i.m_dst] = power(r[i.m_a], r[i.m_b]); break;
+                case Opcode::Less: r[i.m_dst] = r[i.m_a] < r[i.m_b] ? 1. : 0.; break;
+                case Opcode::LessEqual: r[i.m_dst] = r[i.m_a] <= r[i.m_b] ? 1. : 0.; break;
+                case Opcode::Greater: r[i.m_dst] = r[i.m_a] > r[i.m_b] ? 1. : 0.; break;
+                case Opcode::GreaterEqual: r[i.m_dst] = r[i.m_a] >= r[i.m_b] ? 1. : 0.; break;
+                case Opcode::Equal: r[i.m_dst] = r[i.m_a] == r[i.m_b] ? 1. : 0.; break;
+                case Opcode::NotEqual: r[i.m_dst] = r[i.m_a] != r[i.m_b] ? 1. : 0.; break;
+                case Opcode::And: r[i.m_dst] = r[i.m_a] != 0. && r[i.m_b] != 0. ? 1. : 0.; break;
+                case Opcode::Or: r[i.m_dst] = r[i.m_a] != 0. || r[i.m_b] != 0. ? 1. : 0.; break;
+                case Opcode::Select: r[i.m_dst] = r[i.m_a] != 0. ? r[i.m_b] : r[i.m_c]; break;
+                case Opcode::Call: r[i.m_dst] = apply(i.m_function, r[i.m_a]); break;
+                }
+            }
+            return r[m_program.m_result];
+        }
+
+    private:
+        const Program& m_program;
+        std::vector<double> m_registers;
+    };
+
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "Arena.hpp"
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+#include "Evaluation.hpp"
+
+namespace ast {
+
+    struct FoldStats
+    {
+        std::size_t m_nodesBefore = 0;
+        std::size_t m_nodesAfter = 0;
+        std::size_t m_folded = 0;     // operations on literals replaced by their value
+        std::size_t m_simplified = 0; // operations with a neutral literal operand replaced by the other operand
+        std::size_t m_pruned = 0;     // if expressions replaced by the branch their constant condition selects
+
+        std::ptrdiff_t Removed() const
+        {
+            return static_cast<std::ptrdiff_t>(m_nodesBefore) - static_cast<std::ptrdiff_t>(m_nodesAfter);
+        }
+    };
+
+    namespace folding {
+
+        inline std::optional<double> number(const LiteralExpression& lit)
+        {
+            if (lit.m_type == LiteralType::Real) {
+                return std::get<double>(lit.m_value);
+            }
+            if (lit.m_type == LiteralType::Integer) {
+                return std::get<int>(lit.m_value);
+            }
+            return std::nullopt;
+        }
+
+        inline LiteralExpression* literal(Expression& e)
+        {
+            auto* ptr = std::get_if<LiteralExpressionPtr>(&e.m_expr);
+            return ptr != nullptr ? ptr->get() : nullptr;
+        }
+
+        inline bool is_integer(const Expression& e, int value)
+        {
+            auto* ptr = std::get_if<LiteralExpressionPtr>(&e.m_expr);
+            return ptr != nullptr && (*ptr)->m_type == LiteralType::Integer && std::get<int>((*ptr)->m_value) == value;
+        }
+
+        inline std::optional<bool> boolean(const Expression& e)
+        {
+            auto* ptr = std::get_if<LiteralExpressionPtr>(&e.m_expr);
+            if (ptr == nullptr || (*ptr)->m_type != LiteralType::Boolean) {
+                return std::nullopt;
+            }
+            return std::get<bool>((*ptr)->m_value);
+        }
+
+        // Replaces e with one of the expressions below it, which keeps the span of e.
+        inline void replace(Expression& e, Expression& part)
+        {
+            Expression kept = std::move(part);
+            kept.m_span = e.m_span;
+            e = std::move(kept);
+        }
+
+        // Integer arithmetic that does not fit an int is not folded rather than wrapped around; the operation stays in
+        // the tree and nothing reports the overflow.
+        inline std::optional<LiteralExpression> integer(std::int64_t value)
+        {
+            if (value < std::numeric_limits<int>::min() || value > std::numeric_limits<int>::max()) {
+                return std::nullopt;
+            }
+            return LiteralExpression(static_cast<int>(value));
+        }
+
+        inline std::optional<LiteralExpression> real(double value)
+        {
+            if (!std::isfinite(value)) {
+                return std::nullopt;
+            }
+            return LiteralExpression(value);
+        }
+
+        template <typename T>
+        std::optional<LiteralExpression> compare(BinaryOp op, const T& a, const T& b)
+        {
+            switch (op) {
+            case BinaryOp::Less: return LiteralExpression(a < b);
+            case BinaryOp::LessEqual: return LiteralExpression(a <= b);
+            case BinaryOp::Greater: return LiteralExpression(a > b);
+            case BinaryOp::GreaterEqual: return LiteralExpression(a >= b);
+            case BinaryOp::Equal: return LiteralExpression(a == b);
+            case BinaryOp::NotEqual: return LiteralExpression(a != b);
+            default: return std::nullopt;
+            }
+        }
+
+        // The value of a binary operation on two literals with Modelica semantics: Integer operands give an Integer
+        // except for '/' and '^', which are always Real. Anything that would fail or overflow at run time is not folded.
+        inline std::optional<LiteralExpression> evaluate(BinaryOp op, const LiteralExpression& a, const LiteralExpression& b)
+        {
+            if (a.m_type == LiteralType::Boolean && b.m_type == LiteralType::Boolean) {
+                bool x = std::get<bool>(a.m_value);
+                bool y = std::get<bool>(b.m_value);
+                switch (op) {
+                case BinaryOp::Or: return LiteralExpression(x || y);
+                case BinaryOp::And: return LiteralExpression(x && y);
+                default: return compare(op, x, y);
+                }
+            }
+            if (a.m_type == LiteralType::String && b.m_type == LiteralType::String) {
+                std::string_view x = std::get<SourceString>(a.m_value).View();
+                std::string_view y = std::get<SourceString>(b.m_value).View();
+                if (op == BinaryOp::Add) {
+                    std::string joined(x);
+                    joined += y;
+                    return LiteralExpression(SourceString(std::move(joined)));
+                }
+                return compare(op, x, y);
+            }
+            auto x = number(a);
+            auto y = number(b);
+            if (!x.has_value() || !y.has_value()) {
+                return std::nullopt;
+            }
+            if (a.m_type == LiteralType::Integer && b.m_type == LiteralType::Integer) {
+                std::int64_t i = std::get<int>(a.m_value);
+                std::int64_t j = std::get<int>(b.m_value);
+                switch (op) {
+                case BinaryOp::Add:
+                case BinaryOp::AddElemWise:
+                    return integer(i + j);
+                case BinaryOp::Sub:
+                case BinaryOp::SubElemWise:
+                    return integer(i - j);
+                case BinaryOp::Mul:
+                case BinaryOp::MulElemWise:
+                    return integer(i * j);
+                default:
+                    break;
+                }
+            }
+            switch (op) {
+            case BinaryOp::Add:
+            case BinaryOp::AddElemWise:
+                return real(*x + *y);
+            case BinaryOp::Sub:
+            case BinaryOp::SubElemWise:
+                return real(*x - *y);
+            case BinaryOp::Mul:
+            case BinaryOp::MulElemWise:
+                return real(*x * *y);
+            case BinaryOp::Div:
+            case BinaryOp::DivElemWise:
+                return *y != 0. ? real(*x / *y) : std::nullopt;
+            case BinaryOp::Pow:
+            case BinaryOp::PowElemWise:
+                return real(power(*x, *y));
+            default:
+                return compare(op, *x, *y);
+            }
+        }
+
+        inline std::optional<LiteralExpression> evaluate(UnaryOp op, const LiteralExpression& a)
+        {
+            if (a.m_type == LiteralType::Boolean) {
+                return op == UnaryOp::Not ? std::optional(LiteralExpression(!std::get<bool>(a.m_value))) : std::nullopt;
+            }
+            if (op == UnaryOp::Not) {
+                return std::nullopt;
+            }
+            bool negate = op == UnaryOp::Minus || op == UnaryOp::DotMinus;
+            if (a.m_type == LiteralType::Integer) {
+                std::int64_t i = std::get<int>(a.m_value);
+                return integer(negate ? -i : i);
+            }
+            if (a.m_type == LiteralType::Real) {
+                double d = std::get<double>(a.m_value);
+                return LiteralExpression(negate ? -d : d);
+            }
+            return std::nullopt;
+        }
+
+        class Folder
+        {
+        public:
+            explicit Folder(FoldStats& stats)
+                : m_stats(stats) {}
+
+            void Fold(Expression& e)
+            {
+                std::visit([&](auto& ptr) { Fold(e, *ptr); }, e.m_expr);
+            }
+
+        private:
+            void Fold(Expression& e, IfExpression& node)
+            {
+                if (auto condition = boolean(node.m_condition)) {
+                    replace(e, condition.value() ? node.m_then : node.m_else);
+                    ++m_stats.m_pruned;
+                }
+            }
+
+            void Fold(Expression& e, UnaryOpExpression& node)
+            {
+                LiteralExpression* operand = literal(node.m_operand);
+                if (operand == nullptr) {
+                    if (node.m_op == UnaryOp::Plus || node.m_op == UnaryOp::DotPlus) {
+                        replace(e, node.m_operand);
+                        ++m_stats.m_simplified;
+                    }
+                    return;
+                }
+                if (auto value = evaluate(node.m_op, *operand)) {
+                    // the operand's node is reused for the result
+                    *operand = std::move(value.value());
+                    replace(e, node.m_operand);
+                    ++m_stats.m_folded;
+                }
+            }
+
+            void Fold(Expression& e, BinaryOpExpression& node)
+            {
+                LiteralExpression* left = literal(node.m_left);
+                LiteralExpression* right = literal(node.m_right);
+                if (left != nullptr && right != nullptr) {
+                    if (auto value = evaluate(node.m_op, *left, *right)) {
+                        *left = std::move(value.value());
+                        replace(e, node.m_left);
+                        ++m_stats.m_folded;
+                    }
+                    return;
+                }
+                if (Simplify(e, node)) {
+                    ++m_stats.m_simplified;
+                }
+            }
+
+            template <typename Node>
+            void Fold(Expression&, Node&) {}
+
+            // Removes an operand that leaves the other unchanged: Boolean literals in 'and'/'or', which decide the
+            // result or drop out, and Integer 0 and 1 in sums and products, which keep the type of the other operand.
+            // Expressions have no side effects, so a decided 'and'/'or' need not keep the other operand.
+            bool Simplify(Expression& e, BinaryOpExpression& node)
+            {
+                if (node.m_op == BinaryOp::And || node.m_op == BinaryOp::Or) {
+                    bool absorbing = node.m_op == BinaryOp::Or;
+                    if (auto left = boolean(node.m_left)) {
+                        replace(e, left.value() == absorbing ? node.m_left : node.m_right);
+                        return true;
+                    }
+                    if (auto right = boolean(node.m_right)) {
+                        replace(e, right.value() == absorbing ? node.m_right : node.m_left);
+                        return true;
+                    }
+                    return false;
+                }
+                switch (node.m_op) {
+                case BinaryOp::Add:
+                case BinaryOp::AddElemWise:
+                    if (is_integer(node.m_left, 0)) {
+                        replace(e, node.m_right);
+                        return true;
+                    }
+                    [[fallthrough]];
+                case BinaryOp::Sub:
+                case BinaryOp::SubElemWise:
+                    if (is_integer(node.m_right, 0)) {
+                        replace(e, node.m_left);
+                        return true;
+                    }
+                    return false;
+                case BinaryOp::Mul:
+                case BinaryOp::MulElemWise:
+                    if (is_integer(node.m_left, 1)) {
+                        replace(e, node.m_right);
+                        return true;
+                    }
+                    if (is_integer(node.m_right, 1)) {
+                        replace(e, node.m_left);
+                        return true;
+                    }
+                    return false;
+                default:
+                    return false;
+                }
+            }
+
+            FoldStats& m_stats;
+        };
+
+        inline std::size_t count_nodes(const Expression& root)
+        {
+            std::size_t count = 0;
+            walk_pre(root, [&count](const Expression&) { ++count; });
+            return count;
+        }
+
+    }
+
+    // Rewrites the tree in place: operations on literals are replaced by their value, if expressions with a literal
+    // condition by the branch taken and neutral operands are dropped. Powers are left alone, since x*x is Integer
+    // where x^2 is Real and can overflow where x^2 does not; the bytecode and native code square in doubles instead
+    // (see is_square). Children are folded before their parent, so folding propagates up in one pass. Replacements
+    // reuse the nodes of the tree; only joining two String literals allocates, a heap string for the text of the
+    // result. Replaced nodes stay in their arena until it goes away.
+    inline FoldStats fold_constants(Expression& root)
+    {
+        FoldStats stats;
+        folding::Folder folder(stats);
+        walk(root, [&stats](Expression&) { ++stats.m_nodesBefore; }, [&folder](Expression& e) { folder.Fold(e); });
+        stats.m_nodesAfter = folding::count_nodes(root);
+        return stats;
+    }
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MINIMODELICA_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// What the processor running the program can execute, for choosing kernels at run time and for telling apart code
+// built for different hosts.
+namespace cpu {
+
+    // The feature words of cpuid: leaf 1 ECX and EDX, leaf 7 EBX, ECX and EDX, extended leaf 1 ECX and EDX, and the
+    // low word of XCR0, which says what register state the operating system saves. All zero off x86.
+    struct Features
+    {
+        enum Word
+        {
+            Leaf1Ecx,
+            Leaf1Edx,
+            Leaf7Ebx,
+            Leaf7Ecx,
+            Leaf7Edx,
+            Extended1Ecx,
+            Extended1Edx,
+            Xcr0,
+        };
+
+        std::array<std::uint32_t, 8> m_words{};
+
+        bool Has(Word word, int bit) const
+        {
+            return (m_words[word] >> bit) & 1u;
+        }
+    };
+
+#ifdef MINIMODELICA_X86
+    namespace detail {
+
+        // EAX, EBX, ECX and EDX of a cpuid leaf, zero for leaves the processor does not have
+        inline std::array<std::uint32_t, 4> query(std::uint32_t leaf, std::uint32_t subleaf = 0)
+        {
+            std::array<std::uint32_t, 4> r{};
+#ifdef _MSC_VER
+            int max[4];
+            __cpuid(max, static_cast<int>(leaf & 0x80000000u));
+            if (static_cast<std::uint32_t>(max[0]) < leaf) {
+                return r;
+            }
+            int regs[4];
+            __cpuidex(regs, static_cast<int>(leaf), static_cast<int>(subleaf));
+            for (int i = 0; i < 4; ++i) {
+                r[i] = static_cast<std::uint32_t>(regs[i]);
+            }
+#else
+            if (__get_cpuid_max(leaf & 0x80000000u, nullptr) < leaf) {
+                return r;
+            }
+            __cpuid_count(leaf, subleaf, r[0], r[1], r[2], r[3]);
+#endif
+            return r;
+        }
+
+        inline std::uint32_t xcr0()
+        {
+#ifdef _MSC_VER
+            return static_cast<std::uint32_t>(_xgetbv(0));
+#else
+            std::uint32_t low = 0;
+            std::uint32_t high = 0;
+            __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+            return low;
+#endif
+        }
+
+    }
+#endif
+
+    // Read once per process.
+    inline const Features& features()
+    {
+        static const Features result = [] {
+            Features f;
+#ifdef MINIMODELICA_X86
+            auto leaf1 = detail::query(1);
+            auto leaf7 = detail::query(7);
+            auto extended1 = detail::query(0x80000001u);
+            f.m_words = { leaf1[2], leaf1[3], leaf7[1], leaf7[2], leaf7[3], extended1[2], extended1[3], 0 };
+            // xgetbv faults unless the operating system has enabled it
+            if (f.Has(Features::Leaf1Ecx, 27)) {
+                f.m_words[Features::Xcr0] = detail::xcr0();
+            }
+#endif
+            return f;
+        }();
+        return result;
+    }
+
+    // AVX2, with the operating system saving the YMM registers.
+    inline bool has_avx2()
+    {
+        const Features& f = features();
+        return f.Has(Features::Leaf1Ecx, 28) && f.Has(Features::Leaf1Ecx, 27) && (f.m_words[Features::Xcr0] & 0x6u) == 0x6u
+            && f.Has(Features::Leaf7Ebx, 5);
+    }
+
+    // Text that differs between hosts a compiler would build different code for with -march=native: the feature
+    // words on x86, otherwise the host name, which keeps code from being shared between hosts at all.
+    inline std::string host_target()
+    {
+#ifdef MINIMODELICA_X86
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string text = "x86";
+        for (std::uint32_t word : features().m_words) {
+            text += ' ';
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                text += digits[(word >> shift) & 0xF];
+            }
+        }
+        return text;
+#elif defined(_WIN32)
+        // cl has no -march=native; its code depends only on the flags, which are keyed anyway
+        return "";
+#else
+        char name[256] = {};
+        if (gethostname(name, sizeof(name) - 1) != 0) {
+            return "host";
+        }
+        return std::string("host ") + name;
+#endif
+    }
+
+}
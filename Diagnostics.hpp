@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "tao/pegtl.hpp"
+
+namespace peg = tao::pegtl;
+
+// The start offsets of the lines of a source text, for turning the byte offsets of node spans into lines and columns.
+// The text is only scanned on the first lookup, so a file costs nothing until a diagnostic about it is printed.
+// The text must outlive the index, and lookups are not thread safe.
+class LineIndex
+{
+public:
+    struct Location
+    {
+        std::size_t m_line = 0;
+        std::size_t m_column = 0;
+    };
+
+    explicit LineIndex(std::string_view text, std::string source = "")
+        : m_text(text), m_source(std::move(source)) {}
+
+    // 1-based line and byte column, counted as peg::position counts them
+    Location Locate(std::size_t byte) const
+    {
+        if (!m_built) {
+            Build();
+        }
+        auto line = std::upper_bound(m_starts.begin(), m_starts.end(), static_cast<std::uint32_t>(byte)) - 1;
+        return Location{ static_cast<std::size_t>(line - m_starts.begin()) + 1, byte - *line + 1 };
+    }
+
+    const std::string& Source() const
+    {
+        return m_source;
+    }
+
+private:
+    void Build() const
+    {
+        m_starts.push_back(0);
+        const char* p = m_text.data();
+        const char* end = p + m_text.size();
+        while (p != end) {
+            const void* eol = std::memchr(p, '\n', static_cast<std::size_t>(end - p));
+            if (eol == nullptr) {
+                break;
+            }
+            p = static_cast<const char*>(eol) + 1;
+            m_starts.push_back(static_cast<std::uint32_t>(p - m_text.data()));
+        }
+        m_built = true;
+    }
+
+    std::string_view m_text;
+    std::string m_source;
+    mutable std::vector<std::uint32_t> m_starts;
+    mutable bool m_built = false;
+};
+
+// One error found while parsing a text, at a byte offset into it. A parse reports all of them in one pass: builders
+// record errors instead of throwing, and syntax errors inside lists are recovered from at the next separator (see
+// list_recover). The line and column are only worked out when a diagnostic is printed, through the LineIndex of its
+// text, so reporting an error costs no scan of the text before it.
+struct Diagnostic
+{
+    std::size_t m_byte = 0;
+    std::string m_message;
+
+    // "source:line:column: message"
+    std::string ToString(const LineIndex& lines) const
+    {
+        LineIndex::Location location = lines.Locate(m_byte);
+        return lines.Source() + ":" + std::to_string(location.m_line) + ":" + std::to_string(location.m_column) + ": " + m_message;
+    }
+};
+
+// Makes a list the target of report_diagnostic on the current thread for the lifetime of the scope, in the same way
+// as ast::ArenaScope does for nodes, since the builders that detect errors have no access to the parse result.
+class DiagnosticScope
+{
+public:
+    explicit DiagnosticScope(std::vector<Diagnostic>& diagnostics)
+        : m_previous(s_current)
+    {
+        s_current = &diagnostics;
+    }
+
+    ~DiagnosticScope()
+    {
+        s_current = m_previous;
+    }
+
+    DiagnosticScope(const DiagnosticScope& other) = delete;
+    DiagnosticScope& operator=(const DiagnosticScope& other) = delete;
+
+    static std::vector<Diagnostic>* Current()
+    {
+        return s_current;
+    }
+
+private:
+    std::vector<Diagnostic>* m_previous;
+
+    inline static thread_local std::vector<Diagnostic>* s_current = nullptr;
+};
+
+// A syntax error at a byte offset of the input, raised by modelica_control in place of peg::parse_error, whose
+// position would have to be worked out when it is raised: on a lazily tracked input by counting the lines from the
+// start, for every error raised, even those recovered from.
+struct syntax_error : std::runtime_error
+{
+    syntax_error(std::size_t byte, const std::string& message)
+        : std::runtime_error(message), m_byte(byte) {}
+
+    std::size_t m_byte;
+};
+
+// Diagnostics reported outside of any scope are dropped.
+inline void report_diagnostic(std::size_t byte, std::string message)
+{
+    if (auto* diagnostics = DiagnosticScope::Current()) {
+        diagnostics->push_back(Diagnostic{ byte, std::move(message) });
+    }
+}
+
+inline void report_diagnostic(const syntax_error& e)
+{
+    report_diagnostic(e.m_byte, e.what());
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+
+// Numeric evaluation of scalar expressions. Every value is a double: Integers are exact up to 2^53 and Booleans are
+// 0 and 1, with any nonzero value counting as true. Variables are read from an array of values indexed by the slots
+// of a VariableSlots table. Strings, arrays, ranges, subscripts and calls of anything but the builtins below are not
+// evaluated.
+namespace ast {
+
+    enum class Builtin : std::uint8_t
+    {
+        Sin,
+        Cos,
+        Tan,
+        Asin,
+        Acos,
+        Atan,
+        Sinh,
+        Cosh,
+        Tanh,
+        Exp,
+        Log,
+        Log10,
+        Sqrt,
+        Abs,
+        Floor,
+        Ceil,
+    };
+
+    // The Modelica functions of one Real argument that evaluate to a C library call, in the order of Builtin.
+    inline constexpr std::array<std::string_view, 16> BuiltinNames = {
+        "sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh", "exp", "log", "log10", "sqrt", "abs", "floor", "ceil",
+    };
+
+    inline std::optional<Builtin> find_builtin(const ComponentReference& function)
+    {
+        if (function.Size() != 1 || !function.Subscripts(0).empty()) {
+            return std::nullopt;
+        }
+        std::string_view name = name_of(function.Name(0));
+        for (std::size_t i = 0; i < BuiltinNames.size(); ++i) {
+            if (BuiltinNames[i] == name) {
+                return static_cast<Builtin>(i);
+            }
+        }
+        return std::nullopt;
+    }
+
+    inline double apply(Builtin function, double x)
+    {
+        switch (function) {
+        case Builtin::Sin: return std::sin(x);
+        case Builtin::Cos: return std::cos(x);
+        case Builtin::Tan: return std::tan(x);
+        case Builtin::Asin: return std::asin(x);
+        case Builtin::Acos: return std::acos(x);
+        case Builtin::Atan: return std::atan(x);
+        case Builtin::Sinh: return std::sinh(x);
+        case Builtin::Cosh: return std::cosh(x);
+        case Builtin::Tanh: return std::tanh(x);
+        case Builtin::Exp: return std::exp(x);
+        case Builtin::Log: return std::log(x);
+        case Builtin::Log10: return std::log10(x);
+        case Builtin::Sqrt: return std::sqrt(x);
+        case Builtin::Abs: return std::fabs(x);
+        case Builtin::Floor: return std::floor(x);
+        case Builtin::Ceil: return std::ceil(x);
+        }
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    // Scalar semantics of the operators; the element-wise ones are the same on scalars.
+    inline double apply(UnaryOp op, double x)
+    {
+        switch (op) {
+        case UnaryOp::Not: return x == 0. ? 1. : 0.;
+        case UnaryOp::Minus:
+        case UnaryOp::DotMinus: return -x;
+        default: return x;
+        }
+    }
+
+    // The power operator of every evaluator, and of folding. A power that is a single correctly rounded operation is
+    // that operation: x^2 is the product, x^-1 the quotient and x^0.5 the square root, with the results std::pow
+    // gives for -0 and -inf. They are at least as accurate as std::pow, which need not round correctly, cost no call
+    // and have vector instructions (see BatchEvaluation.hpp). x^1 is x, and x^0 is 1 from std::pow for every x. The
+    // other powers are std::pow, x^3 among them, since a chain of products rounds more than once. The compiled
+    // backends square a literal exponent of 2 without the test (see is_square), and native code carries a copy of
+    // this function (see NativeCodegen.hpp); both give the same results to the bit.
+    inline double power(double a, double b)
+    {
+        if (b == 2.) {
+            return a * a;
+        }
+        if (b == 0.5) {
+            // std::pow(-0, 0.5) is +0 where the root is -0, and std::pow(-inf, 0.5) is +inf where the root is NaN
+            return a == -std::numeric_limits<double>::infinity() ? std::numeric_limits<double>::infinity() : std::sqrt(a) + 0.;
+        }
+        if (b == -1.) {
+            return 1. / a;
+        }
+        if (b == 1.) {
+            return a;
+        }
+        return std::pow(a, b);
+    }
+
+    inline double apply(BinaryOp op, double a, double b)
+    {
+        switch (op) {
+        case BinaryOp::Or: return a != 0. || b != 0. ? 1. : 0.;
+        case BinaryOp::And: return a != 0. && b != 0. ? 1. : 0.;
+        case BinaryOp::Less: return a < b ? 1. : 0.;
+        case BinaryOp::LessEqual: return a <= b ? 1. : 0.;
+        case BinaryOp::Greater: return a > b ? 1. : 0.;
+        case BinaryOp::GreaterEqual: return a >= b ? 1. : 0.;
+        case BinaryOp::Equal: return a == b ? 1. : 0.;
+        case BinaryOp::NotEqual: return a != b ? 1. : 0.;
+        case BinaryOp::Add:
+        case BinaryOp::AddElemWise: return a + b;
+        case BinaryOp::Sub:
+        case BinaryOp::SubElemWise: return a - b;
+        case BinaryOp::Mul:
+        case BinaryOp::MulElemWise: return a * b;
+        case BinaryOp::Div:
+        case BinaryOp::DivElemWise: return a / b;
+        default: return power(a, b);
+        }
+    }
+
+    // x^2 with a literal 2, which the compiled backends evaluate as x*x, the result of power, without the test. Higher
+    // powers are left to std::pow, since a chain of products rounds more than once.
+    inline bool is_square(const BinaryOpExpression& e)
+    {
+        if (e.m_op != BinaryOp::Pow && e.m_op != BinaryOp::PowElemWise) {
+            return false;
+        }
+        auto* ptr = std::get_if<LiteralExpressionPtr>(&e.m_right.m_expr);
+        if (ptr == nullptr) {
+            return false;
+        }
+        const LiteralExpression& exponent = **ptr;
+        return (exponent.m_type == LiteralType::Integer && std::get<int>(exponent.m_value) == 2)
+            || (exponent.m_type == LiteralType::Real && std::get<double>(exponent.m_value) == 2.);
+    }
+
+    // Numbers the variables of a model: each distinct unsubscripted component reference gets the next slot on first
+    // use. Evaluation reads the value of a variable at its slot.
+    class VariableSlots
+    {
+    public:
+        // Whether ref names a variable rather than an element of one.
+        static bool Names(const ComponentReference& ref)
+        {
+            for (std::size_t i = 0; i < ref.Size(); ++i) {
+                if (!ref.Subscripts(i).empty()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::uint32_t Slot(const ComponentReference& ref)
+        {
+            assert(Names(ref));
+            auto [it, added] = m_slots.try_emplace(Key(ref), static_cast<std::uint32_t>(m_names.size()));
+            if (added) {
+                m_names.push_back(it->first);
+            }
+            return it->second;
+        }
+
+        std::optional<std::uint32_t> Find(const ComponentReference& ref) const
+        {
+            if (!Names(ref)) {
+                return std::nullopt;
+            }
+            auto it = m_slots.find(Key(ref));
+            if (it == m_slots.end()) {
+                return std::nullopt;
+            }
+            return it->second;
+        }
+
+        std::size_t Size() const
+        {
+            return m_names.size();
+        }
+
+        // The dotted name of the variable at slot
+        const std::string& Name(std::uint32_t slot) const
+        {
+            return m_names[slot];
+        }
+
+    private:
+        // Built in a per-thread buffer, so lookups of names seen before do not allocate.
+        static const std::string& Key(const ComponentReference& ref)
+        {
+            thread_local std::string key;
+            key.clear();
+            if (ref.m_global) {
+                key += '.';
+            }
+            for (std::size_t i = 0; i < ref.Size(); ++i) {
+                if (i > 0) {
+                    key += '.';
+                }
+                key += name_of(ref.Name(i));
+            }
+            return key;
+        }
+
+        std::unordered_map<std::string, std::uint32_t> m_slots;
+        std::vector<std::string> m_names;
+    };
+
+    // Tree-walking evaluation straight off the AST, looking variables up by name at every use. It is the reference the
+    // compiled forms are checked and measured against. It walks with an explicit stack (see walk) and keeps the values
+    // of the operands evaluated so far on another, so any depth of tree evaluates, such as the left-deep chains of long
+    // sums. Both branches of an if expression are evaluated and one selected, as in the bytecode. What it cannot
+    // evaluate, such as unknown variables, gives NaN.
+    class NaiveEvaluator
+    {
+    public:
+        NaiveEvaluator(const VariableSlots& slots, std::span<const double> values)
+            : m_slots(slots), m_values(values) {}
+
+        double Evaluate(const Expression& root)
+        {
+            m_operands.clear();
+            walk(root, [this](const Expression& e) {
+                return std::visit([this](auto& ptr) { return Descend(*ptr); }, e.m_expr);
+            }, [this](const Expression& e) {
+                std::visit([this](auto& ptr) { Post(*ptr); }, e.m_expr);
+            });
+            return m_operands.back();
+        }
+
+    private:
+        double Pop()
+        {
+            double value = m_operands.back();
+            m_operands.pop_back();
+            return value;
+        }
+
+        // The operators, and the calls that evaluate, take the values of their children from the stack; every other
+        // node is a leaf, whose subscripts or arguments are not evaluated.
+        template <typename Node>
+        static bool Descend(const Node&)
+        {
+            return std::is_same_v<Node, IfExpression> || std::is_same_v<Node, UnaryOpExpression> || std::is_same_v<Node, BinaryOpExpression>;
+        }
+
+        static bool Descend(const FunctionCallExpression& e)
+        {
+            return find_builtin(e.m_functionName).has_value() && e.m_arguments.size() == 1;
+        }
+
+        void Post(const IfExpression&)
+        {
+            double otherwise = Pop();
+            double then = Pop();
+            double condition = Pop();
+            m_operands.push_back(condition != 0. ? then : otherwise);
+        }
+
+        void Post(const UnaryOpExpression& e)
+        {
+            m_operands.push_back(apply(e.m_op, Pop()));
+        }
+
+        void Post(const BinaryOpExpression& e)
+        {
+            double right = Pop();
+            double left = Pop();
+            m_operands.push_back(apply(e.m_op, left, right));
+        }
+
+        void Post(const FunctionCallExpression& e)
+        {
+            auto function = find_builtin(e.m_functionName);
+            if (!function.has_value() || e.m_arguments.size() != 1) {
+                m_operands.push_back(std::numeric_limits<double>::quiet_NaN());
+                return;
+            }
+            m_operands.push_back(apply(function.value(), Pop()));
+        }
+
+        void Post(const LiteralExpression& e)
+        {
+            switch (e.m_type) {
+            case LiteralType::Real: m_operands.push_back(std::get<double>(e.m_value)); break;
+            case LiteralType::Integer: m_operands.push_back(std::get<int>(e.m_value)); break;
+            case LiteralType::Boolean: m_operands.push_back(std::get<bool>(e.m_value) ? 1. : 0.); break;
+            default: m_operands.push_back(std::numeric_limits<double>::quiet_NaN()); break;
+            }
+        }
+
+        void Post(const ArrayRangeExpression&)
+        {
+            m_operands.push_back(std::numeric_limits<double>::quiet_NaN());
+        }
+
+        void Post(const ComponentExpression& e)
+        {
+            auto slot = m_slots.Find(e.m_componentRef);
+            if (!slot.has_value() || slot.value() >= m_values.size()) {
+                m_operands.push_back(std::numeric_limits<double>::quiet_NaN());
+                return;
+            }
+            m_operands.push_back(m_values[slot.value()]);
+        }
+
+        const VariableSlots& m_slots;
+        std::span<const double> m_values;
+        std::vector<double> m_operands;
+    };
+
+    inline double evaluate_naive(const Expression& e, const VariableSlots& slots, std::span<const double> values)
+    {
+        NaiveEvaluator evaluator(slots, values);
+        return evaluator.Evaluate(e);
+    }
+
+}
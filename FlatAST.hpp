@@ -0,0 +1,588 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+
+namespace ast {
+
+    // In the order of the alternatives of Expression::m_expr.
+    enum class NodeKind : std::uint8_t
+    {
+        If,
+        UnaryOp,
+        BinaryOp,
+        FunctionCall,
+        Literal,
+        ArrayRange,
+        Component,
+    };
+
+    // 32-bit handle of a node in a FlatTree: the kind in the top three bits, the index into that kind's columns below.
+    struct NodeRef
+    {
+        static constexpr std::uint32_t IndexBits = 29;
+        static constexpr std::uint32_t MaxIndex = (1u << IndexBits) - 1;
+
+        static constexpr NodeRef Make(NodeKind kind, std::size_t index)
+        {
+            assert(index < MaxIndex);
+            return NodeRef{ static_cast<std::uint32_t>(kind) << IndexBits | static_cast<std::uint32_t>(index) };
+        }
+
+        // absent optional child: the step of a range without one, or an empty ':' subscript
+        static constexpr NodeRef None()
+        {
+            return NodeRef{ ~0u };
+        }
+
+        NodeKind Kind() const
+        {
+            return static_cast<NodeKind>(m_bits >> IndexBits);
+        }
+
+        std::uint32_t Index() const
+        {
+            return m_bits & MaxIndex;
+        }
+
+        bool IsNone() const
+        {
+            return m_bits == ~0u;
+        }
+
+        friend bool operator==(NodeRef a, NodeRef b) = default;
+
+        std::uint32_t m_bits;
+    };
+
+    // Contiguous slice [m_first, m_first + m_count) of another column.
+    struct Range
+    {
+        std::uint32_t m_first;
+        std::uint32_t m_count;
+    };
+
+    // Compact struct-of-arrays form of an expression tree. Each node kind has its own set of columns, all indexed by
+    // NodeRef::Index(); children are NodeRefs, and variable-length lists (call arguments, reference parts, subscripts)
+    // are Ranges into shared columns. A node costs a few 4-byte entries instead of an arena block plus a variant slot,
+    // and whole-tree passes read the columns linearly.
+    class FlatTree
+    {
+    public:
+        struct IfColumns
+        {
+            std::vector<NodeRef> m_condition;
+            std::vector<NodeRef> m_then;
+            std::vector<NodeRef> m_else;
+        };
+
+        struct UnaryColumns
+        {
+            std::vector<UnaryOp> m_op;
+            std::vector<NodeRef> m_operand;
+        };
+
+        struct BinaryColumns
+        {
+            std::vector<BinaryOp> m_op;
+            std::vector<NodeRef> m_left;
+            std::vector<NodeRef> m_right;
+        };
+
+        struct CallColumns
+        {
+            std::vector<std::uint32_t> m_function; // index into m_refs
+            std::vector<Range> m_arguments;        // into m_children
+        };
+
+        union LiteralValue
+        {
+            double m_real;
+            int m_integer;
+            bool m_boolean;
+            std::uint32_t m_string; // index into m_strings
+        };
+
+        struct LiteralColumns
+        {
+            std::vector<LiteralType> m_type;
+            std::vector<LiteralValue> m_value;
+        };
+
+        struct RangeColumns
+        {
+            std::vector<NodeRef> m_start;
+            std::vector<NodeRef> m_step; // NodeRef::None() without a step
+            std::vector<NodeRef> m_stop;
+        };
+
+        struct ComponentColumns
+        {
+            std::vector<std::uint32_t> m_ref; // index into m_refs
+        };
+
+        struct RefColumns
+        {
+            std::vector<Range> m_parts; // into m_parts
+            std::vector<bool> m_global;
+        };
+
+        struct PartColumns
+        {
+            std::vector<Symbol> m_name;
+            std::vector<Range> m_subscripts; // into m_children, NodeRef::None() for ':'
+        };
+
+        // Appends the tree rooted at e and returns its root. The tree is converted bottom-up by a post-order walk,
+        // keeping the converted children on a stack until their parent is added.
+        NodeRef Add(const Expression& e)
+        {
+            return AddTree(e, false);
+        }
+
+        // Like Add, but a subexpression equal to one added by AddShared before, from this tree or an earlier one, is
+        // not stored again and its NodeRef is used instead. The trees added this way become one DAG in which every
+        // distinct subexpression is stored, and can be evaluated, once. Since the children of a node are shared
+        // before the node itself, two nodes are equal if their kinds, operators or values and child NodeRefs are, so
+        // hashing and comparing a node never looks at its subtree. Function calls are shared like any other node, as
+        // Modelica functions have no side effects unless declared impure.
+        NodeRef AddShared(const Expression& e)
+        {
+            return AddTree(e, true);
+        }
+
+        // Number of tree nodes passed to Add and AddShared.
+        std::size_t AddedNodes() const
+        {
+            return m_addedNodes;
+        }
+
+        // Tree nodes added per node stored: 1 without sharing, and the factor by which sharing saved nodes otherwise.
+        double SharingRatio() const
+        {
+            std::size_t stored = NodeCount();
+            return stored == 0 ? 1. : static_cast<double>(m_addedNodes) / static_cast<double>(stored);
+        }
+
+        std::size_t NodeCount() const
+        {
+            return m_if.m_condition.size() + m_unary.m_op.size() + m_binary.m_op.size() + m_call.m_function.size()
+                + m_literal.m_type.size() + m_range.m_start.size() + m_component.m_ref.size();
+        }
+
+        // Bytes held by the columns, including their spare capacity.
+        std::size_t BytesReserved() const
+        {
+            auto bytes = [](auto& column) { return column.capacity() * sizeof(typename std::decay_t<decltype(column)>::value_type); };
+            std::size_t total = bytes(m_if.m_condition) + bytes(m_if.m_then) + bytes(m_if.m_else)
+                + bytes(m_unary.m_op) + bytes(m_unary.m_operand)
+                + bytes(m_binary.m_op) + bytes(m_binary.m_left) + bytes(m_binary.m_right)
+                + bytes(m_call.m_function) + bytes(m_call.m_arguments)
+                + bytes(m_literal.m_type) + bytes(m_literal.m_value)
+                + bytes(m_range.m_start) + bytes(m_range.m_step) + bytes(m_range.m_stop)
+                + bytes(m_component.m_ref)
+                + bytes(m_refs.m_parts) + m_refs.m_global.capacity() / 8
+                + bytes(m_parts.m_name) + bytes(m_parts.m_subscripts)
+                + bytes(m_children) + bytes(m_strings);
+            for (auto& s : m_strings) {
+                total += s.capacity();
+            }
+            return total;
+        }
+
+        // Calls fn(NodeRef) for every direct child of ref, in source order; call arguments and the subscripts of
+        // references are children too. Empty ':' subscripts and missing range steps are skipped.
+        template <typename Fn>
+        void ForEachChild(NodeRef ref, Fn&& fn) const
+        {
+            std::uint32_t i = ref.Index();
+            switch (ref.Kind()) {
+            case NodeKind::If:
+                fn(m_if.m_condition[i]);
+                fn(m_if.m_then[i]);
+                fn(m_if.m_else[i]);
+                break;
+            case NodeKind::UnaryOp:
+                fn(m_unary.m_operand[i]);
+                break;
+            case NodeKind::BinaryOp:
+                fn(m_binary.m_left[i]);
+                fn(m_binary.m_right[i]);
+                break;
+            case NodeKind::FunctionCall:
+                ForEachSubscript(m_call.m_function[i], fn);
+                ForEach(m_call.m_arguments[i], fn);
+                break;
+            case NodeKind::Literal:
+                break;
+            case NodeKind::ArrayRange:
+                fn(m_range.m_start[i]);
+                if (!m_range.m_step[i].IsNone()) {
+                    fn(m_range.m_step[i]);
+                }
+                fn(m_range.m_stop[i]);
+                break;
+            case NodeKind::Component:
+                ForEachSubscript(m_component.m_ref[i], fn);
+                break;
+            }
+        }
+
+        IfColumns m_if;
+        UnaryColumns m_unary;
+        BinaryColumns m_binary;
+        CallColumns m_call;
+        LiteralColumns m_literal;
+        RangeColumns m_range;
+        ComponentColumns m_component;
+        RefColumns m_refs;
+        PartColumns m_parts;
+        std::vector<NodeRef> m_children;
+        std::vector<std::string> m_strings;
+
+    private:
+        NodeRef AddTree(const Expression& e, bool shared)
+        {
+            std::vector<NodeRef> converted;
+            walk_post(e, [&](const Expression& node) {
+                ++m_addedNodes;
+                std::size_t count = 0;
+                for_each_child(node, [&count](const Expression&) { ++count; });
+                std::span<const NodeRef> children(converted.data() + converted.size() - count, count);
+                NodeRef ref = std::visit([&](auto& ptr) { return shared ? AddSharedNode(*ptr, children) : AddNode(*ptr, children); }, node.m_expr);
+                converted.resize(converted.size() - count);
+                converted.push_back(ref);
+            });
+            return converted.back();
+        }
+
+        template <typename Fn>
+        void ForEach(Range range, Fn& fn) const
+        {
+            for (std::uint32_t c = range.m_first; c < range.m_first + range.m_count; ++c) {
+                if (!m_children[c].IsNone()) {
+                    fn(m_children[c]);
+                }
+            }
+        }
+
+        template <typename Fn>
+        void ForEachSubscript(std::uint32_t ref, Fn& fn) const
+        {
+            Range parts = m_refs.m_parts[ref];
+            for (std::uint32_t p = parts.m_first; p < parts.m_first + parts.m_count; ++p) {
+                ForEach(m_parts.m_subscripts[p], fn);
+            }
+        }
+
+        // Every node is stored after its children, so a reference spans a contiguous run of m_children for the
+        // subscripts of each part.
+        std::uint32_t AddReference(const ComponentReference& ref, const NodeRef*& next)
+        {
+            Range parts{ static_cast<std::uint32_t>(m_parts.m_name.size()), static_cast<std::uint32_t>(ref.Size()) };
+            for (std::size_t i = 0; i < ref.Size(); ++i) {
+                auto subscripts = ref.Subscripts(i);
+                m_parts.m_name.push_back(ref.Name(i));
+                m_parts.m_subscripts.push_back(Range{ static_cast<std::uint32_t>(m_children.size()), static_cast<std::uint32_t>(subscripts.size()) });
+                for (auto& s : subscripts) {
+                    m_children.push_back(s.m_subscript.has_value() ? *next++ : NodeRef::None());
+                }
+            }
+            m_refs.m_parts.push_back(parts);
+            m_refs.m_global.push_back(ref.m_global);
+            return static_cast<std::uint32_t>(m_refs.m_parts.size() - 1);
+        }
+
+        // Hash-consing for AddShared: the stored nodes by the hash of their kind, payload and child NodeRefs. A new node
+        // is compared with the stored ones of equal hash before it is added.
+        template <typename Node>
+        NodeRef AddSharedNode(const Node& e, std::span<const NodeRef> children)
+        {
+            std::uint64_t hash = HashNode(e, children);
+            auto [first, last] = m_shared.equal_range(hash);
+            for (auto it = first; it != last; ++it) {
+                if (SameNode(it->second, e, children)) {
+                    return it->second;
+                }
+            }
+            NodeRef ref = AddNode(e, children);
+            m_shared.emplace(hash, ref);
+            return ref;
+        }
+
+        static std::uint64_t mix(std::uint64_t hash, std::uint64_t value)
+        {
+            hash = (hash ^ value) * 0x9E3779B97F4A7C15ull;
+            return hash ^ (hash >> 32);
+        }
+
+        static std::uint64_t HashReference(std::uint64_t hash, const ComponentReference& ref)
+        {
+            hash = mix(hash, ref.m_global);
+            for (std::size_t i = 0; i < ref.Size(); ++i) {
+                hash = mix(hash, ref.Name(i).m_id);
+                for (auto& s : ref.Subscripts(i)) {
+                    hash = mix(hash, s.m_subscript.has_value());
+                }
+                hash = mix(hash, ~0ull); // ends the part, so a.b and a[:].b differ
+            }
+            return hash;
+        }
+
+        template <typename Node>
+        static std::uint64_t HashNode(const Node& e, std::span<const NodeRef> children)
+        {
+            std::uint64_t hash = 0;
+            if constexpr (std::is_same_v<Node, UnaryOpExpression> || std::is_same_v<Node, BinaryOpExpression>) {
+                hash = mix(hash, static_cast<std::uint64_t>(e.m_op));
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                hash = HashReference(hash, e.m_functionName);
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                hash = mix(hash, static_cast<std::uint64_t>(e.m_type));
+                std::visit([&hash](auto& value) {
+                    using Value = std::remove_cvref_t<decltype(value)>;
+                    if constexpr (std::is_same_v<Value, SourceString>) {
+                        hash = mix(hash, std::hash<std::string_view>{}(value.View()));
+                    }
+                    else if constexpr (std::is_same_v<Value, double>) {
+                        hash = mix(hash, std::bit_cast<std::uint64_t>(value));
+                    }
+                    else {
+                        hash = mix(hash, static_cast<std::uint64_t>(value));
+                    }
+                }, e.m_value);
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                hash = mix(hash, e.m_step.has_value());
+            }
+            else if constexpr (std::is_same_v<Node, ComponentExpression>) {
+                hash = HashReference(hash, e.m_componentRef);
+            }
+            hash = mix(hash, static_cast<std::uint64_t>(kind_of<Node>()));
+            for (NodeRef child : children) {
+                hash = mix(hash, child.m_bits);
+            }
+            return hash;
+        }
+
+        template <typename Node>
+        static constexpr NodeKind kind_of()
+        {
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                return NodeKind::If;
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                return NodeKind::UnaryOp;
+            }
+            else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                return NodeKind::BinaryOp;
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                return NodeKind::FunctionCall;
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                return NodeKind::Literal;
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                return NodeKind::ArrayRange;
+            }
+            else {
+                return NodeKind::Component;
+            }
+        }
+
+        // Whether the stored reference equals ref with the given subscript children, consuming those from next.
+        bool SameReference(std::uint32_t stored, const ComponentReference& ref, const NodeRef*& next) const
+        {
+            Range parts = m_refs.m_parts[stored];
+            if (m_refs.m_global[stored] != ref.m_global || parts.m_count != ref.Size()) {
+                return false;
+            }
+            for (std::size_t i = 0; i < ref.Size(); ++i) {
+                std::uint32_t p = parts.m_first + static_cast<std::uint32_t>(i);
+                auto subscripts = ref.Subscripts(i);
+                Range storedSubscripts = m_parts.m_subscripts[p];
+                if (m_parts.m_name[p] != ref.Name(i) || storedSubscripts.m_count != subscripts.size()) {
+                    return false;
+                }
+                for (std::size_t s = 0; s < subscripts.size(); ++s) {
+                    NodeRef expected = subscripts[s].m_subscript.has_value() ? *next++ : NodeRef::None();
+                    if (m_children[storedSubscripts.m_first + s] != expected) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        bool SameChildren(Range stored, const NodeRef* first, const NodeRef* last) const
+        {
+            return stored.m_count == static_cast<std::size_t>(last - first)
+                && std::equal(first, last, m_children.begin() + stored.m_first);
+        }
+
+        template <typename Node>
+        bool SameNode(NodeRef ref, const Node& e, std::span<const NodeRef> children) const
+        {
+            if (ref.Kind() != kind_of<Node>()) {
+                return false;
+            }
+            std::uint32_t i = ref.Index();
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                return m_if.m_condition[i] == children[0] && m_if.m_then[i] == children[1] && m_if.m_else[i] == children[2];
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                return m_unary.m_op[i] == e.m_op && m_unary.m_operand[i] == children[0];
+            }
+            else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                return m_binary.m_op[i] == e.m_op && m_binary.m_left[i] == children[0] && m_binary.m_right[i] == children[1];
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                const NodeRef* next = children.data();
+                return SameReference(m_call.m_function[i], e.m_functionName, next)
+                    && SameChildren(m_call.m_arguments[i], next, children.data() + children.size());
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                if (m_literal.m_type[i] != e.m_type) {
+                    return false;
+                }
+                const LiteralValue& value = m_literal.m_value[i];
+                switch (e.m_type) {
+                case LiteralType::Real:
+                    return std::bit_cast<std::uint64_t>(value.m_real) == std::bit_cast<std::uint64_t>(std::get<double>(e.m_value));
+                case LiteralType::Integer:
+                    return value.m_integer == std::get<int>(e.m_value);
+                case LiteralType::Boolean:
+                    return value.m_boolean == std::get<bool>(e.m_value);
+                case LiteralType::String:
+                    return m_strings[value.m_string] == std::get<SourceString>(e.m_value).View();
+                default:
+                    return true;
+                }
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                bool step = e.m_step.has_value();
+                return m_range.m_start[i] == children[0] && m_range.m_step[i] == (step ? children[1] : NodeRef::None())
+                    && m_range.m_stop[i] == children[step ? 2 : 1];
+            }
+            else {
+                const NodeRef* next = children.data();
+                return SameReference(m_component.m_ref[i], e.m_componentRef, next);
+            }
+        }
+
+        // The AddNode overloads receive the already converted children of the node, in for_each_child order.
+
+        NodeRef AddNode(const IfExpression&, std::span<const NodeRef> children)
+        {
+            m_if.m_condition.push_back(children[0]);
+            m_if.m_then.push_back(children[1]);
+            m_if.m_else.push_back(children[2]);
+            return NodeRef::Make(NodeKind::If, m_if.m_condition.size() - 1);
+        }
+
+        NodeRef AddNode(const UnaryOpExpression& e, std::span<const NodeRef> children)
+        {
+            m_unary.m_op.push_back(e.m_op);
+            m_unary.m_operand.push_back(children[0]);
+            return NodeRef::Make(NodeKind::UnaryOp, m_unary.m_op.size() - 1);
+        }
+
+        NodeRef AddNode(const BinaryOpExpression& e, std::span<const NodeRef> children)
+        {
+            m_binary.m_op.push_back(e.m_op);
+            m_binary.m_left.push_back(children[0]);
+            m_binary.m_right.push_back(children[1]);
+            return NodeRef::Make(NodeKind::BinaryOp, m_binary.m_op.size() - 1);
+        }
+
+        NodeRef AddNode(const FunctionCallExpression& e, std::span<const NodeRef> children)
+        {
+            const NodeRef* next = children.data();
+            m_call.m_function.push_back(AddReference(e.m_functionName, next));
+            m_call.m_arguments.push_back(Range{ static_cast<std::uint32_t>(m_children.size()), static_cast<std::uint32_t>(e.m_arguments.size()) });
+            m_children.insert(m_children.end(), next, children.data() + children.size());
+            return NodeRef::Make(NodeKind::FunctionCall, m_call.m_function.size() - 1);
+        }
+
+        NodeRef AddNode(const LiteralExpression& e, std::span<const NodeRef>)
+        {
+            LiteralValue value{};
+            switch (e.m_type) {
+            case LiteralType::Real:
+                value.m_real = std::get<double>(e.m_value);
+                break;
+            case LiteralType::Integer:
+                value.m_integer = std::get<int>(e.m_value);
+                break;
+            case LiteralType::Boolean:
+                value.m_boolean = std::get<bool>(e.m_value);
+                break;
+            case LiteralType::String:
+                value.m_string = static_cast<std::uint32_t>(m_strings.size());
+                m_strings.emplace_back(std::get<SourceString>(e.m_value).View());
+                break;
+            case LiteralType::IndexEnd:
+                break;
+            }
+            m_literal.m_type.push_back(e.m_type);
+            m_literal.m_value.push_back(value);
+            return NodeRef::Make(NodeKind::Literal, m_literal.m_type.size() - 1);
+        }
+
+        NodeRef AddNode(const ArrayRangeExpression& e, std::span<const NodeRef> children)
+        {
+            bool step = e.m_step.has_value();
+            m_range.m_start.push_back(children[0]);
+            m_range.m_step.push_back(step ? children[1] : NodeRef::None());
+            m_range.m_stop.push_back(children[step ? 2 : 1]);
+            return NodeRef::Make(NodeKind::ArrayRange, m_range.m_start.size() - 1);
+        }
+
+        NodeRef AddNode(const ComponentExpression& e, std::span<const NodeRef> children)
+        {
+            const NodeRef* next = children.data();
+            m_component.m_ref.push_back(AddReference(e.m_componentRef, next));
+            return NodeRef::Make(NodeKind::Component, m_component.m_ref.size() - 1);
+        }
+
+        std::unordered_multimap<std::uint64_t, NodeRef> m_shared;
+        std::size_t m_addedNodes = 0;
+    };
+
+    // Preorder walk of the flat tree below root, with an explicit stack instead of recursion.
+    // pre(ref) returning false skips the children of ref.
+    template <typename Pre>
+    void walk(const FlatTree& tree, NodeRef root, Pre&& pre)
+    {
+        std::vector<NodeRef> stack{ root };
+        std::vector<NodeRef> children;
+        while (!stack.empty()) {
+            NodeRef ref = stack.back();
+            stack.pop_back();
+            if (!pre(ref)) {
+                continue;
+            }
+            children.clear();
+            tree.ForEachChild(ref, [&](NodeRef child) { children.push_back(child); });
+            stack.insert(stack.end(), children.rbegin(), children.rend());
+        }
+    }
+
+}
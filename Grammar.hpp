@@ -1,6 +1,13 @@
 #pragma once
 
+#include <cstddef>
+#include <string>
+#include <string_view>
+
 #include "tao/pegtl.hpp"
+#include "Diagnostics.hpp"
+#include "Keywords.hpp"
+#include "TriviaScanner.hpp"
 
 namespace peg = tao::pegtl;
 
@@ -10,12 +17,66 @@ struct single_line_comment : peg::seq<TAO_PEGTL_STRING("//"), peg::until<peg::eo
 struct multi_line_comment : peg::seq<TAO_PEGTL_STRING("/*"), peg::until<TAO_PEGTL_STRING("*/")>> {};
 struct modelica_space : peg::sor<peg::space, single_line_comment, multi_line_comment> {};
 
+// Matches a maximal (possibly empty) run of whitespace and comments: accepts the same input as
+// peg::star<modelica_space>, but skips it with block scans instead of one character at a time. The bump is only
+// pointer arithmetic on the lazily tracked inputs of Parser.hpp; on an eagerly tracked input it would go over the
+// skipped bytes again, one at a time, to count lines.
+struct modelica_trivia
+{
+    using rule_t = modelica_trivia;
+    using subs_t = peg::empty_list;
+
+    template <typename ParseInput>
+    static bool match(ParseInput& in)
+    {
+        const char* end = scan::skip_trivia(in.current(), in.end());
+        in.bump(static_cast<std::size_t>(end - in.current()));
+        return true;
+    }
+};
+
 template <typename rule>
-struct padded : peg::pad<rule, modelica_space> {};
+struct padded : peg::seq<modelica_trivia, rule, modelica_trivia> {};
+
+
+// Length of the peg::identifier starting at p, or 0 if there is none.
+inline std::size_t identifier_length(const char* p, const char* end)
+{
+    auto first = [](char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; };
+    auto other = [&](char c) { return first(c) || (c >= '0' && c <= '9'); };
+    if (p == end || !first(*p)) {
+        return 0;
+    }
+    const char* q = p + 1;
+    while (q != end && other(*q)) {
+        ++q;
+    }
+    return static_cast<std::size_t>(q - p);
+}
+
+// The reserved word K, not followed by further identifier characters. The word at the input is scanned once and
+// classified with keywords::lookup, instead of being compared character by character with the text of K.
+template <keywords::Keyword K>
+struct _keyword
+{
+    using rule_t = _keyword;
+    using subs_t = peg::empty_list;
+
+    template <typename ParseInput>
+    static bool match(ParseInput& in)
+    {
+        std::size_t n = identifier_length(in.current(), in.end());
+        if (n == 0 || keywords::lookup(std::string_view(in.current(), n)) != K) {
+            return false;
+        }
+        in.bump_in_this_line(n);
+        return true;
+    }
+};
 
 
 // padded keyword terminals
-#define PADDED_KEYWORD(x) struct KEYWORD_##x : padded<TAO_PEGTL_KEYWORD(#x)> {}
+#define PADDED_KEYWORD(x) struct KEYWORD_##x : padded<_keyword<keywords::lookup(#x).value()>> {}
 
 PADDED_KEYWORD(algorithm);
 PADDED_KEYWORD(and);
@@ -77,67 +138,6 @@ PADDED_KEYWORD(when);
 PADDED_KEYWORD(while);
 PADDED_KEYWORD(within);
 
-struct KEYWORD : peg::sor <
-    KEYWORD_algorithm,
-    KEYWORD_and,
-    KEYWORD_annotation,
-    KEYWORD_block,
-    KEYWORD_break,
-    KEYWORD_class,
-    KEYWORD_connect,
-    KEYWORD_connector,
-    KEYWORD_constant,
-    KEYWORD_constrainedby,
-    KEYWORD_der,
-    KEYWORD_discrete,
-    KEYWORD_each,
-    KEYWORD_else,
-    KEYWORD_elseif,
-    KEYWORD_elsewhen,
-    KEYWORD_encapsulated,
-    KEYWORD_end,
-    KEYWORD_enumeration,
-    KEYWORD_equation,
-    KEYWORD_expandable,
-    KEYWORD_extends,
-    KEYWORD_external,
-    KEYWORD_false,
-    KEYWORD_final,
-    KEYWORD_flow,
-    KEYWORD_for,
-    KEYWORD_function,
-    KEYWORD_if,
-    KEYWORD_import,
-    KEYWORD_impure,
-    KEYWORD_in,
-    KEYWORD_initial,
-    KEYWORD_inner,
-    KEYWORD_input,
-    KEYWORD_loop,
-    KEYWORD_model,
-    KEYWORD_not,
-    KEYWORD_operator,
-    KEYWORD_or,
-    KEYWORD_outer,
-    KEYWORD_output,
-    KEYWORD_package,
-    KEYWORD_parameter,
-    KEYWORD_partial,
-    KEYWORD_protected,
-    KEYWORD_public,
-    KEYWORD_pure,
-    KEYWORD_record,
-    KEYWORD_redeclare,
-    KEYWORD_replaceable,
-    KEYWORD_return,
-    KEYWORD_stream,
-    KEYWORD_then,
-    KEYWORD_true,
-    KEYWORD_type,
-    KEYWORD_when,
-    KEYWORD_while,
-    KEYWORD_within > {};
-
 
 // padded symbol terminals
 #define PADDED_SYMBOL(x, y) struct SYMBOL_##x : padded<TAO_PEGTL_STRING(y)> {};
@@ -183,8 +183,26 @@ struct _Q_CHAR : peg::sor<peg::identifier_other, peg::one<'!', '#', '$', '%', '&
 struct _Q_SINGLE_QUOTE : peg::one<'\''> {};
 struct _Q_IDENT : peg::seq<_Q_SINGLE_QUOTE, peg::star<peg::sor<_Q_CHAR, _S_ESCAPE>>, peg::must<_Q_SINGLE_QUOTE>> {};
 
-struct _identifier : peg::identifier {};
-struct _IDENT : peg::minus<peg::sor<_identifier, _Q_IDENT>, KEYWORD> {};
+// peg::identifier that is not a reserved word; the word is scanned once and then looked up, rather than
+// re-matched against every keyword.
+struct _unreserved_identifier
+{
+    using rule_t = _unreserved_identifier;
+    using subs_t = peg::empty_list;
+
+    template <typename ParseInput>
+    static bool match(ParseInput& in)
+    {
+        std::size_t n = identifier_length(in.current(), in.end());
+        if (n == 0 || keywords::is_keyword(std::string_view(in.current(), n))) {
+            return false;
+        }
+        in.bump_in_this_line(n);
+        return true;
+    }
+};
+
+struct _IDENT : peg::sor<_unreserved_identifier, _Q_IDENT> {};
 struct IDENT : padded<_IDENT> {};
 
 struct __UNSIGNED_INTEGER : peg::plus<peg::digit> {}; // no action, for use in _UNSIGNED_REAL
@@ -202,6 +220,51 @@ struct _UNSIGNED_REAL : peg::sor<
 
 struct UNSIGNED_NUMBER : padded<peg::sor<_UNSIGNED_REAL, _UNSIGNED_INTEGER>> {};
 
+// The control of every parse: as peg::normal, but errors are raised as a syntax_error at a byte offset, so raising
+// one does not work out a line and column that is only needed if the diagnostic is printed.
+template <typename Rule>
+struct modelica_control : peg::normal<Rule>
+{
+    template <typename ParseInput, typename... States>
+    [[noreturn]] static void raise(const ParseInput& in, States&&...)
+    {
+        throw syntax_error(static_cast<std::size_t>(in.current() - in.begin()), "parse error matching " + std::string(peg::demangle<Rule>()));
+    }
+};
+
+// Matches Rule, or reports why it does not match (its own local failure or a parse error raised inside it), skips to
+// the next separator and succeeds anyway, failing the current builder. Used for list elements after a separator,
+// which can only be errors when they do not match, so that one parse reports every broken element of a list.
+template <typename Rule>
+struct recover
+{
+    using rule_t = recover;
+    using subs_t = peg::type_list<Rule>;
+
+    template <peg::apply_mode A, peg::rewind_mode M, template <typename...> class Action, template <typename...> class Control, typename ParseInput, typename... States>
+    static bool match(ParseInput& in, States&... st)
+    {
+        const auto start = in.iterator();
+        try {
+            if (Control<Rule>::template match<A, peg::rewind_mode::required, Action, Control>(in, st...)) {
+                return true;
+            }
+            report_diagnostic(static_cast<std::size_t>(in.current() - in.begin()), "parse error matching " + std::string(peg::demangle<Rule>()));
+        }
+        catch (const syntax_error& e) {
+            in.iterator() = start;
+            report_diagnostic(e);
+        }
+        (st.Fail(), ...);
+        in.bump(static_cast<std::size_t>(scan::find_recovery_point(in.current(), in.end()) - in.current()));
+        return true;
+    }
+};
+
+// peg::list with recovery for every element after the first.
+template <typename Rule, typename Sep>
+struct list_recover : peg::seq<Rule, peg::star<Sep, recover<Rule>>> {};
+
 // 2.7 Expressions
 struct expression;
 struct subscript : peg::sor<SYMBOL_colon, expression> {};
@@ -209,15 +272,15 @@ struct name : peg::list<IDENT, SYMBOL_dot> {};
 struct type_specifier : peg::seq<peg::opt<SYMBOL_dot>, name> {};
 struct for_index : peg::seq<IDENT, peg::opt<KEYWORD_in, expression>> {};
 struct for_indices : peg::list<for_index, SYMBOL_comma> {};
-struct array_subscripts : peg::seq<SYMBOL_open_bracket, peg::list<subscript, SYMBOL_comma>, SYMBOL_close_bracket> {};
-struct expression_list : peg::list<expression, SYMBOL_comma> {};
+struct array_subscripts : peg::seq<SYMBOL_open_bracket, list_recover<subscript, SYMBOL_comma>, SYMBOL_close_bracket> {};
+struct expression_list : list_recover<expression, SYMBOL_comma> {};
 struct output_expression_list : peg::list<peg::opt<expression>, SYMBOL_comma> {};
 struct named_arguments;
 struct function_partial_application : peg::seq<KEYWORD_function, type_specifier, SYMBOL_open_paren, peg::opt<named_arguments>, SYMBOL_close_paren> {};
 struct function_argument : peg::sor<function_partial_application, expression> {};
 struct named_argument : peg::seq<IDENT, SYMBOL_equals, function_argument> {};
 struct named_arguments : peg::list<named_argument, SYMBOL_comma> {};
-struct array_arguments_non_first : peg::list<expression, SYMBOL_comma> {};
+struct array_arguments_non_first : peg::list<recover<expression>, SYMBOL_comma> {};
 struct array_arguments : peg::seq<expression, peg::opt<peg::sor<peg::seq<SYMBOL_comma, array_arguments_non_first>, peg::seq<KEYWORD_for, for_indices>>>> {};
 struct function_arguments_non_first : peg::sor<
     peg::seq<peg::list<function_argument, SYMBOL_comma>, peg::opt<SYMBOL_comma, named_arguments>>,
@@ -237,10 +300,10 @@ struct primary : peg::sor <
     STRING,
     KEYWORD_false,
     KEYWORD_true,
-    peg::seq<peg::sor<KEYWORD_der, KEYWORD_initial, KEYWORD_pure, component_reference>, function_call_args>,
-    component_reference,
+    peg::seq<peg::sor<KEYWORD_der, KEYWORD_initial, KEYWORD_pure>, function_call_args>,
+    peg::seq<component_reference, peg::opt<function_call_args>>, // a reference is matched once and then optionally called
     peg::seq<SYMBOL_open_paren, output_expression_list, SYMBOL_close_paren>,
-    peg::seq<SYMBOL_open_bracket, peg::list<expression_list, SYMBOL_semicolon>, SYMBOL_close_bracket>,
+    peg::seq<SYMBOL_open_bracket, list_recover<expression_list, SYMBOL_semicolon>, SYMBOL_close_bracket>,
     peg::seq<SYMBOL_open_brace, array_arguments, SYMBOL_close_brace>,
     KEYWORD_end
 > {};
@@ -266,4 +329,39 @@ struct simple_expression : peg::seq<logical_expression, peg::opt<peg::if_must<SY
 
 struct if_expression : peg::if_must<KEYWORD_if, expression, KEYWORD_then, expression, peg::star<KEYWORD_elseif, expression, KEYWORD_then, expression>, KEYWORD_else, expression> {};
 
-struct expression : peg::sor<if_expression, simple_expression> {};
\ No newline at end of file
+struct expression : peg::sor<if_expression, simple_expression> {};
+// 2.5 Modification, the subset used in annotations: no redeclarations, replaceable elements or 'break'
+struct class_modification;
+struct description_string : peg::opt<peg::list<STRING, SYMBOL_plus>> {};
+struct modification : peg::sor<
+    peg::seq<class_modification, peg::opt<SYMBOL_equals, expression>>,
+    peg::seq<peg::sor<SYMBOL_equals, SYMBOL_assign>, expression>
+> {};
+struct element_modification : peg::seq<peg::opt<KEYWORD_each>, peg::opt<KEYWORD_final>, name, peg::opt<modification>, description_string> {};
+struct argument_list : peg::list<element_modification, SYMBOL_comma> {};
+struct class_modification : peg::seq<SYMBOL_open_paren, peg::opt<argument_list>, SYMBOL_close_paren> {};
+
+// The class modification of an annotation is only delimited by a bracket matching scan while parsing, and is parsed
+// as a class_modification on demand (see parse_annotation).
+struct _ANNOTATION_BODY
+{
+    using rule_t = _ANNOTATION_BODY;
+    using subs_t = peg::empty_list;
+
+    template <typename ParseInput>
+    static bool match(ParseInput& in)
+    {
+        const char* end = scan::skip_balanced(in.current(), in.end());
+        if (end == nullptr) {
+            return false;
+        }
+        in.bump(static_cast<std::size_t>(end - in.current()));
+        return true;
+    }
+};
+
+struct annotation_clause : peg::seq<KEYWORD_annotation, padded<_ANNOTATION_BODY>> {};
+struct description : peg::seq<description_string, peg::opt<annotation_clause>> {};
+
+// Top level of a source file: an expression followed by an optional description, as in a binding or an equation.
+struct described_expression : peg::seq<expression, description> {};
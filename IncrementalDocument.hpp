@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "tao/pegtl.hpp"
+#include "Grammar.hpp"
+#include "Arena.hpp"
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+#include "Diagnostics.hpp"
+#include "ParserActions.hpp"
+#include "Parser.hpp"
+#include "TriviaScanner.hpp"
+
+// Replaces m_removed bytes at m_offset with m_inserted.
+struct TextEdit
+{
+    std::size_t m_offset = 0;
+    std::size_t m_removed = 0;
+    std::string_view m_inserted;
+};
+
+struct EditStats
+{
+    bool m_incremental = false; // false if the whole text was parsed again
+    std::size_t m_reparsedBytes = 0;
+    std::chrono::steady_clock::duration m_time{};
+};
+
+// A source text kept parsed across edits, for editors. An edit reparses only the smallest simple expression, primary
+// or if expression whose text strictly contains the edited range, with the rule that matched it before, and moves the new
+// subtree into the place of the old one; the rest of the tree is kept as it is. Since such a region is delimited by
+// its neighbours in every context it occurs in, the splice gives the tree a full parse would give. The one exception
+// is a line comment running to the end of the reparsed text, which ends with the fragment when parsed on its own but
+// runs on over the text after it in the document; such a fragment is not spliced.
+// The whole text is parsed again when no region contains the edit or reparses cleanly, when the previous text did not
+// parse, and when replaced subtrees and reparsed fragments have grown to the size of the live tree and text.
+class IncrementalDocument
+{
+public:
+    explicit IncrementalDocument(std::string text, std::string name = "")
+        : m_text(std::move(text)), m_name(std::move(name)), m_lines(m_text, m_name)
+    {
+        FullParse();
+    }
+
+    // the regions point into the tree held by the document
+    IncrementalDocument(const IncrementalDocument& other) = delete;
+    IncrementalDocument& operator=(const IncrementalDocument& other) = delete;
+
+    EditStats Apply(const TextEdit& edit)
+    {
+        auto start = std::chrono::steady_clock::now();
+        EditStats stats;
+        std::size_t offset = std::min(edit.m_offset, m_text.size());
+        std::size_t removed = std::min(edit.m_removed, m_text.size() - offset);
+        auto candidates = Enclosing(offset, removed);
+        m_text.replace(offset, removed, edit.m_inserted);
+        std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(edit.m_inserted.size()) - static_cast<std::ptrdiff_t>(removed);
+
+        bool compact = m_result.m_arena->BytesAllocated() > 2 * m_liveBytes || m_fragmentBytes > m_text.size();
+        if (m_result.m_success && !compact) {
+            for (std::size_t index : candidates) {
+                std::size_t bytes = Reparse(index, offset, removed, delta);
+                if (bytes != 0) {
+                    stats.m_incremental = true;
+                    stats.m_reparsedBytes = bytes;
+                    break;
+                }
+            }
+        }
+        if (!stats.m_incremental) {
+            FullParse();
+            stats.m_reparsedBytes = m_text.size();
+        }
+        m_lines = LineIndex(m_text, m_name);
+        m_result.m_text = m_text;
+        stats.m_time = std::chrono::steady_clock::now() - start;
+        return stats;
+    }
+
+    std::string_view Text() const
+    {
+        return m_text;
+    }
+
+    // The tree and diagnostics of the current text, which m_text views. m_bytes and m_time are those of the last full
+    // parse.
+    const ParseResult& Result() const
+    {
+        return m_result;
+    }
+
+    // Lines of the current text, for locating the spans of the tree.
+    const LineIndex& Lines() const
+    {
+        return m_lines;
+    }
+
+private:
+    // A parsed region in current text offsets, with the place in the tree that holds its node.
+    struct Region
+    {
+        std::uint32_t m_begin;
+        std::uint32_t m_end;
+        RegionRule m_rule;
+        ast::Expression* m_slot;
+    };
+
+    void FullParse()
+    {
+        // the old tree has to go before the arena and the text it lives in
+        m_result.m_ast.reset();
+        m_regions.clear();
+        m_fragments.clear();
+        m_fragmentBytes = 0;
+        auto source = std::make_shared<const std::string>(m_text);
+        std::vector<ParsedRegion> parsed;
+        {
+            RegionScope scope(parsed);
+            text_input in(source->data(), source->size(), m_name);
+            m_result = parse_input(in);
+        }
+        m_result.m_source = source;
+        m_liveBytes = m_result.m_arena->BytesAllocated();
+        if (m_result.m_success) {
+            Index(parsed, source->data(), 0, m_result.m_ast.value(), m_regions);
+            SortRegions(m_regions.begin(), m_regions.end());
+        }
+    }
+
+    // Indices of the regions strictly containing [offset, offset + removed), smallest first. The characters on both
+    // sides of the edit stay in the region, so a token can not extend across its boundary.
+    std::vector<std::size_t> Enclosing(std::size_t offset, std::size_t removed) const
+    {
+        std::vector<std::size_t> found;
+        for (std::size_t i = 0; i < m_regions.size(); ++i) {
+            if (m_regions[i].m_begin < offset && offset + removed < m_regions[i].m_end) {
+                found.push_back(i);
+            }
+        }
+        std::sort(found.begin(), found.end(), [this](std::size_t a, std::size_t b) {
+            return m_regions[a].m_end - m_regions[a].m_begin < m_regions[b].m_end - m_regions[b].m_begin;
+        });
+        return found;
+    }
+
+    // Parses the edited text of a region with its rule and splices the result in; returns the bytes parsed, or 0 if
+    // the text does not match the rule completely and cleanly.
+    std::size_t Reparse(std::size_t index, std::size_t offset, std::size_t removed, std::ptrdiff_t delta)
+    {
+        const Region region = m_regions[index];
+        std::size_t begin = region.m_begin;
+        std::size_t end = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(region.m_end) + delta);
+        auto fragment = std::make_unique<const std::string>(m_text, begin, end - begin);
+
+        ExpressionReceiver er;
+        std::vector<ParsedRegion> parsed;
+        std::vector<Diagnostic> diagnostics;
+        bool matched = false;
+        {
+            ast::ArenaScope arena(*m_result.m_arena);
+            DiagnosticScope diagnosticScope(diagnostics);
+            RegionScope regionScope(parsed);
+            text_input in(fragment->data(), fragment->size(), m_name);
+            try {
+                switch (region.m_rule) {
+                case RegionRule::IfExpression:
+                    matched = peg::parse<complete<if_expression>, ast_builder_action, modelica_control>(in, er);
+                    break;
+                case RegionRule::SimpleExpression:
+                    matched = peg::parse<complete<simple_expression>, ast_builder_action, modelica_control>(in, er);
+                    break;
+                case RegionRule::Primary:
+                    matched = peg::parse<complete<primary>, ast_builder_action, modelica_control>(in, er);
+                    break;
+                }
+            }
+            catch (const syntax_error&) {
+                return 0;
+            }
+        }
+        if (!matched || !diagnostics.empty() || er.Failed() || !er.result.has_value() || ends_in_line_comment(*fragment)) {
+            return 0;
+        }
+
+        // the old subtree goes away with the assignment; its nodes stay in the arena until the next full parse
+        *region.m_slot = std::move(er.result.value());
+        ast::walk_pre(*region.m_slot, [begin](ast::Expression& e) {
+            if (!e.m_span.Empty()) {
+                e.m_span.m_begin += static_cast<std::uint32_t>(begin);
+                e.m_span.m_end += static_cast<std::uint32_t>(begin);
+            }
+        });
+        ShiftSpans(region.m_slot, offset, removed, delta);
+        std::vector<Region> spliced;
+        Index(parsed, fragment->data(), begin, *region.m_slot, spliced);
+        SortRegions(spliced.begin(), spliced.end());
+
+        // regions of the old subtree are replaced, those after it shift and those around it grow
+        auto first = std::find_if(m_regions.begin(), m_regions.end(), [&](const Region& r) {
+            return r.m_begin >= region.m_begin && r.m_end <= region.m_end;
+        });
+        auto last = std::find_if(first, m_regions.end(), [&](const Region& r) { return r.m_begin >= region.m_end; });
+        for (auto it = m_regions.begin(); it != m_regions.end(); ++it) {
+            if (it >= first && it < last) {
+                continue;
+            }
+            if (it->m_begin >= region.m_end) {
+                it->m_begin = static_cast<std::uint32_t>(it->m_begin + delta);
+                it->m_end = static_cast<std::uint32_t>(it->m_end + delta);
+            }
+            else if (it->m_end >= region.m_end) {
+                it->m_end = static_cast<std::uint32_t>(it->m_end + delta);
+            }
+        }
+        auto at = m_regions.erase(first, last);
+        m_regions.insert(at, spliced.begin(), spliced.end());
+
+        m_fragmentBytes += fragment->size();
+        m_fragments.push_back(std::move(fragment));
+        return end - begin;
+    }
+
+    // Moves the spans of the nodes outside the spliced subtree to the edited text and grows those around it to cover
+    // the new subtree. This walks the whole tree, but only once and without touching the text.
+    void ShiftSpans(const ast::Expression* spliced, std::size_t offset, std::size_t removed, std::ptrdiff_t delta)
+    {
+        auto shift = [&](std::uint32_t p) {
+            if (p <= offset) {
+                return p;
+            }
+            if (p < offset + removed) {
+                return static_cast<std::uint32_t>(offset);
+            }
+            return static_cast<std::uint32_t>(p + delta);
+        };
+        ast::walk(m_result.m_ast.value(), [spliced](ast::Expression& e) { return &e != spliced; }, [&](ast::Expression& e) {
+            if (&e == spliced || e.m_span.Empty()) {
+                return;
+            }
+            e.m_span = ast::SourceSpan{ shift(e.m_span.m_begin), shift(e.m_span.m_end) };
+            ast::for_each_child(e, [&e](ast::Expression& child) { e.m_span = ast::join(e.m_span, child.m_span); });
+        });
+    }
+
+    // Whether a line comment, not inside a string, quoted identifier or block comment, runs to the end of text.
+    static bool ends_in_line_comment(std::string_view text)
+    {
+        const char* p = text.data();
+        const char* end = p + text.size();
+        while ((p = scan::find_bracket_or_quote(p, end)) != end) {
+            if (*p == '"' || *p == '\'') {
+                p = scan::skip_quoted(p, end);
+                if (p == nullptr) {
+                    return false;
+                }
+            }
+            else if (*p == '/' && end - p >= 2 && p[1] == '*') {
+                const char* close = scan::find_comment_end(p + 2, end);
+                if (close == nullptr) {
+                    return false;
+                }
+                p = close + 2;
+            }
+            else if (*p == '/' && end - p >= 2 && p[1] == '/') {
+                auto lf = static_cast<const char*>(std::memchr(p + 2, '\n', static_cast<std::size_t>(end - p - 2)));
+                if (lf == nullptr) {
+                    return true;
+                }
+                p = lf + 1;
+            }
+            else {
+                ++p;
+            }
+        }
+        return false;
+    }
+
+    // Converts recorded regions to text offsets and finds the slots of their nodes below root.
+    static void Index(const std::vector<ParsedRegion>& parsed, const char* base, std::size_t offset, ast::Expression& root, std::vector<Region>& out)
+    {
+        std::unordered_map<const void*, ast::Expression*> slots;
+        slots.reserve(parsed.size());
+        ast::walk_pre(root, [&slots](ast::Expression& e) {
+            slots.emplace(std::visit([](auto& p) -> const void* { return p.get(); }, e.m_expr), &e);
+        });
+        out.reserve(out.size() + parsed.size());
+        for (auto& r : parsed) {
+            auto it = slots.find(r.m_node);
+            if (it == slots.end()) {
+                continue; // a node that was merged into another one, such as a call's name
+            }
+            out.push_back(Region{ static_cast<std::uint32_t>(offset + (r.m_begin - base)), static_cast<std::uint32_t>(offset + (r.m_end - base)), r.m_rule, it->second });
+        }
+    }
+
+    // Outer regions before inner ones, so the regions of a subtree are contiguous.
+    template <typename It>
+    static void SortRegions(It first, It last)
+    {
+        std::sort(first, last, [](const Region& a, const Region& b) {
+            return a.m_begin != b.m_begin ? a.m_begin < b.m_begin : a.m_end > b.m_end;
+        });
+    }
+
+    std::string m_text;
+    std::string m_name;
+    // string literals of reparsed subtrees view their fragment, so the fragments outlive the tree
+    std::vector<std::unique_ptr<const std::string>> m_fragments;
+    std::size_t m_fragmentBytes = 0;
+    ParseResult m_result;
+    std::size_t m_liveBytes = 0;
+    std::vector<Region> m_regions;
+    LineIndex m_lines;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// Recognition of the Modelica reserved words in O(1): a multiply-shift hash over the length and the first and
+// last two characters selects the only keyword a word can be, and a single comparison confirms it.
+namespace keywords {
+
+    enum class Keyword : std::uint8_t
+    {
+        Algorithm,
+        And,
+        Annotation,
+        Block,
+        Break,
+        Class,
+        Connect,
+        Connector,
+        Constant,
+        Constrainedby,
+        Der,
+        Discrete,
+        Each,
+        Else,
+        Elseif,
+        Elsewhen,
+        Encapsulated,
+        End,
+        Enumeration,
+        Equation,
+        Expandable,
+        Extends,
+        External,
+        False,
+        Final,
+        Flow,
+        For,
+        Function,
+        If,
+        Import,
+        Impure,
+        In,
+        Initial,
+        Inner,
+        Input,
+        Loop,
+        Model,
+        Not,
+        Operator,
+        Or,
+        Outer,
+        Output,
+        Package,
+        Parameter,
+        Partial,
+        Protected,
+        Public,
+        Pure,
+        Record,
+        Redeclare,
+        Replaceable,
+        Return,
+        Stream,
+        Then,
+        True,
+        Type,
+        When,
+        While,
+        Within
+    };
+
+    // indexed by Keyword
+    inline constexpr std::array<std::string_view, 59> names = {
+        "algorithm",
+        "and",
+        "annotation",
+        "block",
+        "break",
+        "class",
+        "connect",
+        "connector",
+        "constant",
+        "constrainedby",
+        "der",
+        "discrete",
+        "each",
+        "else",
+        "elseif",
+        "elsewhen",
+        "encapsulated",
+        "end",
+        "enumeration",
+        "equation",
+        "expandable",
+        "extends",
+        "external",
+        "false",
+        "final",
+        "flow",
+        "for",
+        "function",
+        "if",
+        "import",
+        "impure",
+        "in",
+        "initial",
+        "inner",
+        "input",
+        "loop",
+        "model",
+        "not",
+        "operator",
+        "or",
+        "outer",
+        "output",
+        "package",
+        "parameter",
+        "partial",
+        "protected",
+        "public",
+        "pure",
+        "record",
+        "redeclare",
+        "replaceable",
+        "return",
+        "stream",
+        "then",
+        "true",
+        "type",
+        "when",
+        "while",
+        "within"
+    };
+
+    inline constexpr std::size_t min_length = 2;
+    inline constexpr std::size_t max_length = 13;
+
+    // Slot of a word of at least min_length characters in the 256 entry table.
+    constexpr std::uint32_t slot(std::string_view word)
+    {
+        auto at = [&](std::size_t i) { return static_cast<std::uint32_t>(static_cast<unsigned char>(word[i])); };
+        std::size_t n = word.size();
+        std::uint32_t key = at(0) | at(1) << 8 | at(n - 2) << 16 | at(n - 1) << 24;
+        key ^= static_cast<std::uint32_t>(n) * 0x9E3779B1u;
+        return (key * 0xA7BF5019u) >> 24;
+    }
+
+    inline constexpr std::uint8_t no_keyword = 0xFF;
+
+    inline constexpr std::array<std::uint8_t, 256> table = [] {
+        std::array<std::uint8_t, 256> t{};
+        for (auto& entry : t) {
+            entry = no_keyword;
+        }
+        for (std::size_t i = 0; i < names.size(); ++i) {
+            t[slot(names[i])] = static_cast<std::uint8_t>(i);
+        }
+        return t;
+    }();
+
+    constexpr bool is_perfect()
+    {
+        for (std::size_t i = 0; i < names.size(); ++i) {
+            if (table[slot(names[i])] != i || names[i].size() < min_length || names[i].size() > max_length) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(is_perfect(), "keyword hash has collisions, pick new constants");
+
+    constexpr std::optional<Keyword> lookup(std::string_view word)
+    {
+        if (word.size() < min_length || word.size() > max_length) {
+            return std::nullopt;
+        }
+        std::uint8_t index = table[slot(word)];
+        if (index == no_keyword || names[index] != word) {
+            return std::nullopt;
+        }
+        return static_cast<Keyword>(index);
+    }
+
+    constexpr bool is_keyword(std::string_view word)
+    {
+        return lookup(word).has_value();
+    }
+
+    constexpr std::string_view name_of(Keyword keyword)
+    {
+        return names[static_cast<std::size_t>(keyword)];
+    }
+
+}
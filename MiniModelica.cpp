@@ -1,34 +1,356 @@
 // MiniModelica.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
 #include "tao/pegtl.hpp"
 #include "Grammar.hpp"
 #include "AST.hpp"
 #include "ASTBuilder.hpp"
 #include "ParserActions.hpp"
+#include "Parser.hpp"
+#include "PackageLoader.hpp"
 #include "PrintVisitor.hpp"
+#include "FlatAST.hpp"
+#include "BufferedPrinter.hpp"
+#include "ConstantFolding.hpp"
+#include "Bytecode.hpp"
+#include "BatchEvaluation.hpp"
+#include "NativeCodegen.hpp"
 
-template <typename rule>
-struct complete : peg::seq<rule, peg::eof> {};
+static double megabytes_per_second(std::size_t bytes, std::chrono::steady_clock::duration time)
+{
+    double seconds = std::chrono::duration<double>(time).count();
+    return seconds > 0. ? (bytes / 1e6) / seconds : 0.;
+}
+
+template <typename Result>
+static void print_stats(const std::string& name, const Result& result)
+{
+    double ms = std::chrono::duration<double, std::milli>(result.m_time).count();
+    std::cerr << name << ": " << result.m_bytes << " bytes in " << ms << " ms (" << megabytes_per_second(result.m_bytes, result.m_time) << " MB/s)\n";
+}
+
+// Compares the memory of the arena-allocated tree with its flat struct-of-arrays form, with and without sharing of
+// common subexpressions.
+static void print_flat_stats(const std::string& name, const ParseResult& result)
+{
+    ast::FlatTree tree;
+    tree.Add(result.m_ast.value());
+    ast::FlatTree dag;
+    dag.AddShared(result.m_ast.value());
+    std::cerr << name << ": " << tree.NodeCount() << " nodes, " << result.m_arena->BytesAllocated() << " bytes as tree, "
+        << tree.BytesReserved() << " bytes flat; " << dag.NodeCount() << " nodes, " << dag.BytesReserved()
+        << " bytes shared (sharing ratio " << dag.SharingRatio() << ")\n";
+}
+
+static void print_fold_stats(const std::string& name, const ast::FoldStats& stats)
+{
+    std::cerr << name << ": folded " << stats.m_folded << ", simplified " << stats.m_simplified << ", pruned "
+        << stats.m_pruned << "; " << stats.m_nodesBefore << " -> "
+        << stats.m_nodesAfter << " nodes (" << stats.Removed() << " removed)\n";
+}
 
-struct ExpressionReceiver
+// Evaluates the tree of a file count times with the naive evaluator, as bytecode, as bytecode over lanes of
+// different values and, given a compiler, as native code, changing one variable before each evaluation so that none
+// can be hoisted, and prints the time per evaluation.
+static bool benchmark_evaluation(const std::string& name, std::string_view text, const ast::Expression& e, std::size_t count, const ast::NativeCompiler* native)
 {
-    void Node(ast::Expression&& expr)
-    {
-        result.emplace(std::move(expr));
+    ast::VariableSlots slots;
+    ast::CompileResult compiled = ast::compile(e, slots);
+    if (!compiled.m_program.has_value()) {
+        LineIndex lines(text, name);
+        std::cerr << Diagnostic{ compiled.m_where.m_begin, compiled.m_error }.ToString(lines) << "\n";
+        return false;
+    }
+    std::vector<double> values(slots.Size());
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        values[i] = 1. + 0.25 * static_cast<double>(i);
+    }
+    auto measure = [&](auto&& evaluate) {
+        double sum = 0.;
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t k = 0; k < count; ++k) {
+            if (!values.empty()) {
+                values[k % values.size()] += 1e-9;
+            }
+            sum += evaluate();
+        }
+        auto time = std::chrono::steady_clock::now() - start;
+        return std::make_pair(std::chrono::duration<double, std::nano>(time).count() / static_cast<double>(count), sum);
+    };
+    ast::Machine machine(compiled.m_program.value());
+    auto [naiveNs, naiveSum] = measure([&] { return ast::evaluate_naive(e, slots, values); });
+    auto [bytecodeNs, bytecodeSum] = measure([&] { return machine.Run(values); });
+    std::cerr << name << ": " << compiled.m_program->m_code.size() << " instructions (" << compiled.m_shared << " operations shared), "
+        << compiled.m_program->m_registers << " registers; " << naiveNs << " ns per evaluation as tree, " << bytecodeNs << " ns as bytecode ("
+        << (bytecodeNs > 0. ? naiveNs / bytecodeNs : 0.) << "x)\n";
+    double naive = ast::evaluate_naive(e, slots, values);
+    double bytecode = machine.Run(values);
+    if (naive != bytecode && !(std::isnan(naive) && std::isnan(bytecode))) {
+        std::cerr << name << ": bytecode gives " << bytecode << " where the tree gives " << naive << "\n";
+        return false;
     }
 
-    std::optional<ast::Expression> result;
-};
+    // as many lanes as fit the cache, each a little apart from the values above, run until count points are done
+    const std::size_t lanes = std::min<std::size_t>(count, 4096);
+    std::vector<std::vector<double>> columns(values.size(), std::vector<double>(lanes));
+    for (std::size_t s = 0; s < columns.size(); ++s) {
+        for (std::size_t l = 0; l < lanes; ++l) {
+            columns[s][l] = values[s] + 1e-6 * static_cast<double>(l);
+        }
+    }
+    std::vector<std::span<const double>> spans(columns.begin(), columns.end());
+    std::vector<double> lanesOut(lanes);
+    ast::BatchMachine batch(compiled.m_program.value());
+    auto batchStart = std::chrono::steady_clock::now();
+    for (std::size_t done = 0; done < count; done += lanes) {
+        batch.Run(spans, lanesOut);
+    }
+    double batchNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - batchStart).count()
+        / static_cast<double>((count + lanes - 1) / lanes * lanes);
+    std::cerr << name << ": " << batchNs << " ns per evaluation in batches of " << lanes << " (" << (batchNs > 0. ? bytecodeNs / batchNs : 0.)
+        << "x over bytecode)\n";
+    std::vector<double> row(values.size());
+    std::size_t differing = 0;
+    for (std::size_t l = 0; l < lanes; ++l) {
+        for (std::size_t s = 0; s < row.size(); ++s) {
+            row[s] = columns[s][l];
+        }
+        double scalar = machine.Run(row);
+        if (scalar != lanesOut[l] && !(std::isnan(scalar) && std::isnan(lanesOut[l]))) {
+#ifdef MINIMODELICA_BATCH_SLEEF
+            ++differing; // the vector pow need not round as std::pow does
+#else
+            std::cerr << name << ": lane " << l << " gives " << lanesOut[l] << " where the bytecode gives " << scalar << "\n";
+            return false;
+#endif
+        }
+    }
+    if (differing > 0) {
+        std::cerr << name << ": " << differing << " lanes differ from the bytecode in rounding\n";
+    }
+    if (native == nullptr) {
+        return true;
+    }
 
+    // every variable is a state here, in the slots the bytecode gave them
+    ast::NativeResult module = native->Compile(e, slots, ast::VariableSlots{});
+    if (!module.m_module.has_value()) {
+        std::cerr << name << ": " << module.m_error << "\n";
+        return false;
+    }
+    auto run = [&] {
+        double out = 0.;
+        module.m_module->Run(values, {}, std::span<double>(&out, 1));
+        return out;
+    };
+    auto [nativeNs, nativeSum] = measure(run);
+    std::cerr << name << ": native code (" << module.m_shared << " operations shared) " << (module.m_fromCache ? "loaded" : "built") << " in "
+        << std::chrono::duration<double, std::milli>(module.m_time).count() << " ms; " << nativeNs << " ns per evaluation ("
+        << (nativeNs > 0. ? naiveNs / nativeNs : 0.) << "x)\n";
+    naive = ast::evaluate_naive(e, slots, values);
+    double result = run();
+    if (result != naive && !(std::isnan(result) && std::isnan(naive))) {
+        std::cerr << name << ": native code gives " << result << " where the tree gives " << naive << "\n";
+        return false;
+    }
+    return true;
+}
 
-int main()
+// All diagnostics of a failed parse or check, one per line.
+template <typename Result>
+static std::string failure_message(const std::string& name, const Result& result)
 {
-    peg::memory_input in("true > 1e-12", "");
-    ExpressionReceiver er;
-    bool success = peg::parse<complete<expression>, ast_builder_action>(in, er);
-    if (success) {
-        ast::visitor<ast::Expression, std::ostream>::visit(er.result.value(), std::cerr);
+    if (result.m_diagnostics.empty()) {
+        return name + ": parse failed";
+    }
+    LineIndex lines(result.m_text, name);
+    std::string message;
+    for (auto& diagnostic : result.m_diagnostics) {
+        if (!message.empty()) {
+            message += '\n';
+        }
+        message += diagnostic.ToString(lines);
+    }
+    return message;
+}
+
+template <typename Result>
+static int report_package(const PackageResult<Result>& package)
+{
+    int failures = 0;
+    std::size_t bytes = 0;
+    for (auto& file : package.m_files) {
+        if (file.m_error.has_value()) {
+            std::cerr << file.m_path.string() << ": " << file.m_error.value() << "\n";
+            ++failures;
+        }
+        else if (!file.m_result->m_success) {
+            std::cerr << failure_message(file.m_path.string(), file.m_result.value()) << "\n";
+            ++failures;
+        }
+    }
+    for (std::size_t t = 0; t < package.m_workers.size(); ++t) {
+        auto& w = package.m_workers[t];
+        bytes += w.m_bytes;
+        std::cerr << "thread " << t << ": " << w.m_files << " files, " << w.m_bytes << " bytes, "
+            << megabytes_per_second(w.m_bytes, w.m_busy) << " MB/s\n";
+    }
+    std::cerr << package.m_files.size() << " files, " << failures << " failed, "
+        << std::chrono::duration<double, std::milli>(package.m_wallTime).count() << " ms wall ("
+        << megabytes_per_second(bytes, package.m_wallTime) << " MB/s)\n";
+    return failures == 0 ? 0 : 1;
+}
+
+static int check_files(const std::vector<std::string>& files)
+{
+    int failures = 0;
+    for (auto& file : files) {
+        try {
+            CheckResult result = check_file(file);
+            if (!result.m_success) {
+                std::cerr << failure_message(file, result) << "\n";
+                ++failures;
+            }
+            print_stats(file, result);
+        }
+        catch (const std::exception& e) {
+            std::cerr << file << ": " << e.what() << "\n";
+            ++failures;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        ParseResult result = parse_string("true > 1e-12");
+        if (result.m_success) {
+            ast::visitor<ast::Expression, std::ostream>::visit(result.m_ast.value(), std::cerr);
+        }
+        return 0;
+    }
+
+    std::vector<std::string> files;
+    std::string package;
+    unsigned threads = 0;
+    bool check = false;
+    bool flat = false;
+    bool unparse = false;
+    bool annotations = false;
+    bool fold = false;
+    std::size_t evaluations = 0;
+    std::string cacheDir;
+    std::string nativeDir;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--package" && i + 1 < argc) {
+            package = argv[++i];
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--unparse") {
+            unparse = true;
+        }
+        else if (arg == "--annotations") {
+            annotations = true;
+        }
+        else if (arg == "--eval" && i + 1 < argc) {
+            evaluations = static_cast<std::size_t>(std::stoull(argv[++i]));
+        }
+        else if (arg == "--native" && i + 1 < argc) {
+            nativeDir = argv[++i];
+        }
+        else if (arg == "--fold") {
+            fold = true;
+        }
+        else if (arg == "--flat") {
+            flat = true;
+        }
+        else if (arg == "--check") {
+            check = true;
+        }
+        else if (arg == "-j" && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else {
+            files.push_back(arg);
+        }
+    }
+    std::optional<ParseCache> cache;
+    if (!cacheDir.empty()) {
+        cache.emplace(cacheDir);
+    }
+    std::optional<ast::NativeCompiler> native;
+    if (!nativeDir.empty()) {
+        native.emplace(nativeDir);
+    }
+    if (!package.empty()) {
+        return check ? report_package(check_package(package, threads)) : report_package(load_package(package, threads, cache ? &cache.value() : nullptr));
+    }
+    if (check) {
+        return check_files(files);
+    }
+
+    // the trees go to stdout through one buffer flushed in large blocks, as Modelica source with --unparse;
+    // annotations are copied from the source unless --annotations asks for them to be parsed
+    ast::OutputBuffer out(1);
+    int failures = 0;
+    for (auto& file : files) {
+        try {
+            ParseResult result = cache ? cache->Parse(file) : parse_file(file);
+            if (result.m_success) {
+                if (fold) {
+                    print_fold_stats(file, ast::fold_constants(result.m_ast.value()));
+                }
+                if (unparse) {
+                    ast::SourceWriter writer{ out };
+                    ast::visitor<ast::Expression, ast::SourceWriter>::visit(result.m_ast.value(), writer);
+                    std::optional<AnnotationResult> annotation;
+                    if (annotations && result.m_description.m_annotation.has_value()) {
+                        annotation = parse_annotation(result.m_description.m_annotation.value());
+                        if (annotation->m_wellFormed && !annotation->m_success) {
+                            // valid, but with values the builders do not materialize, such as the named arguments
+                            // and arrays of graphics annotations; it is copied as written
+                            std::cerr << file << ": annotation not materialized"
+                                << (annotation->m_diagnostics.empty() ? "" : ": " + annotation->m_diagnostics.front().m_message) << "\n";
+                        }
+                        else if (!annotation->m_success) {
+                            std::cerr << failure_message(file + " annotation", annotation.value()) << "\n";
+                            ++failures;
+                        }
+                    }
+                    ast::write_description(result.m_description, writer, annotation && annotation->m_success ? &annotation->m_modification.value() : nullptr);
+                }
+                else {
+                    ast::TreeWriter writer{ out };
+                    ast::visitor<ast::Expression, ast::TreeWriter>::visit(result.m_ast.value(), writer);
+                }
+                out.Put('\n');
+                if (flat) {
+                    print_flat_stats(file, result);
+                }
+                if (evaluations > 0 && !benchmark_evaluation(file, result.m_text, result.m_ast.value(), evaluations, native ? &native.value() : nullptr)) {
+                    ++failures;
+                }
+            }
+            else {
+                std::cerr << failure_message(file, result) << "\n";
+                ++failures;
+            }
+            print_stats(file, result);
+        }
+        catch (const std::exception& e) {
+            std::cerr << file << ": " << e.what() << "\n";
+            ++failures;
+        }
     }
+    return failures == 0 ? 0 : 1;
 }
@@ -0,0 +1,724 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+#include "CpuFeatures.hpp"
+#include "Evaluation.hpp"
+#include "ParseCache.hpp"
+
+// Native code for scalar expressions (see Evaluation.hpp for what evaluates). A list of expressions is lowered to a
+// self-contained C++ translation unit defining
+//     extern "C" void minimodelica_evaluate(const double* x, const double* p, double* out)
+// which stores the value of the i-th expression at out[i], reading state variables from x and parameters from p at
+// their slots. The unit is built into a shared library by the installed compiler and loaded. Libraries are cached in
+// a directory under the hash of their source, their build command and the processor they were built for, so a run
+// that needs the same code again on the same kind of host loads it without compiling.
+namespace ast {
+
+    using NativeFunction = void (*)(const double* states, const double* parameters, double* out);
+
+    struct NativeSource
+    {
+        std::optional<std::string> m_code;
+        std::string m_error;
+        SourceSpan m_where;       // of the expression that could not be lowered
+        std::size_t m_shared = 0; // operations that reuse the constant of an equal one
+    };
+
+    namespace native {
+
+        inline constexpr const char* EntryPoint = "minimodelica_evaluate";
+
+        // The C library functions of the builtins, in the order of Builtin.
+        inline constexpr std::array<std::string_view, 16> LibraryNames = {
+            "sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh", "exp", "log", "log10", "sqrt", "fabs", "floor", "ceil",
+        };
+
+        // C++ text of a double literal that reads back as the same value.
+        inline std::string literal(double value)
+        {
+            if (std::isnan(value)) {
+                return "std::numeric_limits<double>::quiet_NaN()";
+            }
+            if (std::isinf(value)) {
+                return value < 0. ? "(-std::numeric_limits<double>::infinity())" : "std::numeric_limits<double>::infinity()";
+            }
+            char text[32];
+            std::string number(text, static_cast<std::size_t>(std::to_chars(text, text + sizeof(text), value).ptr - text));
+            if (number.find_first_of(".e") == std::string::npos) {
+                number += ".0"; // a double, so that 1 / 2 does not divide integers
+            }
+            return std::signbit(value) ? "(" + number + ")" : number;
+        }
+
+        // Lowers in one post-order walk, with the C++ text of the operands computed so far on a stack. Literals and
+        // variables are used in place and every operation gets a constant of its own, so the text stays flat however
+        // deep the tree is and the C++ compiler sees each rounding step the other evaluators make. An operation whose
+        // text equals one defined before, in this expression or an earlier one, uses that constant instead: operands
+        // are always literals, slots or constants, so equal text is the same operation on the same values.
+        class Generator
+        {
+        public:
+            Generator(VariableSlots& states, const VariableSlots& parameters)
+                : m_states(states), m_parameters(parameters) {}
+
+            // Appends the computation of root, whose value goes to the next element of out.
+            bool Add(const Expression& root)
+            {
+                walk(root, [this](const Expression& e) {
+                    return m_error.empty() && !std::holds_alternative<ComponentExpressionPtr>(e.m_expr);
+                }, [this](const Expression& e) {
+                    if (m_error.empty()) {
+                        std::visit([&](auto& ptr) { Emit(e, *ptr); }, e.m_expr);
+                    }
+                });
+                if (!m_error.empty()) {
+                    return false;
+                }
+                m_body += "    out[" + std::to_string(m_outputs++) + "] = " + Pop() + ";\n";
+                return true;
+            }
+
+            NativeSource Finish()
+            {
+                NativeSource result;
+                if (!m_error.empty()) {
+                    result.m_error = std::move(m_error);
+                    result.m_where = m_where;
+                    return result;
+                }
+                std::string code;
+                code.reserve(m_body.size() + 1024);
+                code += "// generated by MiniModelica\n"
+                    "#include <cmath>\n"
+                    "#include <limits>\n"
+                    "\n"
+                    "#ifdef _WIN32\n"
+                    "#define MINIMODELICA_EXPORT __declspec(dllexport)\n"
+                    "#else\n"
+                    "#define MINIMODELICA_EXPORT __attribute__((visibility(\"default\")))\n"
+                    "#endif\n"
+                    "\n"
+                    "// ast::power\n"
+                    "static double minimodelica_power(double a, double b)\n"
+                    "{\n"
+                    "    if (b == 2.) {\n"
+                    "        return a * a;\n"
+                    "    }\n"
+                    "    if (b == 0.5) {\n"
+                    "        return a == -std::numeric_limits<double>::infinity() ? std::numeric_limits<double>::infinity() : std::sqrt(a) + 0.;\n"
+                    "    }\n"
+                    "    if (b == -1.) {\n"
+                    "        return 1. / a;\n"
+                    "    }\n"
+                    "    if (b == 1.) {\n"
+                    "        return a;\n"
+                    "    }\n"
+                    "    return std::pow(a, b);\n"
+                    "}\n"
+                    "\n"
+                    "extern \"C\" MINIMODELICA_EXPORT void ";
+                code += EntryPoint;
+                code += "(const double* x, const double* p, double* out)\n{\n";
+                code += m_body;
+                code += "    (void)x;\n    (void)p;\n}\n";
+                result.m_code = std::move(code);
+                result.m_shared = m_reused;
+                return result;
+            }
+
+        private:
+            void Fail(const Expression& e, const char* error)
+            {
+                m_error = error;
+                m_where = e.m_span;
+            }
+
+            std::string Pop()
+            {
+                std::string operand = std::move(m_operands.back());
+                m_operands.pop_back();
+                return operand;
+            }
+
+            // Defines a constant with the value of expression, unless one is defined already, which becomes an operand
+            // in turn.
+            void Result(const std::string& expression)
+            {
+                auto [it, added] = m_shared.try_emplace(expression);
+                if (!added) {
+                    ++m_reused;
+                    m_operands.push_back(it->second);
+                    return;
+                }
+                it->second = "t" + std::to_string(m_temporaries++);
+                m_body += "    const double " + it->second + " = " + expression + ";\n";
+                m_operands.push_back(it->second);
+            }
+
+            void Emit(const Expression&, const IfExpression&)
+            {
+                // both branches are computed and one selected, as in the bytecode
+                std::string otherwise = Pop();
+                std::string then = Pop();
+                std::string condition = Pop();
+                Result(condition + " != 0. ? " + then + " : " + otherwise);
+            }
+
+            void Emit(const Expression&, const UnaryOpExpression& e)
+            {
+                switch (e.m_op) {
+                case UnaryOp::Not:
+                    Result(Pop() + " == 0. ? 1. : 0.");
+                    break;
+                case UnaryOp::Minus:
+                case UnaryOp::DotMinus:
+                    Result("-" + Pop());
+                    break;
+                default:
+                    break; // the operand is the result
+                }
+            }
+
+            void Emit(const Expression&, const BinaryOpExpression& e)
+            {
+                std::string right = Pop();
+                std::string left = Pop();
+                if (is_square(e)) {
+                    return Result(left + " * " + left);
+                }
+                switch (e.m_op) {
+                case BinaryOp::Or: return Result(left + " != 0. || " + right + " != 0. ? 1. : 0.");
+                case BinaryOp::And: return Result(left + " != 0. && " + right + " != 0. ? 1. : 0.");
+                case BinaryOp::Less: return Result(left + " < " + right + " ? 1. : 0.");
+                case BinaryOp::LessEqual: return Result(left + " <= " + right + " ? 1. : 0.");
+                case BinaryOp::Greater: return Result(left + " > " + right + " ? 1. : 0.");
+                case BinaryOp::GreaterEqual: return Result(left + " >= " + right + " ? 1. : 0.");
+                case BinaryOp::Equal: return Result(left + " == " + right + " ? 1. : 0.");
+                case BinaryOp::NotEqual: return Result(left + " != " + right + " ? 1. : 0.");
+                case BinaryOp::Add:
+                case BinaryOp::AddElemWise: return Result(left + " + " + right);
+                case BinaryOp::Sub:
+                case BinaryOp::SubElemWise: return Result(left + " - " + right);
+                case BinaryOp::Mul:
+                case BinaryOp::MulElemWise: return Result(left + " * " + right);
+                case BinaryOp::Div:
+                case BinaryOp::DivElemWise: return Result(left + " / " + right);
+                default: return Result("minimodelica_power(" + left + ", " + right + ")");
+                }
+            }
+
+            void Emit(const Expression& node, const FunctionCallExpression& e)
+            {
+                auto function = find_builtin(e.m_functionName);
+                if (!function.has_value()) {
+                    return Fail(node, "only calls of builtin functions of one argument can be compiled");
+                }
+                if (e.m_arguments.size() != 1) {
+                    return Fail(node, "builtin function takes one argument");
+                }
+                Result("std::" + std::string(LibraryNames[static_cast<std::size_t>(function.value())]) + "(" + Pop() + ")");
+            }
+
+            void Emit(const Expression& node, const LiteralExpression& e)
+            {
+                switch (e.m_type) {
+                case LiteralType::Real:
+                    m_operands.push_back(literal(std::get<double>(e.m_value)));
+                    break;
+                case LiteralType::Integer:
+                    m_operands.push_back(literal(std::get<int>(e.m_value)));
+                    break;
+                case LiteralType::Boolean:
+                    m_operands.push_back(std::get<bool>(e.m_value) ? "1." : "0.");
+                    break;
+                default:
+                    Fail(node, "only numeric and Boolean literals can be compiled");
+                }
+            }
+
+            void Emit(const Expression& node, const ArrayRangeExpression&)
+            {
+                Fail(node, "array ranges can not be compiled");
+            }
+
+            void Emit(const Expression& node, const ComponentExpression& e)
+            {
+                if (!VariableSlots::Names(e.m_componentRef)) {
+                    return Fail(node, "subscripted component references can not be compiled");
+                }
+                if (auto parameter = m_parameters.Find(e.m_componentRef)) {
+                    m_operands.push_back("p[" + std::to_string(parameter.value()) + "]");
+                }
+                else {
+                    m_operands.push_back("x[" + std::to_string(m_states.Slot(e.m_componentRef)) + "]");
+                }
+            }
+
+            VariableSlots& m_states;
+            const VariableSlots& m_parameters;
+            std::string m_body;
+            std::vector<std::string> m_operands;
+            std::unordered_map<std::string, std::string> m_shared;
+            std::size_t m_reused = 0;
+            std::size_t m_temporaries = 0;
+            std::size_t m_outputs = 0;
+            std::string m_error;
+            SourceSpan m_where;
+        };
+
+        inline bool read_file(const std::filesystem::path& path, std::string& data)
+        {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                return false;
+            }
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            return !in.bad();
+        }
+
+        // Written to a temporary file and renamed, as ParseCache does, so concurrent runs never see a partial file.
+        inline bool write_file(const std::filesystem::path& path, std::string_view data)
+        {
+            auto temp = temporary_path(path);
+            {
+                std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+                out.write(data.data(), static_cast<std::streamsize>(data.size()));
+                if (!out) {
+                    out.close();
+                    std::error_code ec;
+                    std::filesystem::remove(temp, ec);
+                    return false;
+                }
+            }
+            std::error_code ec;
+            std::filesystem::rename(temp, path, ec);
+            if (ec) {
+                std::filesystem::remove(temp, ec);
+                return false;
+            }
+            return true;
+        }
+
+#ifdef _WIN32
+        // Quoted so that CommandLineToArgvW, and so the C runtime of the program, gives the argument back unchanged:
+        // backslashes are only doubled where a quote follows them.
+        inline void append_argument(std::wstring& line, const std::wstring& argument)
+        {
+            if (!line.empty()) {
+                line += L' ';
+            }
+            line += L'"';
+            std::size_t backslashes = 0;
+            for (wchar_t c : argument) {
+                if (c == L'\\') {
+                    ++backslashes;
+                    continue;
+                }
+                line.append(c == L'"' ? 2 * backslashes + 1 : backslashes, L'\\');
+                backslashes = 0;
+                line += c;
+            }
+            line.append(2 * backslashes, L'\\');
+            line += L'"';
+        }
+#endif
+
+        // Runs a program with the given arguments, the first naming it, and its output and errors going to log.
+        // No shell is involved, so nothing in the arguments is expanded; the program is looked up on the path.
+        // True if it ran and exited with 0.
+        inline bool run_process(const std::vector<std::filesystem::path>& arguments, const std::filesystem::path& log)
+        {
+#ifdef _WIN32
+            std::wstring line;
+            for (auto& argument : arguments) {
+                append_argument(line, argument.native());
+            }
+            SECURITY_ATTRIBUTES inherit{ static_cast<DWORD>(sizeof(SECURITY_ATTRIBUTES)), nullptr, TRUE };
+            HANDLE output = CreateFileW(log.c_str(), GENERIC_WRITE, FILE_SHARE_READ, &inherit, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (output == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            STARTUPINFOW startup{};
+            startup.cb = sizeof(startup);
+            startup.dwFlags = STARTF_USESTDHANDLES;
+            startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+            startup.hStdOutput = output;
+            startup.hStdError = output;
+            PROCESS_INFORMATION process{};
+            BOOL started = CreateProcessW(nullptr, line.data(), nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &startup, &process);
+            CloseHandle(output);
+            if (!started) {
+                return false;
+            }
+            WaitForSingleObject(process.hProcess, INFINITE);
+            DWORD code = 1;
+            GetExitCodeProcess(process.hProcess, &code);
+            CloseHandle(process.hThread);
+            CloseHandle(process.hProcess);
+            return code == 0;
+#else
+            std::vector<char*> argv;
+            for (auto& argument : arguments) {
+                argv.push_back(const_cast<char*>(argument.c_str()));
+            }
+            argv.push_back(nullptr);
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_addopen(&actions, 1, log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            posix_spawn_file_actions_adddup2(&actions, 1, 2);
+            pid_t pid = 0;
+            int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+            posix_spawn_file_actions_destroy(&actions);
+            if (error != 0) {
+                return false;
+            }
+            int status = 0;
+            while (waitpid(pid, &status, 0) == -1) {
+                if (errno != EINTR) {
+                    return false;
+                }
+            }
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+        }
+
+    }
+
+    // Lowers the expressions in order, giving each variable they read that is not a parameter a slot in states.
+    inline NativeSource generate_native(std::span<const Expression* const> roots, VariableSlots& states, const VariableSlots& parameters)
+    {
+        native::Generator generator(states, parameters);
+        for (const Expression* root : roots) {
+            if (!generator.Add(*root)) {
+                break;
+            }
+        }
+        return generator.Finish();
+    }
+
+    // A loaded library and its entry point. The library stays loaded for the lifetime of the module.
+    class NativeModule
+    {
+    public:
+        NativeModule(NativeModule&& other) noexcept
+            : m_handle(std::exchange(other.m_handle, nullptr)), m_function(std::exchange(other.m_function, nullptr)), m_states(other.m_states),
+              m_parameters(other.m_parameters), m_outputs(other.m_outputs) {}
+
+        NativeModule& operator=(NativeModule&& other) noexcept
+        {
+            std::swap(m_handle, other.m_handle);
+            std::swap(m_function, other.m_function);
+            std::swap(m_states, other.m_states);
+            std::swap(m_parameters, other.m_parameters);
+            std::swap(m_outputs, other.m_outputs);
+            return *this;
+        }
+
+        NativeModule(const NativeModule& other) = delete;
+        NativeModule& operator=(const NativeModule& other) = delete;
+
+        ~NativeModule()
+        {
+            if (m_handle != nullptr) {
+#ifdef _WIN32
+                FreeLibrary(static_cast<HMODULE>(m_handle));
+#else
+                dlclose(m_handle);
+#endif
+            }
+        }
+
+        // Loads a library built from generate_native for slot tables of the given sizes and the given number of
+        // expressions; on failure returns nothing and sets error.
+        static std::optional<NativeModule> Load(const std::filesystem::path& library, std::size_t states, std::size_t parameters, std::size_t outputs,
+            std::string& error)
+        {
+#ifdef _WIN32
+            HMODULE handle = LoadLibraryW(library.c_str());
+            if (handle == nullptr) {
+                error = "can not load " + library.string();
+                return std::nullopt;
+            }
+            auto function = reinterpret_cast<NativeFunction>(GetProcAddress(handle, native::EntryPoint));
+            if (function == nullptr) {
+                FreeLibrary(handle);
+                error = library.string() + " has no entry point";
+                return std::nullopt;
+            }
+#else
+            void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (handle == nullptr) {
+                error = dlerror();
+                return std::nullopt;
+            }
+            auto function = reinterpret_cast<NativeFunction>(dlsym(handle, native::EntryPoint));
+            if (function == nullptr) {
+                dlclose(handle);
+                error = library.string() + " has no entry point";
+                return std::nullopt;
+            }
+#endif
+            return NativeModule(handle, function, states, parameters, outputs);
+        }
+
+        // Callable from any number of threads at once: the code keeps no state.
+        NativeFunction Function() const
+        {
+            return m_function;
+        }
+
+        // The sizes of the state and parameter slot tables when the code was generated, which are the least sizes of
+        // states and parameters.
+        std::size_t States() const
+        {
+            return m_states;
+        }
+
+        std::size_t Parameters() const
+        {
+            return m_parameters;
+        }
+
+        // The number of expressions, which is the size of out.
+        std::size_t Outputs() const
+        {
+            return m_outputs;
+        }
+
+        // The code reads every slot it was generated for without checking, so spans shorter than that are refused
+        // here: out is filled with NaN, as far as it goes, like Machine does for a missing variable.
+        void Run(std::span<const double> states, std::span<const double> parameters, std::span<double> out) const
+        {
+            if (states.size() < m_states || parameters.size() < m_parameters || out.size() < m_outputs) {
+                std::fill(out.begin(), out.end(), std::numeric_limits<double>::quiet_NaN());
+                return;
+            }
+            m_function(states.data(), parameters.data(), out.data());
+        }
+
+    private:
+        NativeModule(void* handle, NativeFunction function, std::size_t states, std::size_t parameters, std::size_t outputs)
+            : m_handle(handle), m_function(function), m_states(states), m_parameters(parameters), m_outputs(outputs) {}
+
+        void* m_handle = nullptr;
+        NativeFunction m_function = nullptr;
+        std::size_t m_states = 0;
+        std::size_t m_parameters = 0;
+        std::size_t m_outputs = 0;
+    };
+
+    struct NativeResult
+    {
+        std::optional<NativeModule> m_module;
+        std::string m_error;
+        SourceSpan m_where;       // of the expression that could not be lowered, if that was the error
+        std::size_t m_shared = 0; // as in NativeSource
+        bool m_fromCache = false;
+        std::chrono::steady_clock::duration m_time{};
+    };
+
+    // The compiler named by the CXX environment variable, else the platform's. It is run as one program, without a
+    // shell, so CXX is a path or a name on the path and not a command line.
+    inline std::string default_native_compiler()
+    {
+#ifdef _WIN32
+        char* value = nullptr;
+        std::size_t size = 0;
+        if (_dupenv_s(&value, &size, "CXX") == 0 && value != nullptr) {
+            std::string compiler(value);
+            std::free(value);
+            if (!compiler.empty()) {
+                return compiler;
+            }
+        }
+        return "cl";
+#else
+        const char* value = std::getenv("CXX");
+        return value != nullptr && *value != '\0' ? value : "c++";
+#endif
+    }
+
+    // Builds and loads native modules through a cache directory holding, for each hash, the generated source, the
+    // library and the compiler output. An entry is used only if its source is the one generated now; a failed build
+    // leaves just the source and the log behind, for looking into. Builds for the same code from concurrent runs
+    // both compile, each to a temporary name unique to its process and thread, and the last rename wins.
+    class NativeCompiler
+    {
+    public:
+        explicit NativeCompiler(std::filesystem::path dir, std::string compiler = default_native_compiler())
+            : m_dir(std::move(dir)), m_compiler(std::move(compiler)) {}
+
+        NativeResult Compile(std::span<const Expression* const> roots, VariableSlots& states, const VariableSlots& parameters) const
+        {
+            auto start = std::chrono::steady_clock::now();
+            NativeResult result;
+            NativeSource source = generate_native(roots, states, parameters);
+            if (!source.m_code.has_value()) {
+                result.m_error = std::move(source.m_error);
+                result.m_where = source.m_where;
+                return result;
+            }
+            const std::string& code = source.m_code.value();
+            result.m_shared = source.m_shared;
+
+            // the build command is part of the key, so a library built for other flags or another compiler is not
+            // reused, and so is the processor -march=native resolves to: a cache directory shared between hosts must
+            // not hand one a library using instructions it does not have
+            std::uint64_t hash = content_hash(m_compiler + '\n' + Flags() + '\n' + cpu::host_target() + '\n' + code);
+            char name[17];
+            static constexpr char digits[] = "0123456789abcdef";
+            for (int i = 0; i < 16; ++i) {
+                name[i] = digits[(hash >> (60 - 4 * i)) & 0xF];
+            }
+            name[16] = '\0';
+            std::string stem(name);
+            auto sourcePath = m_dir / (stem + ".cpp");
+            auto library = m_dir / (stem + LibrarySuffix);
+
+            std::error_code ec;
+            std::string stored;
+            if (std::filesystem::is_regular_file(library, ec) && native::read_file(sourcePath, stored) && stored == code) {
+                std::string error;
+                result.m_module = NativeModule::Load(library, states.Size(), parameters.Size(), roots.size(), error);
+                if (result.m_module.has_value()) {
+                    result.m_fromCache = true;
+                    result.m_time = std::chrono::steady_clock::now() - start;
+                    return result;
+                }
+            }
+
+            std::filesystem::create_directories(m_dir, ec);
+            if (!native::write_file(sourcePath, code)) {
+                result.m_error = "can not write " + sourcePath.string();
+                return result;
+            }
+            auto built = temporary_path(library);
+            built += LibrarySuffix;
+            auto log = m_dir / (stem + ".log");
+            auto buildLog = temporary_path(log);
+            bool compiled = native::run_process(Arguments(sourcePath, built), buildLog);
+            std::filesystem::rename(buildLog, log, ec);
+            if (ec) {
+                std::filesystem::remove(buildLog, ec);
+            }
+            if (!compiled) {
+                std::string output;
+                native::read_file(log, output);
+                result.m_error = "compiling " + sourcePath.string() + " failed:\n" + output;
+                std::filesystem::remove(built, ec);
+                return result;
+            }
+            std::filesystem::rename(built, library, ec);
+            if (ec) {
+                std::filesystem::remove(built, ec);
+                result.m_error = "can not write " + library.string();
+                return result;
+            }
+            result.m_module = NativeModule::Load(library, states.Size(), parameters.Size(), roots.size(), result.m_error);
+            result.m_time = std::chrono::steady_clock::now() - start;
+            return result;
+        }
+
+        NativeResult Compile(const Expression& root, VariableSlots& states, const VariableSlots& parameters) const
+        {
+            const Expression* roots[] = { &root };
+            return Compile(roots, states, parameters);
+        }
+
+    private:
+#ifdef _WIN32
+        static constexpr const char* LibrarySuffix = ".dll";
+
+        // /fp:precise keeps each operation rounded on its own, like the other evaluators; AVX2 only where this host
+        // has it, as there is no -march=native
+        static std::string Flags()
+        {
+            return cpu::has_avx2() ? "/nologo /std:c++17 /O2 /fp:precise /arch:AVX2 /LD" : "/nologo /std:c++17 /O2 /fp:precise /LD";
+        }
+
+        std::vector<std::filesystem::path> Arguments(const std::filesystem::path& source, const std::filesystem::path& library) const
+        {
+            std::vector<std::filesystem::path> arguments = Words();
+            arguments.push_back(source);
+            arguments.push_back(L"/Fe" + library.native());
+            // the object file is named after the library, so concurrent builds do not write the same one
+            arguments.push_back(L"/Fo" + std::filesystem::path(library).replace_extension(".obj").native());
+            return arguments;
+        }
+#else
+        static constexpr const char* LibrarySuffix = ".so";
+
+        // no contraction into fused multiply-adds, which -march=native would otherwise allow and which would make
+        // the results differ from the other evaluators
+        static std::string Flags()
+        {
+            return "-std=c++17 -O3 -march=native -ffp-contract=off -fPIC -shared";
+        }
+
+        std::vector<std::filesystem::path> Arguments(const std::filesystem::path& source, const std::filesystem::path& library) const
+        {
+            std::vector<std::filesystem::path> arguments = Words();
+            arguments.push_back("-o");
+            arguments.push_back(library);
+            arguments.push_back(source);
+            return arguments;
+        }
+#endif
+
+        // The compiler, taken as one program even if its path has spaces, followed by the flags split at spaces.
+        std::vector<std::filesystem::path> Words() const
+        {
+            std::vector<std::filesystem::path> words{ std::filesystem::path(m_compiler) };
+            const std::string flags = Flags();
+            std::size_t begin = flags.find_first_not_of(' ');
+            while (begin != std::string::npos) {
+                std::size_t end = flags.find(' ', begin);
+                words.emplace_back(flags.substr(begin, end - begin));
+                begin = end == std::string::npos ? end : flags.find_first_not_of(' ', end);
+            }
+            return words;
+        }
+
+        std::filesystem::path m_dir;
+        std::string m_compiler;
+    };
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Parser.hpp"
+#include "ParseCache.hpp"
+
+template <typename Result>
+struct PackageFile
+{
+    std::filesystem::path m_path;
+    std::optional<Result> m_result;
+    std::optional<std::string> m_error;
+};
+
+struct WorkerStats
+{
+    std::size_t m_files = 0;
+    std::size_t m_bytes = 0;
+    std::chrono::steady_clock::duration m_busy{};
+};
+
+template <typename Result>
+struct PackageResult
+{
+    std::vector<PackageFile<Result>> m_files; // sorted by path
+    std::vector<WorkerStats> m_workers;
+    std::chrono::steady_clock::duration m_wallTime{};
+};
+
+// Recursively collects all Modelica source files below root, in path order.
+inline std::vector<std::filesystem::path> collect_package_files(const std::filesystem::path& root)
+{
+    std::vector<std::filesystem::path> files;
+    if (std::filesystem::is_regular_file(root)) {
+        files.push_back(root);
+        return files;
+    }
+    for (auto& entry : std::filesystem::recursive_directory_iterator(root)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".mo") {
+            files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Runs fn on every file from a shared work queue drained by a pool of threads.
+// Every parse constructs its own builders on the worker's stack, so no parser state is shared between threads.
+template <typename Result, typename Fn>
+PackageResult<Result> process_files_parallel(const std::vector<std::filesystem::path>& paths, unsigned threads, Fn fn)
+{
+    PackageResult<Result> package;
+    package.m_files.resize(paths.size());
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<std::size_t>(threads, std::max<std::size_t>(paths.size(), 1)));
+    package.m_workers.resize(threads);
+
+    // hand out the biggest files first so one late giant does not serialise the tail of the load
+    std::vector<std::pair<std::uintmax_t, std::size_t>> queue;
+    queue.reserve(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(paths[i], ec);
+        queue.emplace_back(ec ? 0 : size, i);
+    }
+    std::sort(queue.begin(), queue.end(), [](auto& a, auto& b) { return a.first > b.first; });
+
+    std::atomic<std::size_t> next{ 0 };
+    auto worker = [&](WorkerStats& stats) {
+        for (std::size_t q = next++; q < queue.size(); q = next++) {
+            auto [size, index] = queue[q];
+            auto& file = package.m_files[index];
+            file.m_path = paths[index];
+            auto start = std::chrono::steady_clock::now();
+            try {
+                file.m_result.emplace(fn(file.m_path));
+            }
+            catch (const std::exception& e) {
+                file.m_error = e.what();
+            }
+            catch (...) {
+                file.m_error = "unknown error";
+            }
+            stats.m_busy += std::chrono::steady_clock::now() - start;
+            stats.m_bytes += static_cast<std::size_t>(size);
+            ++stats.m_files;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        // joined when the pool goes, also if it goes with an exception; a thread that can not be started leaves
+        // its share of the files to the others
+        std::vector<std::jthread> pool;
+        pool.reserve(threads - 1);
+        for (unsigned t = 1; t < threads; ++t) {
+            try {
+                pool.emplace_back(worker, std::ref(package.m_workers[t]));
+            }
+            catch (const std::system_error&) {
+                break;
+            }
+        }
+        worker(package.m_workers[0]);
+    }
+    package.m_wallTime = std::chrono::steady_clock::now() - start;
+    return package;
+}
+
+// Parses every .mo file below root in parallel; threads == 0 uses one worker per hardware thread.
+// With a cache, unchanged files are loaded from it instead and newly parsed ones are added.
+inline PackageResult<ParseResult> load_package(const std::filesystem::path& root, unsigned threads = 0, const ParseCache* cache = nullptr)
+{
+    return process_files_parallel<ParseResult>(collect_package_files(root), threads, [cache](const std::filesystem::path& path) {
+        return cache != nullptr ? cache->Parse(path) : parse_file(path);
+    });
+}
+
+// Syntax checks every .mo file below root in parallel, without building any AST.
+inline PackageResult<CheckResult> check_package(const std::filesystem::path& root, unsigned threads = 0)
+{
+    return process_files_parallel<CheckResult>(collect_package_files(root), threads, [](const std::filesystem::path& path) {
+        return check_file(path);
+    });
+}
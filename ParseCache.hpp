@@ -0,0 +1,151 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <random>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "tao/pegtl.hpp"
+#include "Arena.hpp"
+#include "Parser.hpp"
+#include "Serialization.hpp"
+
+// 64-bit FNV-1a
+inline std::uint64_t content_hash(std::string_view data)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// A name next to path for a file that is written and then renamed to path, unique across the threads and processes
+// doing the same: the process id tells processes apart, and a random number the writes of one process.
+inline std::filesystem::path temporary_path(const std::filesystem::path& path)
+{
+    thread_local std::mt19937_64 random(std::random_device{}() ^ std::hash<std::thread::id>{}(std::this_thread::get_id()));
+#ifdef _WIN32
+    auto pid = _getpid();
+#else
+    auto pid = getpid();
+#endif
+    auto temp = path;
+    temp += ".tmp" + std::to_string(pid) + "-" + std::to_string(random());
+    return temp;
+}
+
+// Directory of serialized trees keyed by the hash of the source text, so unchanged files are loaded without running
+// the parser. Entries also record the source size and the format version and are ignored on any mismatch; writes go
+// through a temporary file and a rename, so concurrent loaders never see a partial entry.
+class ParseCache
+{
+public:
+    explicit ParseCache(std::filesystem::path dir)
+        : m_dir(std::move(dir))
+    {
+        std::filesystem::create_directories(m_dir);
+    }
+
+    std::filesystem::path EntryFor(std::uint64_t hash) const
+    {
+        char name[17];
+        static constexpr char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 16; ++i) {
+            name[i] = digits[(hash >> (60 - 4 * i)) & 0xF];
+        }
+        name[16] = '\0';
+        return m_dir / (std::string(name) + ".mast");
+    }
+
+    // Loads the tree of a file from the cache if its entry is valid, otherwise parses the file and stores the tree.
+    ParseResult Parse(const std::filesystem::path& path) const
+    {
+        auto source = std::make_shared<mapped_input>(path);
+        std::string_view text(source->begin(), source->size());
+        auto start = std::chrono::steady_clock::now();
+        std::uint64_t hash = content_hash(text);
+        auto entry = EntryFor(hash);
+
+        std::error_code ec;
+        if (std::filesystem::is_regular_file(entry, ec)) {
+            ParseResult result = Load(entry, hash, source);
+            if (result.m_success) {
+                result.m_time = std::chrono::steady_clock::now() - start;
+                return result;
+            }
+        }
+
+        ParseResult result = parse_input(*source);
+        result.m_source = std::move(source);
+        if (result.m_success) {
+            Store(entry, ast::serialize(result.m_ast.value(), result.m_description, hash, text.size()));
+        }
+        return result;
+    }
+
+private:
+    ParseResult Load(const std::filesystem::path& entry, std::uint64_t hash, const std::shared_ptr<mapped_input>& source) const
+    {
+        ParseResult result;
+        const std::size_t size = source->size();
+        try {
+            // string literals in the tree point into the mapping of the entry, the spans into the source text, and
+            // the result keeps both alive
+            auto cached = std::make_shared<mapped_input>(entry);
+            std::string_view data(cached->begin(), cached->size());
+            auto header = ast::read_header(data);
+            if (!header.has_value() || header->m_sourceHash != hash || header->m_sourceSize != size) {
+                return result;
+            }
+            ast::ArenaScope scope(*result.m_arena);
+            result.m_ast = ast::deserialize(data, &result.m_description);
+            result.m_success = result.m_ast.has_value();
+            result.m_fromCache = result.m_success;
+            result.m_bytes = size;
+            result.m_text = std::string_view(source->begin(), size);
+            result.m_source = std::make_shared<std::pair<std::shared_ptr<mapped_input>, std::shared_ptr<mapped_input>>>(source, std::move(cached));
+        }
+        catch (const std::exception&) {
+            // an entry removed or truncated under us is just a miss
+            result.m_success = false;
+        }
+        return result;
+    }
+
+    void Store(const std::filesystem::path& entry, const std::string& data) const
+    {
+        auto temp = temporary_path(entry);
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            out.write(data.data(), static_cast<std::streamsize>(data.size()));
+            if (!out) {
+                out.close();
+                std::error_code ec;
+                std::filesystem::remove(temp, ec);
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp, entry, ec);
+        if (ec) {
+            std::filesystem::remove(temp, ec);
+        }
+    }
+
+    std::filesystem::path m_dir;
+};
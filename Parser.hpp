@@ -0,0 +1,215 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tao/pegtl.hpp"
+#include "Grammar.hpp"
+#include "Arena.hpp"
+#include "AST.hpp"
+#include "ASTBuilder.hpp"
+#include "Diagnostics.hpp"
+#include "ParserActions.hpp"
+
+// The inputs the parser runs on. They track positions lazily, so consuming text only moves a pointer; with eager
+// tracking every byte skipped in one step by the trivia scanner would be walked again to count lines. The line and
+// column of a position would be worked out from the start of the text on request; diagnostics record byte offsets
+// instead and leave lines and columns to the LineIndex they are printed with.
+using text_input = peg::memory_input<peg::tracking_mode::lazy>;
+using mapped_input = peg::mmap_input<peg::tracking_mode::lazy>;
+
+template <typename rule>
+struct complete : peg::seq<rule, peg::eof> {};
+
+// Like complete, but any failure raises a syntax_error, at the first character after the longest prefix
+// that still parses when the rule itself matched.
+template <typename rule>
+struct complete_or_raise : peg::must<rule, peg::eof> {};
+
+struct ExpressionReceiver : ast::BaseBuilder
+{
+    void Node(ast::Expression&& expr)
+    {
+        result.emplace(std::move(expr));
+    }
+
+    void Node(ast::Description&& desc)
+    {
+        description = std::move(desc);
+    }
+
+    std::optional<ast::Expression> result;
+    ast::Description description;
+};
+
+// The AST nodes live in m_arena and string literals may view m_source, both declared first so that they are
+// destroyed after the tree; m_ast must not be moved out of the result and outlive it. m_text is the source text the
+// spans of the tree are offsets into. m_source keeps it alive when the result owns it, also for a tree loaded from a
+// cache entry, whose string literals view the entry instead.
+struct ParseResult
+{
+    std::shared_ptr<const void> m_source;
+    std::string_view m_text;
+    std::unique_ptr<ast::Arena> m_arena = std::make_unique<ast::Arena>();
+    bool m_success = false;
+    bool m_fromCache = false; // loaded from a ParseCache entry instead of parsed
+    std::optional<ast::Expression> m_ast;
+    ast::Description m_description;
+    std::vector<Diagnostic> m_diagnostics; // every error found, in the order found; empty on success
+    std::size_t m_bytes = 0;
+    std::chrono::steady_clock::duration m_time{};
+};
+
+// Runs the expression grammar with the AST builder actions over any PEGTL input. Errors do not escape as exceptions
+// but are returned as diagnostics, and the tree is only set if there are none.
+template <typename Input>
+ParseResult parse_input(Input& in)
+{
+    ParseResult result;
+    result.m_bytes = in.size();
+    result.m_text = std::string_view(in.begin(), in.size());
+    ExpressionReceiver er;
+    ast::ArenaScope scope(*result.m_arena);
+    DiagnosticScope diagnostics(result.m_diagnostics);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        peg::parse<complete_or_raise<described_expression>, ast_builder_action, modelica_control>(in, er);
+    }
+    catch (const syntax_error& e) {
+        report_diagnostic(e);
+    }
+    result.m_time = std::chrono::steady_clock::now() - start;
+    result.m_success = result.m_diagnostics.empty() && !er.Failed() && er.result.has_value();
+    if (result.m_success) {
+        result.m_ast = std::move(er.result);
+    }
+    result.m_description = std::move(er.description);
+    return result;
+}
+
+// Outcome of a syntax check: only whether the input parsed and, if not, where it failed. m_text is the text the
+// diagnostics are offsets into; check_file keeps its mapping alive in m_source only when the check failed.
+struct CheckResult
+{
+    std::shared_ptr<const void> m_source;
+    std::string_view m_text;
+    bool m_success = false;
+    std::vector<Diagnostic> m_diagnostics;
+    std::size_t m_bytes = 0;
+    std::chrono::steady_clock::duration m_time{};
+};
+
+// Runs the bare expression grammar over any PEGTL input, without actions: no builders are constructed and no
+// nodes, symbols or strings are allocated, so this runs at the speed of the PEG matcher itself.
+// Errors that are only detected while building the AST (such as out of range numbers) are not reported.
+template <typename Rule = described_expression, typename Input>
+CheckResult check_input(Input& in)
+{
+    CheckResult result;
+    result.m_bytes = in.size();
+    result.m_text = std::string_view(in.begin(), in.size());
+    DiagnosticScope diagnostics(result.m_diagnostics);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        peg::parse<complete_or_raise<Rule>, peg::nothing, modelica_control>(in);
+    }
+    catch (const syntax_error& e) {
+        report_diagnostic(e);
+    }
+    result.m_time = std::chrono::steady_clock::now() - start;
+    result.m_success = result.m_diagnostics.empty();
+    return result;
+}
+
+inline CheckResult check_file(const std::filesystem::path& path)
+{
+    auto in = std::make_shared<mapped_input>(path);
+    CheckResult result = check_input(*in);
+    if (result.m_success) {
+        result.m_text = {};
+    }
+    else {
+        result.m_source = std::move(in);
+    }
+    return result;
+}
+
+// The source text is not copied and must outlive the result.
+inline CheckResult check_string(std::string_view source, const std::string& name = "")
+{
+    text_input in(source.data(), source.size(), name);
+    return check_input(in);
+}
+
+// Parses a source file straight out of a read-only memory mapping, without copying it to the heap.
+// The mapping is kept alive by the result, since the AST refers to identifiers and string literals inside it.
+inline ParseResult parse_file(const std::filesystem::path& path)
+{
+    auto in = std::make_shared<mapped_input>(path);
+    ParseResult result = parse_input(*in);
+    result.m_source = std::move(in);
+    return result;
+}
+
+// The source text is not copied and must outlive the result.
+inline ParseResult parse_string(std::string_view source, const std::string& name = "")
+{
+    text_input in(source.data(), source.size(), name);
+    return parse_input(in);
+}
+
+struct ModificationReceiver : ast::BaseBuilder
+{
+    void Node(ast::ClassModification&& mod)
+    {
+        result.emplace(std::move(mod));
+    }
+
+    std::optional<ast::ClassModification> result;
+};
+
+// Like ParseResult, the values of the modification live in m_arena; string literals may view the source
+// the annotation was taken from, which must outlive the result. The diagnostics are offsets into m_text, the body.
+struct AnnotationResult
+{
+    std::string_view m_text;
+    std::unique_ptr<ast::Arena> m_arena = std::make_unique<ast::Arena>();
+    bool m_success = false;
+    bool m_wellFormed = false; // the body is a class modification, even if it could not be built
+    std::optional<ast::ClassModification> m_modification;
+    std::vector<Diagnostic> m_diagnostics;
+};
+
+// Builds the class modification of an annotation that the parser only delimited.
+inline AnnotationResult parse_annotation(const ast::Annotation& annotation)
+{
+    AnnotationResult result;
+    result.m_text = annotation.m_body;
+    text_input in(annotation.m_body.data(), annotation.m_body.size(), "annotation");
+    ModificationReceiver mr;
+    ast::ArenaScope scope(*result.m_arena);
+    DiagnosticScope diagnostics(result.m_diagnostics);
+    try {
+        peg::parse<complete_or_raise<class_modification>, ast_builder_action, modelica_control>(in, mr);
+    }
+    catch (const syntax_error& e) {
+        report_diagnostic(e);
+    }
+    result.m_success = result.m_diagnostics.empty() && !mr.Failed() && mr.result.has_value();
+    if (result.m_success) {
+        result.m_modification = std::move(mr.result);
+        result.m_wellFormed = true;
+    }
+    else {
+        // whether the text or only the builders are at fault: without actions only syntax errors are reported
+        text_input again(annotation.m_body.data(), annotation.m_body.size(), "annotation");
+        result.m_wellFormed = check_input<class_modification>(again).m_success;
+    }
+    return result;
+}
@@ -2,10 +2,16 @@
 
 #include <type_traits>
 #include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 #include "Grammar.hpp"
 #include "ASTBuilder.hpp"
-#include <tao/pegtl/contrib/unescape.hpp>
+#include "Diagnostics.hpp"
 
 //
 // Terminal token actions
@@ -39,14 +45,39 @@ NOTIFY_FOR_TERMINAL(SYMBOL_dot_slash);
 NOTIFY_FOR_TERMINAL(SYMBOL_pow);
 NOTIFY_FOR_TERMINAL(SYMBOL_dot_pow);
 NOTIFY_FOR_TERMINAL(KEYWORD_end);
+NOTIFY_FOR_TERMINAL(KEYWORD_der);
+NOTIFY_FOR_TERMINAL(KEYWORD_initial);
+NOTIFY_FOR_TERMINAL(KEYWORD_pure);
 NOTIFY_FOR_TERMINAL(SYMBOL_dot);
+NOTIFY_FOR_TERMINAL(KEYWORD_each);
+NOTIFY_FOR_TERMINAL(KEYWORD_final);
+
+// Byte offsets of the matched input in the whole input, without the trivia a padded rule matches before its first
+// token and the whitespace after its last. Only the offsets are taken, so this costs no more than a trivia scan.
+template <typename ActionInput>
+ast::SourceSpan source_span(const ActionInput& ai)
+{
+	const char* base = ai.input().begin();
+	const char* begin = scan::skip_trivia(ai.begin(), ai.end());
+	const char* end = ai.end();
+	while (end > begin && scan::is_space(end[-1])) {
+		--end;
+	}
+	return ast::SourceSpan{ static_cast<std::uint32_t>(begin - base), static_cast<std::uint32_t>(end - base) };
+}
 
 template <typename rule>
 struct notify_action
 {
-	template <typename builder>
-	static void apply0(builder& b)
+	template <typename ActionInput, typename builder>
+	static void apply(const ActionInput& ai, builder& b)
 	{
+		if (b.Failed()) {
+			return;
+		}
+		if constexpr (requires { b.OperatorAt(std::uint32_t{}); }) {
+			b.OperatorAt(source_span(ai).m_begin);
+		}
 		b.Terminal<rule>();
 	}
 };
@@ -60,13 +91,17 @@ template <> struct ast_builder_action<_UNSIGNED_REAL>
 	template <typename ActionInput, typename builder>
 	static void apply(const ActionInput& ai, builder& b)
 	{
+		if (b.Failed()) {
+			return;
+		}
 		double d = 0.;
 		auto res = std::from_chars(ai.begin(), ai.end(), d);
 		if (res.ec == std::errc{}) {
 			b.Real(d);
 		}
 		else {
-			throw std::exception("could not parse double");
+			report_diagnostic(source_span(ai).m_begin, "real literal out of range");
+			b.Fail();
 		}
 	}
 };
@@ -76,13 +111,17 @@ template <> struct ast_builder_action<_UNSIGNED_INTEGER>
 	template <typename ActionInput, typename builder>
 	static void apply(const ActionInput& ai, builder& b)
 	{
+		if (b.Failed()) {
+			return;
+		}
 		int i = 0;
 		auto res = std::from_chars(ai.begin(), ai.end(), i);
 		if (res.ec == std::errc{}) {
 			b.Integer(i);
 		}
 		else {
-			throw std::exception("could not parse int");
+			report_diagnostic(source_span(ai).m_begin, "integer literal out of range");
+			b.Fail();
 		}
 	}
 };
@@ -92,7 +131,9 @@ template <> struct ast_builder_action<KEYWORD_true>
 	template <typename builder>
 	static void apply0(builder& b)
 	{
-		b.Boolean(true);
+		if (!b.Failed()) {
+			b.Boolean(true);
+		}
 	}
 };
 
@@ -101,60 +142,186 @@ template <> struct ast_builder_action<KEYWORD_false>
 	template <typename builder>
 	static void apply0(builder& b)
 	{
-		b.Boolean(false);
+		if (!b.Failed()) {
+			b.Boolean(false);
+		}
 	}
 };
 
-template <> struct ast_builder_action<_S_CHAR> : peg::unescape::append_all {};
-template <> struct ast_builder_action<_ESCAPE_CHAR> : peg::unescape::unescape_c<_ESCAPE_CHAR, '\'', '"', '?', '\\', '\a', '\b', '\f', '\n', '\r', '\t', '\v'> {};
+// Resolves the escape sequences of a string literal or quoted identifier; the grammar guarantees they are well formed.
+inline std::string unescape(std::string_view escaped)
+{
+	std::string result;
+	result.reserve(escaped.size());
+	for (std::size_t i = 0; i < escaped.size(); ++i) {
+		char c = escaped[i];
+		if (c == '\\' && i + 1 < escaped.size()) {
+			c = escaped[++i];
+			switch (c) {
+			case 'a': c = '\a'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'v': c = '\v'; break;
+			default: break; // \' \" \? \\ stand for themselves
+			}
+		}
+		result.push_back(c);
+	}
+	return result;
+}
 
-template <> struct ast_builder_action<_STRING> : peg::change_states<std::string>
+// String literals and identifiers are taken from the matched input as a whole; the common case without escapes
+// is passed on as a view into the source buffer and only escaped tokens are copied.
+template <> struct ast_builder_action<_STRING>
 {
-	template<typename ActionInput, typename builder>
-	static void success(const ActionInput& ai, std::string& s, builder& b)
+	template <typename ActionInput, typename builder>
+	static void apply(const ActionInput& ai, builder& b)
 	{
-		b.String(std::move(s));
+		if (b.Failed()) {
+			return;
+		}
+		std::string_view text(ai.begin() + 1, ai.size() - 2); // strip the quotes
+		if (text.find('\\') == std::string_view::npos) {
+			b.String(ast::SourceString(text));
+		}
+		else {
+			b.String(ast::SourceString(unescape(text)));
+		}
 	}
 };
 
-template <> struct ast_builder_action<_identifier> : peg::unescape::append_all {};
-template <> struct ast_builder_action<_Q_SINGLE_QUOTE> : peg::unescape::append_all {};
-template <> struct ast_builder_action<_Q_CHAR> : peg::unescape::append_all {};
-
-template <> struct ast_builder_action<_IDENT> : peg::change_states<std::string>
+template <> struct ast_builder_action<_IDENT>
 {
 	template <typename ActionInput, typename builder>
-	static void success(const ActionInput& ai, std::string& s, builder& b)
+	static void apply(const ActionInput& ai, builder& b)
 	{
-		b.Ident(std::move(s));
+		if (b.Failed()) {
+			return;
+		}
+		std::string_view ident(ai.begin(), ai.size());
+		if (ident.find('\\') == std::string_view::npos) {
+			b.Ident(ast::intern(ident));
+		}
+		else {
+			b.Ident(ast::intern(unescape(ident)));
+		}
 	}
 };
 
 
+// Annotations are kept as source text; see parse_annotation.
+template <> struct ast_builder_action<_ANNOTATION_BODY>
+{
+	template <typename ActionInput, typename builder>
+	static void apply(const ActionInput& ai, builder& b)
+	{
+		if (!b.Failed()) {
+			b.AnnotationBody(std::string_view(ai.begin(), ai.size()));
+		}
+	}
+};
+
 
 //
 // Nonterminal rule actions
 //
 
-template <typename new_builder>
+// Rules whose builders produce expression nodes, as recorded for incremental reparsing.
+enum class RegionRule : std::uint8_t
+{
+	IfExpression,
+	SimpleExpression,
+	Primary,
+};
+
+template <typename rule>
+struct region_rule;
+
+template <> struct region_rule<if_expression> : std::integral_constant<RegionRule, RegionRule::IfExpression> {};
+template <> struct region_rule<simple_expression> : std::integral_constant<RegionRule, RegionRule::SimpleExpression> {};
+template <> struct region_rule<primary> : std::integral_constant<RegionRule, RegionRule::Primary> {};
+
+// The input matched by a rule and the node its builder produced.
+struct ParsedRegion
+{
+	const char* m_begin;
+	const char* m_end;
+	RegionRule m_rule;
+	const void* m_node;
+};
+
+// Records a ParsedRegion for every expression node built on the current thread while the scope is active; nothing
+// is recorded by ordinary parses.
+class RegionScope
+{
+public:
+	explicit RegionScope(std::vector<ParsedRegion>& regions)
+		: m_previous(s_current)
+	{
+		s_current = &regions;
+	}
+
+	~RegionScope()
+	{
+		s_current = m_previous;
+	}
+
+	RegionScope(const RegionScope& other) = delete;
+	RegionScope& operator=(const RegionScope& other) = delete;
+
+	static std::vector<ParsedRegion>* Current()
+	{
+		return s_current;
+	}
+
+private:
+	std::vector<ParsedRegion>* m_previous;
+
+	inline static thread_local std::vector<ParsedRegion>* s_current = nullptr;
+};
+
+// A rule with a builder hands the built node to the enclosing builder, with the span of the rule's input if it is an
+// expression. If the builder failed, its error is reported at the start of the rule and the enclosing builder fails
+// as well, without a diagnostic of its own.
+template <typename rule, typename new_builder>
 struct builder_action : peg::change_states<new_builder>
 {
 	template <typename ActionInput, typename old_builder>
 	static void success(const ActionInput& ai, new_builder& nb, old_builder& ob)
 	{
-		ob.Node(nb.Build());
+		if (ob.Failed()) {
+			return;
+		}
+		auto node = nb.Failed() ? std::nullopt : nb.Build();
+		if (node.has_value()) {
+			if constexpr (std::is_same_v<typename decltype(node)::value_type, ast::Expression>) {
+				node->m_span = source_span(ai);
+			}
+			if constexpr (requires { region_rule<rule>::value; }) {
+				if (auto* regions = RegionScope::Current()) {
+					const void* address = std::visit([](auto& p) -> const void* { return p.get(); }, node->m_expr);
+					regions->push_back(ParsedRegion{ ai.begin(), ai.end(), region_rule<rule>::value, address });
+				}
+			}
+			ob.Node(std::move(node.value()));
+			return;
+		}
+		if (nb.Error() != nullptr) {
+			report_diagnostic(source_span(ai).m_begin, nb.Error());
+		}
+		ob.Fail();
 	}
 };
 
-#define BUILDER_FOR_RULE(rule, builder) template <> struct ast_builder_action< rule > : builder_action< builder > {}
+#define BUILDER_FOR_RULE(rule, builder) template <> struct ast_builder_action< rule > : builder_action< rule, builder > {}
 BUILDER_FOR_RULE(if_expression, ast::IfExpressionBuilder);
-BUILDER_FOR_RULE(expression, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(logical_expression, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(logical_term, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(logical_factor, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(relation, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(arithmetic_expression, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(term, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(factor, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(primary, ast::ExpressionBuilder);
-BUILDER_FOR_RULE(component_reference, ast::ComponentReferenceBuilder);
\ No newline at end of file
+BUILDER_FOR_RULE(simple_expression, ast::ExpressionBuilder);
+BUILDER_FOR_RULE(primary, ast::PrimaryBuilder);
+BUILDER_FOR_RULE(function_call_args, ast::FunctionArgumentsBuilder);
+BUILDER_FOR_RULE(component_reference, ast::ComponentReferenceBuilder);
+BUILDER_FOR_RULE(description, ast::DescriptionBuilder);
+BUILDER_FOR_RULE(element_modification, ast::ElementModificationBuilder);
+BUILDER_FOR_RULE(class_modification, ast::ClassModificationBuilder);
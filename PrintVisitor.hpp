@@ -1,184 +1,169 @@
 #pragma once
 
+#include <cstddef>
 #include <iostream>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
 #include "AST.hpp"
 #include "ASTVisitor.hpp"
 
-template <> struct ast::visitor<ast::IfExpressionPtr, std::ostream>
+// Prints the tree with walk(), so that deep trees do not take a call frame per level; the separators between the
+// children of a node are decided from a stack of the nodes above.
+template <> struct ast::visitor<ast::Expression, std::ostream>
 {
-    static void visit(const IfExpressionPtr& e, std::ostream& out);
+    static void visit(const Expression& e, std::ostream& out);
 };
 
-template <> struct ast::visitor<ast::UnaryOpExpressionPtr, std::ostream>
-{
-    static void visit(const UnaryOpExpressionPtr& e, std::ostream& out);
-};
-
-template <> struct ast::visitor<ast::BinaryOpExpressionPtr, std::ostream>
-{
-    static void visit(const BinaryOpExpressionPtr& e, std::ostream& out);
-};
-
-template <> struct ast::visitor<ast::FunctionCallExpressionPtr, std::ostream>
-{
-    static void visit(const FunctionCallExpressionPtr& e, std::ostream& out);
-};
-
-template <> struct ast::visitor<ast::LiteralExpressionPtr, std::ostream>
-{
-    static void visit(const LiteralExpressionPtr& e, std::ostream& out);
-};
-
-template <> struct ast::visitor<ast::ArrayRangeExpressionPtr, std::ostream>
-{
-    static void visit(const ArrayRangeExpressionPtr& e, std::ostream& out);
-};
-
-inline void ast::visitor<ast::IfExpressionPtr, std::ostream>::visit(const IfExpressionPtr& e, std::ostream& out)
-{
-    out << "If(";
-    AST_VISIT(e->m_condition, out);
-    out << ", ";
-    AST_VISIT(e->m_then, out);
-    out << ", ";
-    AST_VISIT(e->m_else, out);
-    out << ")";
-}
+namespace ast {
 
-inline void ast::visitor<ast::UnaryOpExpressionPtr, std::ostream>::visit(const UnaryOpExpressionPtr& e, std::ostream& out)
-{
-    out << "UnaryOp(";
-    switch (e->m_op) {
-    case ast::UnaryOp::Not:
-        out << "!";
-        break;
-    case ast::UnaryOp::Plus:
-        out << "+";
-        break;
-    case ast::UnaryOp::Minus:
-        out << "-";
-        break;
-    case ast::UnaryOp::DotPlus:
-        out << ".+";
-        break;
-    case ast::UnaryOp::DotMinus:
-        out << ".-";
-        break;
+    // Prints the reference in source form, e.g. .a.b[Literal(1), :].c
+    inline std::ostream& operator<<(std::ostream& out, const ComponentReference& ref)
+    {
+        ReferenceCursor cursor(ref);
+        auto text = [&out](std::string_view s) { out << s; };
+        while (cursor.Advance(text, text)) {
+            AST_VISIT(cursor.Subscript(), out);
+        }
+        return out;
     }
-    out << ", ";
-    AST_VISIT(e->m_operand, out);
-    out << ")";
-}
 
-inline void ast::visitor<ast::BinaryOpExpressionPtr, std::ostream>::visit(const BinaryOpExpressionPtr& e, std::ostream& out)
-{
-    out << "BinaryOp(";
-    switch (e->m_op) {
-    case ast::BinaryOp::Or:
-        out << "or";
-        break;
-    case ast::BinaryOp::And:
-        out << "and";
-        break;
-    case ast::BinaryOp::Less:
-        out << "<";
-        break;
-    case ast::BinaryOp::LessEqual:
-        out << "<=";
-        break;
-    case ast::BinaryOp::Greater:
-        out << ">";
-        break;
-    case ast::BinaryOp::GreaterEqual:
-        out << ">=";
-        break;
-    case ast::BinaryOp::Equal:
-        out << "==";
-        break;
-    case ast::BinaryOp::NotEqual:
-        out << "<>";
-        break;
-    case ast::BinaryOp::Add:
-        out << "+";
-        break;
-    case ast::BinaryOp::Sub:
-        out << "-";
-        break;
-    case ast::BinaryOp::AddElemWise:
-        out << ".+";
-        break;
-    case ast::BinaryOp::SubElemWise:
-        out << ".-";
-        break;
-    case ast::BinaryOp::Mul:
-        out << "*";
-        break;
-    case ast::BinaryOp::Div:
-        out << "/";
-        break;
-    case ast::BinaryOp::MulElemWise:
-        out << ".*";
-        break;
-    case ast::BinaryOp::DivElemWise:
-        out << "./";
-        break;
-    case ast::BinaryOp::Pow:
-        out << "^";
-        break;
-    case ast::BinaryOp::PowElemWise:
-        out << ".^";
-        break;
+    inline const char* print_token(UnaryOp op)
+    {
+        switch (op) {
+        case ast::UnaryOp::Not:
+            return "!";
+        case ast::UnaryOp::Plus:
+            return "+";
+        case ast::UnaryOp::Minus:
+            return "-";
+        case ast::UnaryOp::DotPlus:
+            return ".+";
+        case ast::UnaryOp::DotMinus:
+            return ".-";
+        }
+        return "";
     }
-    out << ", ";
-    AST_VISIT(e->m_left, out);
-    out << ", ";
-    AST_VISIT(e->m_right, out);
-    out << ")";
-}
 
-inline void ast::visitor<ast::FunctionCallExpressionPtr, std::ostream>::visit(const FunctionCallExpressionPtr& e, std::ostream& out)
-{
-    out << "FunctionCall(" << e->m_functionName;
-    for (auto& expr : e->m_arguments) {
-        out << ", ";
-        AST_VISIT(expr, out);
+    inline const char* print_token(BinaryOp op)
+    {
+        switch (op) {
+        case ast::BinaryOp::Or:
+            return "or";
+        case ast::BinaryOp::And:
+            return "and";
+        case ast::BinaryOp::Less:
+            return "<";
+        case ast::BinaryOp::LessEqual:
+            return "<=";
+        case ast::BinaryOp::Greater:
+            return ">";
+        case ast::BinaryOp::GreaterEqual:
+            return ">=";
+        case ast::BinaryOp::Equal:
+            return "==";
+        case ast::BinaryOp::NotEqual:
+            return "<>";
+        case ast::BinaryOp::Add:
+            return "+";
+        case ast::BinaryOp::Sub:
+            return "-";
+        case ast::BinaryOp::AddElemWise:
+            return ".+";
+        case ast::BinaryOp::SubElemWise:
+            return ".-";
+        case ast::BinaryOp::Mul:
+            return "*";
+        case ast::BinaryOp::Div:
+            return "/";
+        case ast::BinaryOp::MulElemWise:
+            return ".*";
+        case ast::BinaryOp::DivElemWise:
+            return "./";
+        case ast::BinaryOp::Pow:
+            return "^";
+        case ast::BinaryOp::PowElemWise:
+            return ".^";
+        }
+        return "";
     }
-    out << ")";
-}
 
-inline void ast::visitor<ast::LiteralExpressionPtr, std::ostream>::visit(const LiteralExpressionPtr& e, std::ostream& out)
-{
-    out << "Literal(";
-    switch (e->m_type) {
-    case ast::LiteralType::Real:
-        out << std::get<double>(e->m_value);
-        break;
-    case ast::LiteralType::Integer:
-        out << std::get<int>(e->m_value);
-        break;
-    case ast::LiteralType::Boolean:
-        out << (std::get<bool>(e->m_value) ? "true" : "false");
-        break;
-    case ast::LiteralType::String:
-        out << std::get<std::string>(e->m_value);
-        break;
-    case ast::LiteralType::IndexEnd:
-        out << "end";
-        break;
-    }
-    out << ")";
 }
 
-inline void ast::visitor<ast::ArrayRangeExpressionPtr, std::ostream>::visit(const ArrayRangeExpressionPtr& e, std::ostream& out)
+inline void ast::visitor<ast::Expression, std::ostream>::visit(const Expression& root, std::ostream& out)
 {
-    out << "ArrayRange(";
-    AST_VISIT(e->m_start, out);
-    out << ", ";
-    if (e->m_step.has_value()) {
-        AST_VISIT(e->m_step.value(), out);
-        out << ", ";
-    }
-    AST_VISIT(e->m_stop, out);
-    out << ")";
+    struct Frame
+    {
+        std::size_t m_children = 0;
+        // the reference of a call or component while it is printed around its subscripts
+        std::optional<ReferenceCursor> m_reference;
+    };
+    std::vector<Frame> stack;
+    auto text = [&out](std::string_view s) { out << s; };
+    walk(root, [&](const Expression& e) {
+        if (!stack.empty()) {
+            Frame& parent = stack.back();
+            if (!parent.m_reference.has_value() || !parent.m_reference->Advance(text, text)) {
+                if (parent.m_reference.has_value() || parent.m_children > 0) {
+                    out << ", ";
+                }
+                parent.m_reference.reset();
+            }
+            ++parent.m_children;
+        }
+        Frame& frame = stack.emplace_back();
+        std::visit([&](auto& node) {
+            using Node = typename std::remove_cvref_t<decltype(node)>::element_type;
+            if constexpr (std::is_same_v<Node, IfExpression>) {
+                out << "If(";
+            }
+            else if constexpr (std::is_same_v<Node, UnaryOpExpression>) {
+                out << "UnaryOp(" << print_token(node->m_op) << ", ";
+            }
+            else if constexpr (std::is_same_v<Node, BinaryOpExpression>) {
+                out << "BinaryOp(" << print_token(node->m_op) << ", ";
+            }
+            else if constexpr (std::is_same_v<Node, FunctionCallExpression>) {
+                out << "FunctionCall(";
+                frame.m_reference.emplace(node->m_functionName);
+            }
+            else if constexpr (std::is_same_v<Node, LiteralExpression>) {
+                out << "Literal(";
+                switch (node->m_type) {
+                case ast::LiteralType::Real:
+                    out << std::get<double>(node->m_value);
+                    break;
+                case ast::LiteralType::Integer:
+                    out << std::get<int>(node->m_value);
+                    break;
+                case ast::LiteralType::Boolean:
+                    out << (std::get<bool>(node->m_value) ? "true" : "false");
+                    break;
+                case ast::LiteralType::String:
+                    out << std::get<ast::SourceString>(node->m_value).View();
+                    break;
+                case ast::LiteralType::IndexEnd:
+                    out << "end";
+                    break;
+                }
+            }
+            else if constexpr (std::is_same_v<Node, ArrayRangeExpression>) {
+                out << "ArrayRange(";
+            }
+            else if constexpr (std::is_same_v<Node, ComponentExpression>) {
+                out << "Component(";
+                frame.m_reference.emplace(node->m_componentRef);
+            }
+        }, e.m_expr);
+    }, [&](const Expression&) {
+        Frame& frame = stack.back();
+        if (frame.m_reference.has_value()) {
+            frame.m_reference->Advance(text, text);
+        }
+        out << ")";
+        stack.pop_back();
+    });
 }
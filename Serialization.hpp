@@ -0,0 +1,596 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "AST.hpp"
+#include "ASTVisitor.hpp"
+
+// Compact binary encoding of expression trees.
+//
+//   header   magic "MMAS", u32 format version, u64 source hash, u64 source size, u32 symbol count, u32 node count
+//   symbols  per symbol: varint length, bytes
+//   nodes    one record per node in preorder, children following their parent in for_each_child order
+//   trailer  byte: bit 0 set if a description string follows, bit 1 if an annotation body follows; each as
+//            varint length + bytes
+//
+// Integers are little endian, counts and symbol indices LEB128 varints, and symbols are numbered locally in order of
+// first use. A record starts with the source span of the node, as the zigzag varint difference of its begin from the
+// begin of the previous record and a varint length; in preorder the difference is rarely more than a byte.
+// Then follows a tag byte and:
+//   If            -
+//   UnaryOp       op byte
+//   BinaryOp      op byte
+//   FunctionCall  reference, varint argument count
+//   Literal       type byte, then f64 bits / i32 / bool byte / varint length + bytes / nothing for 'end'
+//   ArrayRange    byte: has step
+//   Component     reference
+// and a reference is a global byte, a varint part count, and per part a varint symbol, a varint subscript count and
+// one byte per subscript telling whether it is an expression (which then follows as a child) or ':'.
+namespace ast {
+
+    inline constexpr std::uint32_t SerializationVersion = 3;
+
+    struct SerializedHeader
+    {
+        std::uint32_t m_version = SerializationVersion;
+        std::uint64_t m_sourceHash = 0;
+        std::uint64_t m_sourceSize = 0;
+        std::uint32_t m_symbolCount = 0;
+        std::uint32_t m_nodeCount = 0;
+    };
+
+    namespace serialization {
+
+        inline constexpr char Magic[4] = { 'M', 'M', 'A', 'S' };
+        inline constexpr std::size_t HeaderSize = 4 + 4 + 8 + 8 + 4 + 4;
+
+        enum class Tag : std::uint8_t
+        {
+            If,
+            UnaryOp,
+            BinaryOp,
+            FunctionCall,
+            Literal,
+            ArrayRange,
+            Component,
+        };
+
+        class Writer
+        {
+        public:
+            void U8(std::uint8_t v)
+            {
+                m_out.push_back(static_cast<char>(v));
+            }
+
+            void Fixed(std::uint64_t v, int bytes)
+            {
+                for (int i = 0; i < bytes; ++i) {
+                    U8(static_cast<std::uint8_t>(v >> (8 * i)));
+                }
+            }
+
+            void Varint(std::uint64_t v)
+            {
+                while (v >= 0x80) {
+                    U8(static_cast<std::uint8_t>(v | 0x80));
+                    v >>= 7;
+                }
+                U8(static_cast<std::uint8_t>(v));
+            }
+
+            void Bytes(std::string_view text)
+            {
+                Varint(text.size());
+                m_out.append(text);
+            }
+
+            std::string m_out;
+        };
+
+        // Bounds-checked reader; once a read runs past the end everything reads as zero and Ok() turns false.
+        class Reader
+        {
+        public:
+            explicit Reader(std::string_view data)
+                : m_data(data) {}
+
+            std::uint8_t U8()
+            {
+                if (m_pos >= m_data.size()) {
+                    m_ok = false;
+                    return 0;
+                }
+                return static_cast<std::uint8_t>(m_data[m_pos++]);
+            }
+
+            std::uint64_t Fixed(int bytes)
+            {
+                std::uint64_t v = 0;
+                for (int i = 0; i < bytes; ++i) {
+                    v |= static_cast<std::uint64_t>(U8()) << (8 * i);
+                }
+                return v;
+            }
+
+            std::uint64_t Varint()
+            {
+                std::uint64_t v = 0;
+                for (int shift = 0; shift < 64; shift += 7) {
+                    std::uint8_t b = U8();
+                    v |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+                    if ((b & 0x80) == 0) {
+                        return v;
+                    }
+                }
+                m_ok = false;
+                return 0;
+            }
+
+            std::string_view Bytes()
+            {
+                std::uint64_t size = Varint();
+                if (size > m_data.size() - m_pos) {
+                    m_ok = false;
+                    return {};
+                }
+                std::string_view text = m_data.substr(m_pos, static_cast<std::size_t>(size));
+                m_pos += static_cast<std::size_t>(size);
+                return text;
+            }
+
+            bool Ok() const
+            {
+                return m_ok;
+            }
+
+            bool AtEnd() const
+            {
+                return m_pos == m_data.size();
+            }
+
+        private:
+            std::string_view m_data;
+            std::size_t m_pos = 0;
+            bool m_ok = true;
+        };
+
+        class TreeEncoder
+        {
+        public:
+            void Encode(const Expression& root)
+            {
+                walk_pre(root, [this](const Expression& e) {
+                    ++m_nodes;
+                    Span(e.m_span);
+                    std::visit([this](auto& node) { Record(*node); }, e.m_expr);
+                });
+            }
+
+            std::string Finish(const Description& description, std::uint64_t sourceHash, std::uint64_t sourceSize)
+            {
+                Writer out;
+                out.m_out.append(Magic, sizeof(Magic));
+                out.Fixed(SerializationVersion, 4);
+                out.Fixed(sourceHash, 8);
+                out.Fixed(sourceSize, 8);
+                out.Fixed(m_symbols.size(), 4);
+                out.Fixed(m_nodes, 4);
+                for (Symbol sym : m_symbols) {
+                    out.Bytes(name_of(sym));
+                }
+                out.m_out.append(m_body.m_out);
+                out.U8(static_cast<std::uint8_t>(description.m_text.has_value() | description.m_annotation.has_value() << 1));
+                if (description.m_text.has_value()) {
+                    out.Bytes(description.m_text->View());
+                }
+                if (description.m_annotation.has_value()) {
+                    out.Bytes(description.m_annotation->m_body);
+                }
+                return std::move(out.m_out);
+            }
+
+        private:
+            void Span(SourceSpan span)
+            {
+                std::int64_t difference = static_cast<std::int64_t>(span.m_begin) - static_cast<std::int64_t>(m_lastBegin);
+                m_body.Varint((static_cast<std::uint64_t>(difference) << 1) ^ static_cast<std::uint64_t>(difference >> 63));
+                m_body.Varint(span.m_end - span.m_begin);
+                m_lastBegin = span.m_begin;
+            }
+
+            void Reference(const ComponentReference& ref)
+            {
+                m_body.U8(ref.m_global);
+                m_body.Varint(ref.Size());
+                for (std::size_t i = 0; i < ref.Size(); ++i) {
+                    auto [it, added] = m_localIds.try_emplace(ref.Name(i), static_cast<std::uint32_t>(m_symbols.size()));
+                    if (added) {
+                        m_symbols.push_back(ref.Name(i));
+                    }
+                    m_body.Varint(it->second);
+                    auto subscripts = ref.Subscripts(i);
+                    m_body.Varint(subscripts.size());
+                    for (auto& s : subscripts) {
+                        m_body.U8(s.m_subscript.has_value());
+                    }
+                }
+            }
+
+            void Record(const IfExpression&)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::If));
+            }
+
+            void Record(const UnaryOpExpression& e)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::UnaryOp));
+                m_body.U8(static_cast<std::uint8_t>(e.m_op));
+            }
+
+            void Record(const BinaryOpExpression& e)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::BinaryOp));
+                m_body.U8(static_cast<std::uint8_t>(e.m_op));
+            }
+
+            void Record(const FunctionCallExpression& e)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::FunctionCall));
+                Reference(e.m_functionName);
+                m_body.Varint(e.m_arguments.size());
+            }
+
+            void Record(const LiteralExpression& e)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::Literal));
+                m_body.U8(static_cast<std::uint8_t>(e.m_type));
+                switch (e.m_type) {
+                case LiteralType::Real:
+                    m_body.Fixed(std::bit_cast<std::uint64_t>(std::get<double>(e.m_value)), 8);
+                    break;
+                case LiteralType::Integer:
+                    m_body.Fixed(static_cast<std::uint32_t>(std::get<int>(e.m_value)), 4);
+                    break;
+                case LiteralType::Boolean:
+                    m_body.U8(std::get<bool>(e.m_value));
+                    break;
+                case LiteralType::String:
+                    m_body.Bytes(std::get<SourceString>(e.m_value).View());
+                    break;
+                case LiteralType::IndexEnd:
+                    break;
+                }
+            }
+
+            void Record(const ArrayRangeExpression& e)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::ArrayRange));
+                m_body.U8(e.m_step.has_value());
+            }
+
+            void Record(const ComponentExpression& e)
+            {
+                m_body.U8(static_cast<std::uint8_t>(Tag::Component));
+                Reference(e.m_componentRef);
+            }
+
+            Writer m_body;
+            std::vector<Symbol> m_symbols;
+            std::unordered_map<Symbol, std::uint32_t> m_localIds;
+            std::uint32_t m_nodes = 0;
+            std::uint32_t m_lastBegin = 0;
+        };
+
+        // Rebuilds the tree from its preorder records with an explicit stack: a node with children stays on the stack
+        // until they are all decoded, the finished children wait on a value stack. The shapes of pending component
+        // references are kept in shared pools that follow the same stack discipline, so decoding allocates nothing
+        // but the nodes themselves (and the vectors of calls and subscripted references).
+        class TreeDecoder
+        {
+        public:
+            TreeDecoder(Reader& in, std::vector<Symbol> symbols)
+                : m_in(in), m_symbols(std::move(symbols)) {}
+
+            std::optional<Expression> Decode()
+            {
+                do {
+                    if (!ReadRecord()) {
+                        return std::nullopt;
+                    }
+                    while (!m_frames.empty() && m_values.size() - m_frames.back().m_firstChild == m_frames.back().m_children) {
+                        Frame frame = m_frames.back();
+                        m_frames.pop_back();
+                        Expression e = Complete(frame);
+                        m_values.push_back(std::move(e));
+                    }
+                } while (!m_frames.empty());
+                if (m_values.size() != 1) {
+                    return std::nullopt;
+                }
+                return std::move(m_values.back());
+            }
+
+        private:
+            struct Part
+            {
+                Symbol m_name;
+                std::uint32_t m_firstFlag;
+                std::uint32_t m_flagCount;
+            };
+
+            struct Frame
+            {
+                Tag m_tag;
+                std::uint8_t m_op;
+                std::size_t m_children;
+                std::size_t m_firstChild;
+                SourceSpan m_span;
+                // component reference shape, as slices of m_parts and m_flags
+                bool m_global;
+                std::uint32_t m_firstPart;
+                std::uint32_t m_partCount;
+            };
+
+            // Reads the shape of a reference into the pools; returns the number of subscript expressions it has.
+            std::optional<std::size_t> ReadReference(Frame& frame)
+            {
+                frame.m_global = m_in.U8() != 0;
+                std::uint64_t parts = m_in.Varint();
+                frame.m_firstPart = static_cast<std::uint32_t>(m_parts.size());
+                frame.m_partCount = static_cast<std::uint32_t>(parts);
+                std::size_t expressions = 0;
+                for (std::uint64_t p = 0; p < parts && m_in.Ok(); ++p) {
+                    std::uint64_t sym = m_in.Varint();
+                    std::uint64_t subscripts = m_in.Varint();
+                    if (sym >= m_symbols.size()) {
+                        return std::nullopt;
+                    }
+                    m_parts.push_back(Part{ m_symbols[sym], static_cast<std::uint32_t>(m_flags.size()), static_cast<std::uint32_t>(subscripts) });
+                    for (std::uint64_t s = 0; s < subscripts && m_in.Ok(); ++s) {
+                        bool present = m_in.U8() != 0;
+                        m_flags.push_back(present);
+                        expressions += present;
+                    }
+                }
+                if (!m_in.Ok() || parts == 0) {
+                    return std::nullopt;
+                }
+                return expressions;
+            }
+
+            ComponentReference BuildReference(const Frame& frame, Expression*& child)
+            {
+                ComponentReference ref;
+                ref.m_global = frame.m_global;
+                for (std::uint32_t p = frame.m_firstPart; p < frame.m_firstPart + frame.m_partCount; ++p) {
+                    ref.Append(m_parts[p].m_name);
+                    for (std::uint32_t f = m_parts[p].m_firstFlag; f < m_parts[p].m_firstFlag + m_parts[p].m_flagCount; ++f) {
+                        ref.AddSubscript(m_flags[f] ? ArraySubscript(std::move(*child++)) : ArraySubscript{});
+                    }
+                }
+                // the shapes of references still pending lie below this one in the pools
+                m_flags.resize(m_parts[frame.m_firstPart].m_firstFlag);
+                m_parts.resize(frame.m_firstPart);
+                return ref;
+            }
+
+            // Reads one record: a leaf goes straight onto the value stack, a node with children opens a frame.
+            bool ReadRecord()
+            {
+                SourceSpan span = ReadSpan();
+                std::uint8_t tag = m_in.U8();
+                Frame frame{ static_cast<Tag>(tag), 0, 0, m_values.size(), span, false, 0, 0 };
+                switch (frame.m_tag) {
+                case Tag::If:
+                    frame.m_children = 3;
+                    break;
+                case Tag::UnaryOp:
+                    frame.m_op = m_in.U8();
+                    if (frame.m_op > static_cast<std::uint8_t>(UnaryOp::DotMinus)) {
+                        return false;
+                    }
+                    frame.m_children = 1;
+                    break;
+                case Tag::BinaryOp:
+                    frame.m_op = m_in.U8();
+                    if (frame.m_op > static_cast<std::uint8_t>(BinaryOp::PowElemWise)) {
+                        return false;
+                    }
+                    frame.m_children = 2;
+                    break;
+                case Tag::FunctionCall: {
+                    auto subscripts = ReadReference(frame);
+                    if (!subscripts.has_value()) {
+                        return false;
+                    }
+                    frame.m_children = subscripts.value() + static_cast<std::size_t>(m_in.Varint());
+                    break;
+                }
+                case Tag::Literal:
+                    if (!m_in.Ok() || !ReadLiteral()) {
+                        return false;
+                    }
+                    m_values.back().m_span = span;
+                    return true;
+                case Tag::ArrayRange:
+                    frame.m_op = m_in.U8();
+                    frame.m_children = frame.m_op != 0 ? 3 : 2;
+                    break;
+                case Tag::Component: {
+                    auto subscripts = ReadReference(frame);
+                    if (!subscripts.has_value()) {
+                        return false;
+                    }
+                    frame.m_children = subscripts.value();
+                    break;
+                }
+                default:
+                    return false;
+                }
+                if (!m_in.Ok()) {
+                    return false;
+                }
+                m_frames.push_back(frame);
+                return true;
+            }
+
+            SourceSpan ReadSpan()
+            {
+                std::uint64_t zigzag = m_in.Varint();
+                std::int64_t difference = static_cast<std::int64_t>(zigzag >> 1) ^ -static_cast<std::int64_t>(zigzag & 1);
+                std::uint32_t begin = static_cast<std::uint32_t>(m_lastBegin + difference);
+                std::uint32_t end = static_cast<std::uint32_t>(begin + m_in.Varint());
+                m_lastBegin = begin;
+                return SourceSpan{ begin, end };
+            }
+
+            bool ReadLiteral()
+            {
+                switch (static_cast<LiteralType>(m_in.U8())) {
+                case LiteralType::Real:
+                    m_values.emplace_back(make<LiteralExpression>(std::bit_cast<double>(m_in.Fixed(8))));
+                    break;
+                case LiteralType::Integer:
+                    m_values.emplace_back(make<LiteralExpression>(static_cast<int>(static_cast<std::uint32_t>(m_in.Fixed(4)))));
+                    break;
+                case LiteralType::Boolean:
+                    m_values.emplace_back(make<LiteralExpression>(m_in.U8() != 0));
+                    break;
+                case LiteralType::String:
+                    m_values.emplace_back(make<LiteralExpression>(SourceString(m_in.Bytes())));
+                    break;
+                case LiteralType::IndexEnd:
+                    m_values.emplace_back(make<LiteralExpression>());
+                    break;
+                default:
+                    return false;
+                }
+                return m_in.Ok();
+            }
+
+            Expression Complete(const Frame& frame)
+            {
+                Expression* child = m_values.data() + frame.m_firstChild;
+                auto finish = [&](Expression e) {
+                    m_values.erase(m_values.begin() + static_cast<std::ptrdiff_t>(frame.m_firstChild), m_values.end());
+                    e.m_span = frame.m_span;
+                    return e;
+                };
+                switch (frame.m_tag) {
+                case Tag::If:
+                    return finish(Expression(make<IfExpression>(std::move(child[0]), std::move(child[1]), std::move(child[2]))));
+                case Tag::UnaryOp:
+                    return finish(Expression(make<UnaryOpExpression>(static_cast<UnaryOp>(frame.m_op), std::move(child[0]))));
+                case Tag::BinaryOp:
+                    return finish(Expression(make<BinaryOpExpression>(static_cast<BinaryOp>(frame.m_op), std::move(child[0]), std::move(child[1]))));
+                case Tag::FunctionCall: {
+                    ComponentReference function = BuildReference(frame, child);
+                    std::vector<Expression> args;
+                    Expression* end = m_values.data() + m_values.size();
+                    args.reserve(static_cast<std::size_t>(end - child));
+                    for (; child != end; ++child) {
+                        args.push_back(std::move(*child));
+                    }
+                    return finish(Expression(make<FunctionCallExpression>(std::move(function), std::move(args))));
+                }
+                case Tag::ArrayRange:
+                    if (frame.m_op != 0) {
+                        return finish(Expression(make<ArrayRangeExpression>(std::move(child[0]), std::move(child[1]), std::move(child[2]))));
+                    }
+                    return finish(Expression(make<ArrayRangeExpression>(std::move(child[0]), std::move(child[1]))));
+                default:
+                    return finish(Expression(make<ComponentExpression>(BuildReference(frame, child))));
+                }
+            }
+
+            Reader& m_in;
+            std::vector<Symbol> m_symbols;
+            std::vector<Frame> m_frames;
+            std::vector<Expression> m_values;
+            std::vector<Part> m_parts;
+            std::vector<bool> m_flags;
+            std::uint32_t m_lastBegin = 0;
+        };
+
+    }
+
+    // Encodes the tree and its description; the source hash and size are stored for the parse cache to validate against.
+    inline std::string serialize(const Expression& e, const Description& description, std::uint64_t sourceHash = 0, std::uint64_t sourceSize = 0)
+    {
+        serialization::TreeEncoder encoder;
+        encoder.Encode(e);
+        return encoder.Finish(description, sourceHash, sourceSize);
+    }
+
+    inline std::string serialize(const Expression& e, std::uint64_t sourceHash = 0, std::uint64_t sourceSize = 0)
+    {
+        return serialize(e, Description{}, sourceHash, sourceSize);
+    }
+
+    inline std::optional<SerializedHeader> read_header(std::string_view data)
+    {
+        if (data.size() < serialization::HeaderSize || std::memcmp(data.data(), serialization::Magic, sizeof(serialization::Magic)) != 0) {
+            return std::nullopt;
+        }
+        serialization::Reader in(data.substr(sizeof(serialization::Magic)));
+        SerializedHeader header;
+        header.m_version = static_cast<std::uint32_t>(in.Fixed(4));
+        header.m_sourceHash = in.Fixed(8);
+        header.m_sourceSize = in.Fixed(8);
+        header.m_symbolCount = static_cast<std::uint32_t>(in.Fixed(4));
+        header.m_nodeCount = static_cast<std::uint32_t>(in.Fixed(4));
+        return header;
+    }
+
+    // Decodes a tree written by serialize() into the current arena, or returns nothing if the data is malformed or
+    // of another format version. String literals and the description are views into data, which must outlive the tree.
+    inline std::optional<Expression> deserialize(std::string_view data, Description* description = nullptr)
+    {
+        auto header = read_header(data);
+        if (!header.has_value() || header->m_version != SerializationVersion) {
+            return std::nullopt;
+        }
+        serialization::Reader in(data.substr(serialization::HeaderSize));
+        std::vector<Symbol> symbols;
+        symbols.reserve(std::min<std::size_t>(header->m_symbolCount, data.size())); // a corrupt count must not allocate
+        for (std::uint32_t i = 0; i < header->m_symbolCount && in.Ok(); ++i) {
+            symbols.push_back(intern(in.Bytes()));
+        }
+        if (!in.Ok()) {
+            return std::nullopt;
+        }
+        serialization::TreeDecoder decoder(in, std::move(symbols));
+        auto tree = decoder.Decode();
+        if (!tree.has_value()) {
+            return std::nullopt;
+        }
+        std::uint8_t present = in.U8();
+        Description decoded;
+        if (present & 1) {
+            decoded.m_text.emplace(in.Bytes());
+        }
+        if (present & 2) {
+            decoded.m_annotation.emplace(Annotation{ in.Bytes() });
+        }
+        if (!in.Ok() || !in.AtEnd() || present > 3) {
+            return std::nullopt;
+        }
+        if (description != nullptr) {
+            *description = std::move(decoded);
+        }
+        return tree;
+    }
+
+}
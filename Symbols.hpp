@@ -0,0 +1,105 @@
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace ast {
+
+    // Interned identifier: equal names have equal ids, so comparison and hashing are O(1).
+    struct Symbol
+    {
+        std::uint32_t m_id;
+
+        friend bool operator==(Symbol a, Symbol b) = default;
+        friend auto operator<=>(Symbol a, Symbol b) = default;
+    };
+
+    // Process-wide, thread-safe identifier table. Interned names are never freed, so the views
+    // returned by Name() stay valid for the rest of the program.
+    class SymbolTable
+    {
+    public:
+        static SymbolTable& Global()
+        {
+            static SymbolTable table;
+            return table;
+        }
+
+        Symbol Intern(std::string_view name)
+        {
+            // per-thread cache in front of the shared table keeps concurrent parses off the lock for names seen before
+            thread_local std::unordered_map<std::string_view, Symbol> cache;
+            if (auto it = cache.find(name); it != cache.end()) {
+                return it->second;
+            }
+            Symbol sym = InternShared(name);
+            cache.emplace(Name(sym), sym);
+            return sym;
+        }
+
+        std::string_view Name(Symbol sym) const
+        {
+            std::shared_lock lock(m_mutex);
+            return m_names[sym.m_id];
+        }
+
+        std::size_t Size() const
+        {
+            std::shared_lock lock(m_mutex);
+            return m_names.size();
+        }
+
+    private:
+        SymbolTable() = default;
+
+        Symbol InternShared(std::string_view name)
+        {
+            {
+                std::shared_lock lock(m_mutex);
+                if (auto it = m_ids.find(name); it != m_ids.end()) {
+                    return it->second;
+                }
+            }
+            std::unique_lock lock(m_mutex);
+            if (auto it = m_ids.find(name); it != m_ids.end()) {
+                return it->second;
+            }
+            Symbol sym{ static_cast<std::uint32_t>(m_names.size()) };
+            // deque never relocates its elements, so the stored string (and the key viewing it) stays put
+            const std::string& stored = m_names.emplace_back(name);
+            m_ids.emplace(stored, sym);
+            return sym;
+        }
+
+        mutable std::shared_mutex m_mutex;
+        std::deque<std::string> m_names;
+        std::unordered_map<std::string_view, Symbol> m_ids;
+    };
+
+    inline Symbol intern(std::string_view name)
+    {
+        return SymbolTable::Global().Intern(name);
+    }
+
+    inline std::string_view name_of(Symbol sym)
+    {
+        return SymbolTable::Global().Name(sym);
+    }
+
+}
+
+template <> struct std::hash<ast::Symbol>
+{
+    std::size_t operator()(ast::Symbol sym) const noexcept
+    {
+        return std::hash<std::uint32_t>{}(sym.m_id);
+    }
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MINIMODELICA_SSE2 1
+#endif
+
+// Block scanning kernels for whitespace and comments between tokens, and for skipping parenthesised text unparsed.
+namespace scan {
+
+    // the characters matched by peg::space
+    inline bool is_space(char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    // Returns the first character in [p, end) that is not whitespace.
+    inline const char* skip_whitespace(const char* p, const char* end)
+    {
+        // most runs between tokens are a single blank, so check the first character before setting up the vector loop
+        if (p == end || !is_space(*p)) {
+            return p;
+        }
+        ++p;
+#ifdef MINIMODELICA_SSE2
+        const __m128i blank = _mm_set1_epi8(' ');
+        const __m128i low = _mm_set1_epi8('\t');
+        const __m128i high = _mm_set1_epi8('\r');
+        while (end - p >= 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            // '\t' .. '\r' is a contiguous range; compare unsigned via min/max
+            __m128i inRange = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(chunk, low), chunk), _mm_cmpeq_epi8(_mm_min_epu8(chunk, high), chunk));
+            __m128i space = _mm_or_si128(inRange, _mm_cmpeq_epi8(chunk, blank));
+            unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(space)) & 0xFFFFu;
+            if (mask != 0) {
+                return p + std::countr_zero(mask);
+            }
+            p += 16;
+        }
+#endif
+        while (p != end && is_space(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    // Returns the start of the "*/" closing a block comment whose body starts at p, or nullptr if it is unterminated.
+    inline const char* find_comment_end(const char* p, const char* end)
+    {
+        while (end - p >= 2) {
+            auto star = static_cast<const char*>(std::memchr(p, '*', static_cast<std::size_t>(end - p - 1)));
+            if (star == nullptr) {
+                return nullptr;
+            }
+            if (star[1] == '/') {
+                return star;
+            }
+            p = star + 1;
+        }
+        return nullptr;
+    }
+
+    // Returns the end of the maximal run of whitespace, line comments and block comments starting at p.
+    // Accepts exactly what peg::star<modelica_space> accepts: a line comment runs up to and including the next
+    // line feed (or to the end of input), and an unterminated block comment is not trivia at all.
+    inline const char* skip_trivia(const char* p, const char* end)
+    {
+        for (;;) {
+            p = skip_whitespace(p, end);
+            if (end - p < 2 || p[0] != '/') {
+                return p;
+            }
+            if (p[1] == '/') {
+                auto lf = static_cast<const char*>(std::memchr(p + 2, '\n', static_cast<std::size_t>(end - p - 2)));
+                p = lf != nullptr ? lf + 1 : end;
+            }
+            else if (p[1] == '*') {
+                const char* close = find_comment_end(p + 2, end);
+                if (close == nullptr) {
+                    return p;
+                }
+                p = close + 2;
+            }
+            else {
+                return p;
+            }
+        }
+    }
+
+    // Returns the end of the quoted token (string literal or quoted identifier) whose opening quote is at p, or nullptr if
+    // it is unterminated. A backslash escapes the next character.
+    inline const char* skip_quoted(const char* p, const char* end)
+    {
+        const char quote = *p++;
+        while (p != end) {
+            if (*p == quote) {
+                return p + 1;
+            }
+            p += *p == '\\' && end - p >= 2 ? 2 : 1;
+        }
+        return nullptr;
+    }
+
+    inline bool is_bracket_or_quote(char c)
+    {
+        return c == '(' || c == ')' || c == '"' || c == '\'' || c == '/';
+    }
+
+    // Returns the first character in [p, end) that can open or close a parenthesis, a quoted token or a comment.
+    inline const char* find_bracket_or_quote(const char* p, const char* end)
+    {
+#ifdef MINIMODELICA_SSE2
+        const __m128i open = _mm_set1_epi8('(');
+        const __m128i close = _mm_set1_epi8(')');
+        const __m128i dquote = _mm_set1_epi8('"');
+        const __m128i squote = _mm_set1_epi8('\'');
+        const __m128i slash = _mm_set1_epi8('/');
+        while (end - p >= 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, open), _mm_cmpeq_epi8(chunk, close)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, dquote), _mm_cmpeq_epi8(chunk, squote)), _mm_cmpeq_epi8(chunk, slash)));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+            if (mask != 0) {
+                return p + std::countr_zero(mask);
+            }
+            p += 16;
+        }
+#endif
+        while (p != end && !is_bracket_or_quote(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    // Returns the end of the parenthesised text whose '(' is at p, or nullptr if the parentheses are unbalanced.
+    // Only parentheses are counted, so the text is delimited without being tokenized; parentheses inside string
+    // literals, quoted identifiers and comments are skipped.
+    inline const char* skip_balanced(const char* p, const char* end)
+    {
+        if (p == end || *p != '(') {
+            return nullptr;
+        }
+        std::size_t depth = 0;
+        while (p != end) {
+            switch (*p) {
+            case '(':
+                ++depth;
+                ++p;
+                break;
+            case ')':
+                ++p;
+                if (--depth == 0) {
+                    return p;
+                }
+                break;
+            case '"':
+            case '\'':
+                p = skip_quoted(p, end);
+                if (p == nullptr) {
+                    return nullptr;
+                }
+                break;
+            case '/':
+                if (end - p >= 2 && p[1] == '*') {
+                    const char* close = find_comment_end(p + 2, end);
+                    if (close == nullptr) {
+                        return nullptr;
+                    }
+                    p = close + 2;
+                }
+                else if (end - p >= 2 && p[1] == '/') {
+                    auto lf = static_cast<const char*>(std::memchr(p + 2, '\n', static_cast<std::size_t>(end - p - 2)));
+                    p = lf != nullptr ? lf + 1 : end;
+                }
+                else {
+                    ++p;
+                }
+                break;
+            default:
+                p = find_bracket_or_quote(p + 1, end);
+                break;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns the first ',' or ';' in [p, end) outside of brackets, or the first unmatched closing bracket: where the
+    // parser resumes after a broken list element. Brackets are counted without telling them apart, and brackets inside
+    // string literals, quoted identifiers and comments are skipped.
+    inline const char* find_recovery_point(const char* p, const char* end)
+    {
+        std::size_t depth = 0;
+        while (p != end) {
+            switch (*p) {
+            case '(':
+            case '[':
+            case '{':
+                ++depth;
+                ++p;
+                break;
+            case ')':
+            case ']':
+            case '}':
+                if (depth == 0) {
+                    return p;
+                }
+                --depth;
+                ++p;
+                break;
+            case ',':
+            case ';':
+                if (depth == 0) {
+                    return p;
+                }
+                ++p;
+                break;
+            case '"':
+            case '\'':
+                p = skip_quoted(p, end);
+                if (p == nullptr) {
+                    return end;
+                }
+                break;
+            case '/':
+                if (end - p >= 2 && (p[1] == '/' || p[1] == '*')) {
+                    const char* q = skip_trivia(p, end);
+                    p = q != p ? q : end; // an unterminated block comment runs to the end
+                }
+                else {
+                    ++p;
+                }
+                break;
+            default:
+                ++p;
+                break;
+            }
+        }
+        return end;
+    }
+
+}